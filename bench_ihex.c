@@ -0,0 +1,429 @@
+/* Intel hex check and benchmark, not part of the flasher.
+ * The library sources are included, with ihex.c, so the static decoders and
+ * kernels can be called. The records are first decoded by the SSE2 and the
+ * scalar decoder, that must agree on the data, the checksum and the bad
+ * digits, and the kernels of the definition bitmap are checked, see
+ * check_def (). Then a synthetic file of about <MB> MB (default 64), with 32
+ * data bytes per record and extended linear address records, is written by the
+ * buffered writer to a temporary file and mapped. The writer is timed writing
+ * the same records to /dev/null, then the record fields are decoded with both
+ * decoders, and the whole file is loaded with Ihex_Load (); each is timed as
+ * the best of BENCH_IHEX_RUNS runs.
+ *
+ * gcc -Wall -O2 -std=gnu99 -pthread bench_ihex.c -o bench_ihex \
+ *   `pkg-config --cflags --libs libusb-1.0` `xml2-config --cflags --libs`
+ * ./bench_ihex [MB]
+ */
+
+#include "libgmtflasher.c"
+
+#define BENCH_IHEX_RUNS			3
+#define BENCH_IHEX_BLOCK		128
+
+/* Writes a record of cnt bytes, with the checksum, at line. Returns its
+ * length.
+ */
+static int
+check_record (unsigned char *line, uint32_t seed, int cnt, int lower)
+{
+  const char    *digits = lower ? "0123456789abcdef" : "0123456789ABCDEF";
+  unsigned char  rec[4 + 255 + 1];
+  uint32_t       sum = 0;
+  int            n = 0;
+
+  rec[0] = cnt;
+  for (int i=1; i<4+cnt; i++) {
+    seed = seed*1103515245 + 12345;
+    rec[i] = seed>>16;
+  }
+  rec[3] = 0x00;
+  for (int i=0; i<4+cnt; i++)
+    sum += rec[i];
+  rec[4+cnt] = -sum;
+
+  line[n++] = ':';
+  for (int i=0; i<5+cnt; i++) {
+    line[n++] = digits[rec[i]>>4];
+    line[n++] = digits[rec[i] & 0x0F];
+  }
+  line[n] = '\n';
+  return n;
+}
+
+/* Decodes the record at line with the decoder k (1 for SSE2), as Ihex_Load ()
+ * does. Returns -1 for a bad digit, else the low byte of the checksum, 0 if
+ * right.
+ */
+static int
+check_decode (const unsigned char *line, int k, unsigned char *rec)
+{
+  int      cnt = read_next_byte (line, 1);
+  uint32_t sum = cnt;
+  int      q;
+
+  if (cnt < 0)
+    return -1;
+  if (k)
+    q = ihex_decode (line + 3, 3 + cnt + 1, rec, &sum);
+  else
+    q = ihex_decode_scalar (line + 3, 3 + cnt + 1, rec, &sum);
+  return q ? -1 : (int)(sum & 0xFF);
+}
+
+static int
+check_line (const unsigned char *line, int expect, const char *what, int cnt,
+    int pos)
+{
+  unsigned char r0[3 + 255 + 1], r1[3 + 255 + 1];
+  int           q0 = check_decode (line, 0, r0);
+  int           q1 = check_decode (line, 1, r1);
+
+  //expect is -1 for a bad digit, 1 for a bad checksum
+  if (q0 == q1 && (expect < 0 ? q0 < 0 : expect ? q0 > 0 : !q0)
+      && (q0 < 0 || !memcmp (r0, r1, 3 + cnt + 1)))
+    return 0;
+  printf ("%s record of %d bytes, position %d: scalar %d, SSE2 %d\n", what,
+      cnt, pos, q0, q1);
+  return -1;
+}
+
+/* Decodes records of every length, in upper and lower case, right, with a bad
+ * digit in each position and with a bad checksum. Returns the number of
+ * records that failed.
+ */
+static int
+check_ihex_decode (void)
+{
+  //not hex digits, next to the digit ranges and their case bit
+  static const unsigned char bad[] = "/:@G`g \r\x80\xB0\xC1";
+  unsigned char line[1 + 2*(5 + 255) + 1];
+  int           fails = 0, lines = 0;
+
+  for (int cnt=0; cnt<=255; cnt++) {
+    for (int lower=0; lower<2; lower++) {
+      int n = check_record (line, cnt*2 + lower, cnt, lower);
+
+      lines++;
+      fails += check_line (line, 0, "right", cnt, 0) ? 1 : 0;
+      for (int pos=3; pos<n; pos++) {
+        unsigned char c = line[pos];
+
+        for (int b=0; b<(int)sizeof(bad)-1; b++) {
+          line[pos] = bad[b];
+          lines++;
+          fails += check_line (line, -1, "bad digit", cnt, pos) ? 1 : 0;
+        }
+        line[pos] = c;
+      }
+      //a wrong low bit of the checksum
+      line[n-1] = (line[n-1] == '0') ? '1' : '0';
+      lines++;
+      fails += check_line (line, 1, "bad checksum", cnt, n-1) ? 1 : 0;
+    }
+  }
+#ifdef __SSE2__
+  printf ("Record decode check, scalar and SSE2: %d records, %d failed\n",
+      lines, fails);
+#else
+  printf ("Record decode check, scalar only, no SSE2: %d records, %d failed\n",
+      lines, fails);
+#endif
+  return fails;
+}
+
+/* One case of check_def (): def and ref mark the same defined bytes of a block
+ * of bs bytes. Returns -1 if a kernel disagrees with the byte by byte
+ * reference.
+ */
+static int
+check_def_case (const uint32_t *def, const unsigned char *ref, uint32_t bs,
+    const unsigned char *data, const unsigned char *uc)
+{
+  unsigned char out0[BENCH_IHEX_BLOCK], out1[BENCH_IHEX_BLOCK];
+  uint32_t      dirty = 0;
+  int           full = 1;
+
+  for (uint32_t j=0; j<bs; j++) {
+    if (Ihex_Def_Get (def, j) != ref[j])
+      return -1;
+    full &= ref[j];
+    if (ref[j] && data[j] != uc[j])
+      dirty |= 1u << (j/4);
+  }
+  if (Ihex_Def_Full (def, bs) != full
+      || dirty_dwords (data, def, uc, bs) != dirty)
+    return -1;
+  for (uint32_t i=0; i<bs; i+=32) {
+    if (diff_bytes (data + i, uc + i) != diff_bytes_scalar (data + i, uc + i))
+      return -1;
+  }
+
+  ihex_def_merge_scalar (out0, data, def, uc, bs);
+  //in place, as Ihex_Load () merges the blocks
+  memcpy (out1, uc, bs);
+  Ihex_Def_Merge (out1, data, def, out1, bs);
+  for (uint32_t j=0; j<bs; j++) {
+    unsigned char b = ref[j] ? data[j] : uc[j];
+    if (out0[j] != b || out1[j] != b)
+      return -1;
+  }
+  return 0;
+}
+
+/* Checks the definition bitmap kernels, Ihex_Def_Set (), Ihex_Def_Get (),
+ * Ihex_Def_Full (), Ihex_Def_Merge () and dirty_dwords (), with the SSE2 and
+ * the scalar versions of the last two, against a byte by byte reference. The
+ * definition words are empty, full or partial, the ranges start and end on the
+ * word and block edges, and the µC content differs from the data in single
+ * bytes at the dword and word edges or at random. Returns the number of cases
+ * that failed.
+ */
+static int
+check_def (void)
+{
+  //start and length of the defined ranges, clipped to the block
+  static const uint32_t range[][2] = {
+    {0, 0}, {0, 1}, {0, 4}, {0, 32}, {0, 128}, {1, 30}, {3, 2}, {28, 8},
+    {31, 1}, {31, 2}, {32, 32}, {60, 4}, {63, 1}, {63, 2}, {64, 64},
+    {96, 31}, {127, 1}, {1, 126},
+  };
+  static const uint32_t flip[] = {0, 3, 4, 30, 31, 32, 33, 63, 64, 127};
+  uint32_t      def[DEF_WORDS (BENCH_IHEX_BLOCK)];
+  unsigned char ref[BENCH_IHEX_BLOCK];
+  unsigned char data[BENCH_IHEX_BLOCK], uc[BENCH_IHEX_BLOCK];
+  uint32_t      seed = 7;
+  int           fails = 0, cases = 0;
+
+  for (uint32_t bs=64; bs<=BENCH_IHEX_BLOCK; bs*=2) {
+    int nrange = sizeof(range)/sizeof(range[0]);
+
+    //the fixed ranges, then random sets of ranges
+    for (int r=0; r<nrange + 1000; r++) {
+      memset (def, 0x00, sizeof(def));
+      memset (ref, 0x00, sizeof(ref));
+      for (int k=0; k<((r < nrange) ? 1 : 1 + r%4); k++) {
+        uint32_t i, n;
+
+        if (r < nrange) {
+          i = range[r][0];
+          n = range[r][1];
+        } else {
+          seed = seed*1103515245 + 12345;
+          i = (seed>>8) % bs;
+          n = (seed>>20) % (bs + 1);
+        }
+        if (i >= bs)
+          continue;
+        if (n > bs - i)
+          n = bs - i;
+        Ihex_Def_Set (def, i, n);
+        memset (ref + i, 1, n);
+      }
+
+      for (uint32_t j=0; j<bs; j++) {
+        seed = seed*1103515245 + 12345;
+        data[j] = seed>>16;
+      }
+      //the same content, one byte differs, and random differences
+      for (int f=-1; f<(int)(sizeof(flip)/sizeof(flip[0])) + 1; f++) {
+        memcpy (uc, data, bs);
+        if (f >= 0 && f < (int)(sizeof(flip)/sizeof(flip[0]))) {
+          if (flip[f] >= bs)
+            continue;
+          uc[flip[f]] ^= 0x01;
+        } else if (f >= 0) {
+          for (uint32_t j=0; j<bs; j++) {
+            seed = seed*1103515245 + 12345;
+            if ((seed>>16) % 3 == 0)
+              uc[j] = seed>>24;
+          }
+        }
+        cases++;
+        if (check_def_case (def, ref, bs, data, uc)) {
+          if (fails < 8)
+            printf ("Definition kernels, block of %u bytes, case %d, "
+                "difference %d failed\n", bs, r, f);
+          fails++;
+        }
+      }
+    }
+  }
+#ifdef __SSE2__
+  printf ("Definition kernel check, scalar and SSE2: %d cases, %d failed\n",
+      cases, fails);
+#else
+  printf ("Definition kernel check, scalar only, no SSE2: %d cases, %d "
+      "failed\n", cases, fails);
+#endif
+  return fails;
+}
+
+static void
+bench_print (const char *name, uint64_t us, size_t size)
+{
+  if (!us)
+    us = 1;
+  printf ("...%s: %u us, %u MB/s\n", name, (uint32_t)us,
+      (uint32_t)(size / us));
+}
+
+/* Writes nseg segments of 64K to w, the data is random if seg is refilled.
+ * Returns the number of segments written when mbytes MB of file are reached,
+ * -1 with errno set if the write failed.
+ */
+static int
+bench_write (ihex_wr *w, unsigned char *seg, int refill, uint32_t nseg,
+    uint64_t mbytes)
+{
+  uint64_t      size = 0;
+  uint32_t      seed = 1;
+  unsigned char ela[2];
+  uint32_t      a;
+
+  for (a=0; a<nseg && size < mbytes<<20; a++) {
+    for (int i=0; refill && i<0x10000; i++) {
+      seed = seed*1103515245 + 12345;
+      seg[i] = seed>>16;
+    }
+    ela[0] = a>>8;
+    ela[1] = a;
+    if (Ihex_Wr_Record (w, 0x04, 0, ela, 2)
+        || Ihex_Wr_Data (w, 0, seg, 0x10000))
+      return -1;
+    //a segment is 2048 records of 76 characters, plus the address record
+    size += 2048*76 + 15;
+  }
+  if (Ihex_Wr_End (w))
+    return -1;
+  return a;
+}
+
+/* Times the writer, the decoders and Ihex_Load () on the mapped file text */
+static void
+bench_ihex (gmt_ctx *ctx, const char *text, size_t size, uint64_t write_us)
+{
+  uint32_t      *lines;
+  uint32_t       nlines = 0;
+  unsigned char  rec[3 + 255 + 1];
+  volatile uint32_t sink = 0;
+  uint64_t       best;
+
+  for (size_t i=0; i<size; i++)
+    nlines += (text[i] == '\n');
+  lines = malloc (nlines*sizeof(*lines));
+  MALLOC_TST (lines);
+  for (size_t i=0, n=0, sta=0; i<size; i++) {
+    if (text[i] == '\n') {
+      lines[n++] = sta;
+      sta = i + 1;
+    }
+  }
+  printf ("Intel hex, %u kB file, %u records\n", (uint32_t)(size>>10), nlines);
+  bench_print ("Ihex_Wr_Data", write_us, size);
+
+  for (int k=0; k<2; k++) {
+#ifndef __SSE2__
+    if (k)
+      break;
+#endif
+    best = ~0ULL;
+    for (int r=0; r<BENCH_IHEX_RUNS; r++) {
+      uint64_t t0 = time_us ();
+      for (uint32_t i=0; i<nlines; i++) {
+        const unsigned char *line = (const unsigned char *)text + lines[i];
+        uint32_t sum = read_next_byte (line, 1);
+        if (k)
+          ihex_decode (line + 3, 3 + sum + 1, rec, &sum);
+        else
+          ihex_decode_scalar (line + 3, 3 + sum + 1, rec, &sum);
+        sink += sum;
+      }
+      t0 = time_us () - t0;
+      if (t0 < best)
+        best = t0;
+    }
+    bench_print (k ? "record decode, SSE2" : "record decode, scalar", best,
+        size);
+  }
+  free (lines);
+
+  ctx->hexfile_name = strdup ("benchmark");
+  MALLOC_TST (ctx->hexfile_name);
+  best = ~0ULL;
+  for (int r=0; r<BENCH_IHEX_RUNS; r++) {
+    free_hex_data (ctx);
+    uint64_t t0 = time_us ();
+    Ihex_Load (ctx, (const unsigned char *)text, size, BENCH_IHEX_BLOCK);
+    t0 = time_us () - t0;
+    if (t0 < best)
+      best = t0;
+  }
+  bench_print ("Ihex_Load", best, size);
+  printf ("...%d blocks of %u bytes\n", ctx->mblocks, BENCH_IHEX_BLOCK);
+}
+
+int
+main (int argc, char **argv)
+{
+  gmt_ctx       *ctx;
+  unsigned char *seg;
+  ihex_wr       *w = NULL;
+  char          *text = MAP_FAILED;
+  size_t         size = 0;
+  uint64_t       best = ~0ULL;
+  int            mbytes = 64;
+  int            nseg, null = -1, q = EXIT_FAILURE;
+  FILE          *f;
+
+  if ( argc > 2 || (argc == 2 && (sscanf (argv[1], "%i", &mbytes) != 1
+      || mbytes < 1 || mbytes > 1024)) ) {
+    printf ("Usage: %s [MB], from 1 to 1024\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (check_ihex_decode () | check_def ())
+    return EXIT_FAILURE;
+
+  //the library failures exit, with the message printed
+  ctx = Gmt_Ctx_New ();
+  seg = malloc (0x10000);
+  f = tmpfile ();
+  if (!ctx || !seg || !f)
+    goto sys_err;
+  w = Ihex_Wr_New (ctx, fileno (f));
+  nseg = bench_write (w, seg, 1, ~0, mbytes);
+  if (nseg < 0)
+    goto sys_err;
+  size = lseek (w->fd, 0, SEEK_END);
+  text = mmap (NULL, size, PROT_READ, MAP_PRIVATE, w->fd, 0);
+  null = open ("/dev/null", O_WRONLY);
+  if (text == MAP_FAILED || null < 0)
+    goto sys_err;
+
+  w->fd = null;
+  for (int r=0; r<BENCH_IHEX_RUNS; r++) {
+    uint64_t t0 = time_us ();
+    if (bench_write (w, seg, 0, nseg, ~0) < 0)
+      goto sys_err;
+    t0 = time_us () - t0;
+    if (t0 < best)
+      best = t0;
+  }
+
+  bench_ihex (ctx, text, size, best);
+  q = EXIT_SUCCESS;
+  goto done;
+
+sys_err:
+  printf ("%s\n", strerror(errno));
+done:
+  if (text != MAP_FAILED)
+    munmap (text, size);
+  if (null >= 0)
+    close (null);
+  if (f)
+    fclose (f);
+  free (w);
+  free (seg);
+  Gmt_Ctx_Free (ctx);
+  return q;
+}
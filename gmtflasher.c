@@ -1,327 +1,359 @@
 /* Main source file for GmtFlasher
  * Cristian Gyorgy, 2021 */
 
-#include "gmtflasher.h"
+#include "libgmtflasher.c"
 #include "help.h"
 
 
+/* Command line arguments, of the program or of a daemon job */
+typedef struct {
+  int       job;
+  char     *mcu_name;
+  char     *hexfile_name;
+  char     *ofile_name;
+  uint32_t  prog_mode;
+  int       probe;
+  uint32_t  swim_chunk;
+  int       gang;
+  uint32_t  gang_mask;
+  int       daemon;
+  int       remote;
+  char     *script;
+  char     *session_opt;	//an option that applies to the whole session
+} cli_args;
+
+gmt_ctx  *gctx;
+
 static void
-show_version (void)
+show_version (gmt_ctx *ctx)
 {
-  printf ("GmtFlasher %s, STM8 programming tool for STLinkV2\n",
+  fprintf (ctx->out, "GmtFlasher %s, STM8 programming tool for STLinkV2\n",
       SOFTWARE_VERSION);
 }
 
 
 static void
-show_help (void)
+show_help (gmt_ctx *ctx)
 {
-  show_version ();
-  puts (help_text);
+  show_version (ctx);
+  fprintf (ctx->out, "%s\n", help_text);
 }
 
 
 void
 exit_handler (void)
 {
-  if (ghexfile)
-    fclose (ghexfile);
-  if (gdev_handle) {
-    libusb_release_interface (gdev_handle, 0);
-    libusb_close (gdev_handle);
-  }
-  if (gusbcontext)
-    libusb_exit (gusbcontext);
+  Gmt_Ctx_Free (gctx);
 }
 
 /* Reads mcu memory according to job and writes the data into a intel hex file.
- * The name of the file is given by the -o option if defined, else is a fix
- * path/name, depending on job.
+ * The name of the file is given by the -o option if defined, "-" for stdout,
+ * else is a fix path/name, depending on job. With --bin the file is raw binary.
+ * In gang mode each slot gets its own file, the name ends with .slot<probe>.
  */
-static void
-read_mcu (int job, mcu *uc)
+static int
+read_mcu (gmt_ctx *ctx, cli_args *a, int job, uint32_t add_0, uint32_t add_1)
 {
-  char rfname[64];
-  FILE *rfile;
+  char rfname[256];
+  const char *ext = (a->prog_mode & PROG_MODE_READ_BIN) ? "bin" : "ihx";
 
   //setup file name
-  if (prog_stat & PROG_STAT_OFILE) {
-    strncpy (rfname, ofile_name, sizeof(rfname));
+  if (a->ofile_name) {
+    strncpy (rfname, a->ofile_name, sizeof(rfname));
     rfname[sizeof(rfname)-1] = 0x00;
   } else {
     switch (job) {
     case JOB_READ_ALL:
-      strcpy (rfname, "/tmp/gmtflasher/mcu_rd.ihx");
+      sprintf (rfname, "/tmp/gmtflasher/mcu_rd.%s", ext);
       break;
     case JOB_READ_FLASH:
-      strcpy (rfname, "/tmp/gmtflasher/flash_rd.ihx");
+      sprintf (rfname, "/tmp/gmtflasher/flash_rd.%s", ext);
       break;
     case JOB_READ_EEPROM:
-      strcpy (rfname, "/tmp/gmtflasher/eeprom_rd.ihx");
+      sprintf (rfname, "/tmp/gmtflasher/eeprom_rd.%s", ext);
       break;
     case JOB_READ_OPT:
-      strcpy (rfname, "/tmp/gmtflasher/opt_rd.ihx");
+      sprintf (rfname, "/tmp/gmtflasher/opt_rd.%s", ext);
       break;
     case JOB_READ_RANGE:
-      strcpy (rfname, "/tmp/gmtflasher/range_rd.ihx");
+      sprintf (rfname, "/tmp/gmtflasher/range_rd.%s", ext);
       break;
     }
   }
-
-  //open read file
-  rfile = fopen (rfname, "w+");
-  if (!rfile) {
-    printf (strerror(errno));
-    printf ("\n");
-    exit (EXIT_FAILURE);
+  if (a->gang) {
+    int n = strlen (rfname);
+    snprintf (rfname + n, sizeof(rfname) - n, ".slot%d", ctx->probe);
   }
 
-  //do actual reading from mcu to file
-  switch (job) {
-  case JOB_READ_ALL:
-    printf ("...reading device: ");
-    fflush (stdout);
-    Stlink_Read_Memory (uc->eeprom_add, uc->eeprom_size, rfile);
-    Stlink_Read_Memory (0x4800, uc->block_size, rfile);
-    Stlink_Read_Memory (0x8000, uc->flash_size, rfile);
-    break;
-  case JOB_READ_FLASH:
-    printf ("...reading FLASH: ");
-    fflush (stdout);
-    Stlink_Read_Memory (0x8000, uc->flash_size, rfile);
-    break;
-  case JOB_READ_EEPROM:
-    printf ("...reading EEPROM: ");
-    fflush (stdout);
-    Stlink_Read_Memory (uc->eeprom_add, uc->eeprom_size, rfile);
-    break;
-  case JOB_READ_OPT:
-    printf ("...reading OPT: ");
-    fflush (stdout);
-    Stlink_Read_Memory (0x4800, uc->block_size, rfile);
-    break;
-  case JOB_READ_RANGE:
-    printf ("...reading address range [0x%X, 0x%X): ", uc->add_0, uc->add_1);
-    fflush (stdout);
-    Stlink_Read_Memory (uc->add_0, uc->add_1 - uc->add_0, rfile);
-    break;
-  }
-  fprintf (rfile, ":00000001FF");
-  fclose (rfile);
-  printf ("done\n");
-  printf ("See file %s\n", rfname);
+  return Gmt_Read (ctx, job, add_0, add_1, rfname) ? -1 : 0;
 }
 
 
-int
-main (int argc, char **argv)
+/* Prints the attached STLinkV2 probes, with the index used by --probe and
+ * --gang
+ */
+static void
+list_probes (gmt_ctx *ctx)
 {
-  int           job = 0;
-  mcu           uc;
-  int           mblocks;
-  uint32_t      *blk_add = NULL;
-  unsigned char *data = NULL;
-  unsigned char *ddef = NULL;
-
-  if ( atexit (exit_handler) ) {
-    printf (strerror(errno));
-    exit(EXIT_FAILURE);
-  }
+  char serials[GANG_MAX_SLOTS][32];
 
-  memset (&uc, 0x00, sizeof(uc));
+  int n = Gmt_List_Probes (serials, GANG_MAX_SLOTS);
+  if (!n)
+    fprintf (ctx->out, "No STLinkV2 device connected!\n");
+  for (int i=0; i<n && i<GANG_MAX_SLOTS; i++)
+    fprintf (ctx->out, "%d: %s\n", i, serials[i]);
+}
 
-//check user arguments, identify jobs and options
+/* Parses the arguments in a, the help and list options are executed here.
+ * Returns -1 on error, with the message printed.
+ */
+static int
+parse_args (gmt_ctx *ctx, int argc, char **argv, cli_args *a)
+{
   for (int i=1; i<argc; i++) {
     if ( !strcasecmp(argv[i], "-u") ) {
       i++;
       if (i>=argc) {
-        printf ("Missing argument for -u option!\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Missing argument for -u option!\n");
+        return -1;
       }
-      strncpy (uc.name, argv[i], sizeof (uc.name) - 1);
-      uc.name[sizeof(uc.name)] = 0x00;
+      a->mcu_name = argv[i];
     } else if ( !strcasecmp(argv[i], "-o") ) {
       i++;
       if (i>=argc) {
-        printf ("Missing argument for -u option!\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Missing argument for -u option!\n");
+        return -1;
       }
-      ofile_name = argv[i];
-      prog_stat |= PROG_STAT_OFILE;
+      a->ofile_name = argv[i];
     } else if ( !strcasecmp(argv[i], "-w") ) {
-      job |= JOB_WRITE_ALL;
+      a->job |= JOB_WRITE_ALL;
     } else if ( !strcasecmp(argv[i], "-r") ) {
-      job |= JOB_READ_ALL;
+      a->job |= JOB_READ_ALL;
     } else if ( !strcasecmp(argv[i], "-wf") ) {
-      job |= JOB_WRITE_FLASH;
+      a->job |= JOB_WRITE_FLASH;
     } else if ( !strcasecmp(argv[i], "-we") ) {
-      job |= JOB_WRITE_EEPROM;
+      a->job |= JOB_WRITE_EEPROM;
     } else if ( !strcasecmp(argv[i], "-wo") ) {
-      job |= JOB_WRITE_OPT;
+      a->job |= JOB_WRITE_OPT;
+    } else if ( !strcasecmp(argv[i], "-c") ) {
+      a->job |= JOB_VERIFY_ALL;
+    } else if ( !strcasecmp(argv[i], "-cf") ) {
+      a->job |= JOB_VERIFY_FLASH;
+    } else if ( !strcasecmp(argv[i], "-ce") ) {
+      a->job |= JOB_VERIFY_EEPROM;
     } else if ( !strcasecmp(argv[i], "-ul") ) {
-      job |= JOB_UNLOCK;
+      a->job |= JOB_UNLOCK;
     } else if ( !strcasecmp(argv[i], "-lo") ) {
-      job |= JOB_LOCK;
+      a->job |= JOB_LOCK;
     } else if ( !strcasecmp(argv[i], "-rf") ) {
-      job |= JOB_READ_FLASH;
+      a->job |= JOB_READ_FLASH;
     } else if ( !strcasecmp(argv[i], "-re") ) {
-      job |= JOB_READ_EEPROM;
+      a->job |= JOB_READ_EEPROM;
     } else if ( !strcasecmp(argv[i], "-ro") ) {
-      job |= JOB_READ_OPT;
+      a->job |= JOB_READ_OPT;
     } else if ( !strcasecmp(argv[i], "-rr") ) {
-      job |= JOB_READ_RANGE;
+      a->job |= JOB_READ_RANGE;
       i++;
       if (i>=argc) {
-        printf ("Missing argument for -rr option!\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Missing argument for -rr option!\n");
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-wb") ) {
-      job |= JOB_WRITE_BYTE;
+      a->job |= JOB_WRITE_BYTE;
       i += 2;
       if (i>=argc) {
-        printf ("Missing argument for -wb option!\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Missing argument for -wb option!\n");
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-rb") ) {
-      job |= JOB_READ_BYTE;
+      a->job |= JOB_READ_BYTE;
       i++;
       if (i>=argc) {
-        printf ("Missing argument for -rb option!\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Missing argument for -rb option!\n");
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-ww") ) {
-      job |= JOB_WRITE_WORD;
+      a->job |= JOB_WRITE_WORD;
       i += 2;
       if (i>=argc) {
-        printf ("Missing argument for -ww option!\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Missing argument for -ww option!\n");
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-rw") ) {
-      job |= JOB_READ_WORD;
+      a->job |= JOB_READ_WORD;
       i++;
       if (i>=argc) {
-        printf ("Missing argument for -rw option!\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Missing argument for -rw option!\n");
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-iw") ) {
-      job |= JOB_INC_WORD;
+      a->job |= JOB_INC_WORD;
       i++;
       if (i>=argc) {
-        printf ("Missing argument for -iw option!\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Missing argument for -iw option!\n");
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-ib") ) {
-      job |= JOB_INC_BYTE;
+      a->job |= JOB_INC_BYTE;
       i++;
       if (i>=argc) {
-        printf ("Missing argument for -ib option!\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Missing argument for -ib option!\n");
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-v")
         || !strcasecmp(argv[i], "--verbose") ) {
-      prog_mode |= PROG_MODE_VERBOSE;
+      a->prog_mode |= PROG_MODE_VERBOSE;
+    } else if ( !strcasecmp(argv[i], "--chunk") ) {
+      int q;
+
+      i++;
+      if ( (i>=argc) || (sscanf(argv[i], "%i", &q) != 1) || (q < 1)
+          || (q > 0xFFFF) ) {
+        fprintf (ctx->out, "Missing or wrong argument for --chunk option!\n");
+        return -1;
+      }
+      a->swim_chunk = q;
+      a->session_opt = argv[i-1];
+    } else if ( !strcasecmp(argv[i], "--probe") ) {
+      i++;
+      if ( (i>=argc) || (sscanf(argv[i], "%i", &a->probe) != 1) || (a->probe < 0) ) {
+        fprintf (ctx->out, "Missing or wrong argument for --probe option!\n");
+        return -1;
+      }
+      a->session_opt = argv[i-1];
+    } else if ( !strcasecmp(argv[i], "--remote") ) {
+      a->remote = 1;
+      a->session_opt = argv[i];
+    } else if ( !strcasecmp(argv[i], "--daemon") ) {
+      a->daemon = 1;
+      a->session_opt = argv[i];
+    } else if ( !strcasecmp(argv[i], "--script") ) {
+      i++;
+      if (i>=argc) {
+        fprintf (ctx->out, "Missing argument for --script option!\n");
+        return -1;
+      }
+      a->script = argv[i];
+      a->session_opt = argv[i-1];
+    } else if ( !strcasecmp(argv[i], "--gang") ) {
+      i++;
+      if (i>=argc) {
+        fprintf (ctx->out, "Missing argument for --gang option!\n");
+        return -1;
+      }
+      a->gang = 1;
+      a->session_opt = argv[i-1];
+      if (strcasecmp(argv[i], "all")) {
+        //comma separated list of probe indexes
+        char *p = argv[i];
+        do {
+          int q;
+          if ( (sscanf(p, "%i", &q) != 1) || (q < 0) || (q >= GANG_MAX_SLOTS) ) {
+            fprintf (ctx->out, "Wrong --gang argument \"%s\"!\n", argv[i]);
+            return -1;
+          }
+          a->gang_mask |= 1u<<q;
+          p = strchr (p, ',');
+        } while (p++);
+      }
+    } else if ( !strcasecmp(argv[i], "--bin") ) {
+      a->prog_mode |= PROG_MODE_READ_BIN;
+    } else if ( !strcasecmp(argv[i], "--compare") ) {
+      a->prog_mode |= PROG_MODE_READ_CMP;
+    } else if ( !strcasecmp(argv[i], "--crc") ) {
+      a->prog_mode |= PROG_MODE_READ_CRC;
+    } else if ( !strcasecmp(argv[i], "--lowspeed") ) {
+      a->prog_mode |= PROG_MODE_LOW_SPEED;
+      a->session_opt = argv[i];
+    } else if ( !strcasecmp(argv[i], "--loader") ) {
+      a->prog_mode |= PROG_MODE_LOADER;
+      a->session_opt = argv[i];
+    } else if ( !strcasecmp(argv[i], "--plan") ) {
+      a->prog_mode |= PROG_MODE_PLAN;
+    } else if ( !strcasecmp(argv[i], "--shadow") ) {
+      a->prog_mode |= PROG_MODE_SHADOW;
+      a->session_opt = argv[i];
+    } else if ( !strcasecmp(argv[i], "--timings") ) {
+      a->prog_mode |= PROG_MODE_TIMINGS;
+      a->session_opt = argv[i];
     } else if ( !strcasecmp(argv[i], "-f") ) {
-      prog_mode |= PROG_MODE_FORCE_ALL;
+      a->prog_mode |= PROG_MODE_FORCE_ALL;
     } else if ( !strcasecmp(argv[i], "-p") ) {
-      prog_mode |= PROG_MODE_PERSIST;
+      a->prog_mode |= PROG_MODE_PERSIST;
     } else if ( !strcasecmp(argv[i], "-h") || !strcasecmp(argv[i], "--help") ) {
-      job |= JOB_PRINT;
-      show_help ();
+      a->job |= JOB_PRINT;
+      show_help (ctx);
     } else if ( !strcasecmp(argv[i], "--version") ) {
-      job |= JOB_PRINT;
-      show_version ();
+      a->job |= JOB_PRINT;
+      show_version (ctx);
     } else if ( !strcasecmp(argv[i], "--listmcu") ) {
-      job |= JOB_PRINT;
-      List_Devices ();
+      a->job |= JOB_PRINT;
+      if (Gmt_List_Mcu (ctx))
+        return -1;
+    } else if ( !strcasecmp(argv[i], "--listprobes") ) {
+      a->job |= JOB_PRINT;
+      list_probes (ctx);
     } else if (i==argc-1) {
-      ghexfile_name = argv[i];
+      a->hexfile_name = argv[i];
     } else {
     //unknown option/argument
-      printf ("...Unknown argument \"%s\"\n", argv[i]);
-      exit (EXIT_FAILURE);
+      fprintf (ctx->out, "...Unknown argument \"%s\"\n", argv[i]);
+      return -1;
     }
   }
 
+  return 0;
+}
+
+/* Checks that the jobs have the arguments they need. Returns 1 if there is
+ * nothing to do, -1 on error, with the message printed, 0 otherwise.
+ */
+static int
+check_jobs (gmt_ctx *ctx, cli_args *a)
+{
 //exit if no job
-  if (job == JOB_PRINT)
-    exit (EXIT_SUCCESS);
-  if (!job) {
-    printf ("No job specified!\n");
-    exit (EXIT_SUCCESS);
+  if (a->job == JOB_PRINT && !a->script)
+    return 1;
+  if (!a->job && !a->script) {
+    fprintf (ctx->out, "No job specified!\n");
+    return 1;
   }
 
 //exit if no mcu specified
-  if (!uc.name[0]) {
-    printf ("No µC part number specified!\n");
-    exit (EXIT_FAILURE);
+  if (!a->mcu_name) {
+    fprintf (ctx->out, "No µC part number specified!\n");
+    return -1;
   }
 
 //exit if no input hex file and a job that requires an input data file
-  if ( (job & (JOB_WRITE_ALL | JOB_WRITE_FLASH | JOB_WRITE_EEPROM | JOB_WRITE_OPT))
-      && !ghexfile_name) {
-    printf ("Input data file not specified!\n");
-    exit (EXIT_FAILURE);
+  if ( ((a->job & (JOB_WRITE_ALL | JOB_WRITE_FLASH | JOB_WRITE_EEPROM
+      | JOB_WRITE_OPT | JOB_VERIFY_ALL | JOB_VERIFY_FLASH | JOB_VERIFY_EEPROM))
+      || (a->prog_mode & PROG_MODE_READ_CMP)) && !a->hexfile_name) {
+    fprintf (ctx->out, "Input data file not specified!\n");
+    return -1;
   }
+  return 0;
+}
 
-//identify the mcu from the xml file
-  PRINT_IF_VERBOSE ("...reading device xml file and identify device: ");
-  Get_Xml_Mcu_Data (&uc);
-  PRINT_IF_VERBOSE ("done\n");
-
-//if we have an input file, we try to open it
-  if (ghexfile_name) {
-    PRINT_IF_VERBOSE ("...opening data file %s: ", ghexfile_name);
-    ghexfile = fopen (ghexfile_name, "r");
-    if (!ghexfile) {
-      printf (strerror(errno));
-      printf ("\n");
-      exit (EXIT_FAILURE);
-    }
-
-    mblocks = Ihex_Count_Blocks (ghexfile, uc.block_size);
-
-    blk_add = malloc (mblocks*4);
-    MALLOC_TST (blk_add);
-    data = malloc (uc.block_size*mblocks);
-    MALLOC_TST (data);
-    memset (data, 0x00, uc.block_size*mblocks);
-    ddef = malloc (uc.block_size*mblocks);
-    MALLOC_TST (ddef);
-    memset (ddef, 0x00, uc.block_size*mblocks);
-
-    //read the mblocks of data
-    Ihex_Read_Data_Blocks (ghexfile, uc.block_size, blk_add, data, ddef);
-    PRINT_IF_VERBOSE ("%d blocks of data\n", mblocks);
-
-  /* Aici avem in mblocks numarul de blocuri de date definite in fisier, in *blk_add avem
-   * adresele de start la care trebuiesc scrise aceste blolcuri, iar datele se gasesc in
-   * data.
-   */
-  }
-
-//check if /tmp/gmtflasher dir exists, if not create
-  if (mkdir ("/tmp/gmtflasher", 0777) && errno!=EEXIST) {
-    printf (strerror(errno));
-    printf ("\n");
-    exit (EXIT_FAILURE);
-  }
-
-//usb connection to STLINK
-  Stlink_Usb_Init();
-
-//activate SWIM
-  Stlink_Open ();
-
-//rescan and execute jobs
+/* Rescans the arguments and executes the jobs, in the order given, on the open
+ * session. Returns -1 if a job failed.
+ */
+static int
+run_jobs (gmt_ctx *ctx, cli_args *a, int argc, char **argv)
+{
   for (int i=1; i<argc; i++) {
     if ( !strcasecmp(argv[i], "-r") ) {
-      read_mcu (JOB_READ_ALL, &uc);
+      if (read_mcu (ctx, a, JOB_READ_ALL, 0, 0))
+        return -1;
     } else if ( !strcasecmp(argv[i], "-rf") ) {
-      read_mcu (JOB_READ_FLASH, &uc);
+      if (read_mcu (ctx, a, JOB_READ_FLASH, 0, 0))
+        return -1;
     } else if ( !strcasecmp(argv[i], "-re") ) {
-      read_mcu (JOB_READ_EEPROM, &uc);
+      if (read_mcu (ctx, a, JOB_READ_EEPROM, 0, 0))
+        return -1;
     } else if ( !strcasecmp(argv[i], "-ro") ) {
-      read_mcu (JOB_READ_OPT, &uc);
+      if (read_mcu (ctx, a, JOB_READ_OPT, 0, 0))
+        return -1;
     } else if ( !strcasecmp(argv[i], "-rr") ) {
       int add0, add1;
 
@@ -329,206 +361,89 @@ main (int argc, char **argv)
       if ( (sscanf(argv[i], "%i:%i", &add0, &add1) != 2)
           || (add0 > 0xFFFFFF)
 	  || (add1 > 0xFFFFFF) ) {
-        printf ("Wrong -rr arguments! Aborted\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Wrong -rr arguments! Aborted\n");
+        return -1;
       }
-      uc.add_0 = add0;
-      uc.add_1 = add1;
-      read_mcu (JOB_READ_RANGE, &uc);
+      if (read_mcu (ctx, a, JOB_READ_RANGE, add0, add1))
+        return -1;
     } else if ( !strcasecmp(argv[i], "-w") ) {
-      int blk_cnt = 0;
-      int wrd_cnt = 0;
-      int byt_cnt = 0;
-      int skip = 0;
-
-      PRINT_IF_VERBOSE ("...writing device: ");
-      for (int i=0; i<mblocks; i++) {
-        uint32_t add = *(blk_add+i);
-        if ( ( add>=0x8000 && add<(0x8000 + uc.flash_size) )
-            || ( add>=uc.eeprom_add && add<(uc.eeprom_add + uc.eeprom_size) )
-            ) {
-          Stlink_Unlock_Memory (&uc, add);
-          int q = Stlink_Prog_Block (add, uc.block_size, data+i*uc.block_size,
-                ddef+i*uc.block_size);
-          if (q==0)
-            blk_cnt++;
-          else if (q>0)
-            wrd_cnt+=q;
-          else
-            skip++;
-        } else if (add>=0x4800 && add<0x4880) {
-          Stlink_Unlock_Memory (&uc, add);
-          for (int j=0; j<uc.block_size; j++) {
-            if (*(ddef+i*uc.block_size+j)) {
-              Stlink_Prog_Byte (add+j, *(data+i*uc.block_size+j));
-              byt_cnt++;
-            }
-          }
-        }
-      }
-      printf ("Written %d blocks, %d dwords, %d bytes, skipped %d\n",
-            blk_cnt, wrd_cnt, byt_cnt, skip);
+      if (Gmt_Write (ctx, JOB_WRITE_ALL))
+        return -1;
     } else if ( !strcasecmp(argv[i], "-wf") ) {
-      int blk_cnt = 0;
-      int wrd_cnt = 0;
-      int skip = 0;
-
-      PRINT_IF_VERBOSE ("...writing FLASH: ");
-      for (int i=0; i<mblocks; i++) {
-        uint32_t add = *(blk_add+i);
-        if ( (add>=0x8000) && (add<(0x8000 + uc.flash_size)) ) {
-          Stlink_Unlock_Memory (&uc, add);
-          int q = Stlink_Prog_Block (add, uc.block_size, data+i*uc.block_size,
-                ddef+i*uc.block_size);
-          if (q==0)
-            blk_cnt++;
-          else if (q>0)
-            wrd_cnt+=q;
-          else
-            skip++;
-        }
-      }
-      if (!(blk_cnt + wrd_cnt + skip))
-        printf ("No FLASH data defined in %s\n", ghexfile_name);
-      else if (wrd_cnt)
-        printf ("Written %d blocks + %d dwords, skipped %d blocks\n",
-            blk_cnt, wrd_cnt, skip);
-      else
-        printf ("Written %d blocks, skipped %d blocks\n", blk_cnt, skip);
+      if (Gmt_Write (ctx, JOB_WRITE_FLASH))
+        return -1;
     } else if ( !strcasecmp(argv[i], "-we") ) {
-      int blk_cnt = 0;
-      int wrd_cnt = 0;
-      int skip = 0;
-
-      PRINT_IF_VERBOSE ("...writing EEPROM: ");
-      for (int i=0; i<mblocks; i++) {
-        uint32_t add = *(blk_add+i);
-        if ((add>=uc.eeprom_add) && (add<uc.eeprom_add + uc.eeprom_size)) {
-          Stlink_Unlock_Memory (&uc, add);
-          int q = Stlink_Prog_Block (add, uc.block_size, data+i*uc.block_size,
-                ddef+i*uc.block_size);
-          if (q==0)
-            blk_cnt++;
-          else if (q>0)
-            wrd_cnt+=q;
-          else
-            skip++;
-        }
-      }
-      if (!(blk_cnt + wrd_cnt + skip))
-        printf ("No EEPROM data defined in %s\n", ghexfile_name);
-      else if (wrd_cnt)
-        printf ("Written %d blocks + %d dwords, skipped %d blocks\n",
-            blk_cnt, wrd_cnt, skip);
-      else
-        printf ("Written %d blocks, skipped %d blocks\n", blk_cnt, skip);
+      if (Gmt_Write (ctx, JOB_WRITE_EEPROM))
+        return -1;
     } else if ( !strcasecmp(argv[i], "-wo") ) {
-      int wr_cnt = 0;
-
-      PRINT_IF_VERBOSE ("...writing OPT: ");
-      for (int i=0; i<mblocks; i++) {
-        uint32_t add = *(blk_add+i);
-        if (add>=0x4800 && add<0x4880) {
-          Stlink_Unlock_Memory (&uc, add);
-          for (int j=0; j<uc.block_size; j++) {
-            if (*(ddef+i*uc.block_size+j)) {
-              Stlink_Prog_Byte (add+j, *(data+i*uc.block_size+j));
-              wr_cnt++;
-            }
-          }
-        }
-      }
-      if (!wr_cnt)
-        printf ("No OPT data defined in %s\n", ghexfile_name);
-      else
-        printf ("Written %d OPT data bytes\n", wr_cnt);
+      if (Gmt_Write (ctx, JOB_WRITE_OPT))
+        return -1;
+    } else if ( !strcasecmp(argv[i], "-c") ) {
+      if (Gmt_Verify (ctx, JOB_VERIFY_ALL))
+        return -1;
+    } else if ( !strcasecmp(argv[i], "-cf") ) {
+      if (Gmt_Verify (ctx, JOB_VERIFY_FLASH))
+        return -1;
+    } else if ( !strcasecmp(argv[i], "-ce") ) {
+      if (Gmt_Verify (ctx, JOB_VERIFY_EEPROM))
+        return -1;
     } else if ( !strcasecmp(argv[i], "-ul") ) {
-      PRINT_IF_VERBOSE ("...Unlocking device (disable read out protection): ");
-      Stlink_Unlock_Memory (&uc, 0x4800);
-      if (prog_mode & PROG_MODE_STM8L)
-        Stlink_Prog_Byte (0x4800, 0xAA);
-      else
-        Stlink_Prog_Byte (0x4800, 0x00);
-      printf ("done\n");
+      if (Gmt_Unlock (ctx))
+        return -1;
+      fprintf (ctx->out, "done\n");
     } else if ( !strcasecmp(argv[i], "-lo") ) {
-      PRINT_IF_VERBOSE ("...Locking device (enable read out protection): ");
-      Stlink_Unlock_Memory (&uc, 0x4800);
-      if (prog_mode & PROG_MODE_STM8L)
-        Stlink_Prog_Byte (0x4800, 0x00);
-      else
-        Stlink_Prog_Byte (0x4800, 0xAA);
-      printf ("done\n");
+      if (Gmt_Lock (ctx))
+        return -1;
+      fprintf (ctx->out, "done\n");
     } else if ( !strcasecmp(argv[i], "-wb") ) {
       int add;
       int byte;
 
       i++;
       if ( (sscanf(argv[i], "%i", &add) != 1) || (add > 0xFFFFFF) ) {
-        printf ("Wrong -wb argument address parameter! Aborted\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Wrong -wb argument address parameter! Aborted\n");
+        return -1;
       }
       i++;
       if ( (sscanf(argv[i], "%i", &byte) != 1) || (byte > 0xFF) ) {
-        printf ("Wrong -wb argument data parameter! Aborted\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Wrong -wb argument data parameter! Aborted\n");
+        return -1;
       }
-      
-      PRINT_IF_VERBOSE ("...writing 0x%02X to address 0x%04X: ", byte, add);
-      Stlink_Unlock_Memory (&uc, add);
-      Stlink_Prog_Byte (add, byte);
-      PRINT_IF_VERBOSE ("done\n");
-
-      PRINT_IF_VERBOSE ("...verify address 0x%04X: ", add);
-      if (byte == Stlink_Read_Byte (add)) {
-        printf ("done\n");
-      } else {
-        printf ("failed!\n");
-        exit (EXIT_FAILURE);
+
+      switch (Gmt_Write_Byte (ctx, add, byte)) {
+      case GMT_OK:
+        fprintf (ctx->out, "done\n");
+        break;
+      case GMT_ERR_VERIFY:
+        fprintf (ctx->out, "failed!\n");
+        //fall through
+      default:
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-ww") ) {
       int add;
       int word;
-      uint32_t data;
 
       i++;
       if ( (sscanf(argv[i], "%i", &add) != 1) || (add > 0xFFFFFF) ) {
-        printf ("Wrong -ww argument address parameter! Aborted\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Wrong -ww argument address parameter! Aborted\n");
+        return -1;
       }
       i++;
       if ( (sscanf(argv[i], "%i", &word) != 1) || (word > 0xFFFF) ) {
-        printf ("Wrong -ww argument data parameter! Aborted\n");
-        exit (EXIT_FAILURE);
-      }
-      
-      PRINT_IF_VERBOSE ("...writing 0x%04X to address 0x%04X: ", add, word);
-      Stlink_Unlock_Memory (&uc, add);
-      switch (add & 0x03) {
-      case 0x00:
-        data = stlink_read_dword (add);
-        data &= 0xFFFF;
-        data |= (word<<16);
-        Stlink_Prog_Dword (add, data);
-        break;
-      case 0x01:
-      case 0x03:
-        Stlink_Prog_Byte (add+1, word & 0xFF);
-        Stlink_Prog_Byte (add, word>>8);
-        break;
-      case 0x02:
-        data = stlink_read_dword (add);
-        data &= 0xFFFF0000;
-        data |= (word & 0xFFFF);
-        Stlink_Prog_Dword (add, data);
+        fprintf (ctx->out, "Wrong -ww argument data parameter! Aborted\n");
+        return -1;
       }
-      PRINT_IF_VERBOSE ("done\n");
 
-      PRINT_IF_VERBOSE ("...verify address 0x%04X: ", add);
-      if (word == Stlink_Read_Word (add)) {
-        printf ("done\n");
-      } else {
-        printf ("failed!\n");
-        exit (EXIT_FAILURE);
+      switch (Gmt_Write_Word (ctx, add, word)) {
+      case GMT_OK:
+        fprintf (ctx->out, "done\n");
+        break;
+      case GMT_ERR_VERIFY:
+        fprintf (ctx->out, "failed!\n");
+        //fall through
+      default:
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-rb") ) {
       int add;
@@ -536,64 +451,50 @@ main (int argc, char **argv)
 
       i++;
       if ( (sscanf(argv[i], "%i", &add) != 1) || (add > 0xFFFFFF) ) {
-        printf ("Wrong -rb argument address parameter! Aborted\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Wrong -rb argument address parameter! Aborted\n");
+        return -1;
       }
-      PRINT_IF_VERBOSE ("...reading address 0x%04X: ", add);
-      byte = Stlink_Read_Byte (add);
-      if (prog_mode & PROG_MODE_VERBOSE)
-        printf ("0x%02X (%d)\n", byte, byte);
-      else
-        printf ("0x%02X (%d)\n", byte, byte);
+      if (Gmt_Read_Byte (ctx, add, &byte))
+        return -1;
+      fprintf (ctx->out, "0x%02X (%d)\n", byte, byte);
     } else if ( !strcasecmp(argv[i], "-rw") ) {
       int add;
       uint32_t word;
 
       i++;
       if ( (sscanf(argv[i], "%i", &add) != 1) || (add > 0xFFFFFF) ) {
-        printf ("Wrong -rb argument address parameter! Aborted\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Wrong -rb argument address parameter! Aborted\n");
+        return -1;
       }
-      PRINT_IF_VERBOSE ("...reading address 0x%04X: ", add);
-      word = Stlink_Read_Word (add);
-      if (prog_mode & PROG_MODE_VERBOSE)
-        printf ("0x%04X (%d)\n", word, word);
-      else
-        printf ("0x%04X (%d)\n", word, word);
+      if (Gmt_Read_Word (ctx, add, &word))
+        return -1;
+      fprintf (ctx->out, "0x%04X (%d)\n", word, word);
     } else if ( !strcasecmp(argv[i], "-ib") ) {
       int add;
       uint32_t byte;
 
       i++;
       if ( (sscanf(argv[i], "%i", &add) != 1) || (add > 0xFFFFFF) ) {
-        printf ("Wrong -ib argument address parameter! Aborted\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Wrong -ib argument address parameter! Aborted\n");
+        return -1;
       }
-      
-      PRINT_IF_VERBOSE ("...reading address 0x%04X: ", add);
-      byte = Stlink_Read_Byte (add);
-      PRINT_IF_VERBOSE ("0x%02X\n", byte);
-
-      byte++;
-      byte &= 0xFF;
-      PRINT_IF_VERBOSE ("...writing back 0x%02X to address 0x%04X: ", byte, add);
-      Stlink_Unlock_Memory (&uc, add);
-      Stlink_Prog_Byte (add, byte);
-      PRINT_IF_VERBOSE ("done\n");
-      
-      PRINT_IF_VERBOSE ("...verify address 0x%04X: ", add);
-      if (byte == Stlink_Read_Byte (add)) {
-        if (prog_mode & PROG_MODE_VERBOSE)
-          printf ("success\n");
+
+      switch (Gmt_Inc_Byte (ctx, add, &byte)) {
+      case GMT_OK:
+        if (a->prog_mode & PROG_MODE_VERBOSE)
+          fprintf (ctx->out, "success\n");
         else
-          printf ("Incremented address 0x%04X to 0x%02X (%d)\n",
+          fprintf (ctx->out, "Incremented address 0x%04X to 0x%02X (%d)\n",
               add, byte, byte);
-      } else {
-        if (prog_mode & PROG_MODE_VERBOSE)
-          printf ("failed\n");
+        break;
+      case GMT_ERR_VERIFY:
+        if (a->prog_mode & PROG_MODE_VERBOSE)
+          fprintf (ctx->out, "failed\n");
         else
-          printf ("Increment address 0x%04X: byte verification failed!\n", add);
-        exit (EXIT_FAILURE);
+          fprintf (ctx->out, "Increment address 0x%04X: byte verification failed!\n", add);
+        //fall through
+      default:
+        return -1;
       }
     } else if ( !strcasecmp(argv[i], "-iw") ) {
       int add;
@@ -601,62 +502,691 @@ main (int argc, char **argv)
 
       i++;
       if ( (sscanf(argv[i], "%i", &add) != 1) || (add > 0xFFFFFF) ) {
-        printf ("Wrong -iw argument address parameter! Aborted\n");
-        exit (EXIT_FAILURE);
+        fprintf (ctx->out, "Wrong -iw argument address parameter! Aborted\n");
+        return -1;
       }
-      
-      PRINT_IF_VERBOSE ("...reading address 0x%04X: ", add);
-      word = Stlink_Read_Word (add);
-      PRINT_IF_VERBOSE ("0x%04X\n", word);
-
-      word++;
-      word &= 0xFFFF;
-      PRINT_IF_VERBOSE ("...writing back 0x%04X to address 0x%04X: ", word, add);
-      Stlink_Unlock_Memory (&uc, add);
-      Stlink_Prog_Byte (add+1, word & 0xFF);
-      if (!(word & 0xFF))
-        Stlink_Prog_Byte (add, word>>8);
-      PRINT_IF_VERBOSE ("done\n");
-
-      PRINT_IF_VERBOSE ("...verify address 0x%04X: ", add);
-      if (word == Stlink_Read_Word (add)) {
-        if (prog_mode & PROG_MODE_VERBOSE)
-          printf ("success\n");
+
+      switch (Gmt_Inc_Word (ctx, add, &word)) {
+      case GMT_OK:
+        if (a->prog_mode & PROG_MODE_VERBOSE)
+          fprintf (ctx->out, "success\n");
         else
-          printf ("Incremented address 0x%04X to 0x%04X (%d)\n",
+          fprintf (ctx->out, "Incremented address 0x%04X to 0x%04X (%d)\n",
               add, word, word);
-      } else {
-        if (prog_mode & PROG_MODE_VERBOSE)
-          printf ("failed\n");
+        break;
+      case GMT_ERR_VERIFY:
+        if (a->prog_mode & PROG_MODE_VERBOSE)
+          fprintf (ctx->out, "failed\n");
         else
-          printf ("Increment address 0x%04X: Word verification failed!\n", add);
-        exit (EXIT_FAILURE);
+          fprintf (ctx->out, "Increment address 0x%04X: Word verification failed!\n", add);
+        //fall through
+      default:
+        return -1;
       }
     }
   }
 
-//if memory is unlocked, lock back
-  if (prog_stat & (PROG_STAT_UL_EEPROM | PROG_STAT_UL_FLASH)) {
-    uint32_t iaspr;
+  return 0;
+}
+
+/* Script mode.
+ * Each line of the --script file is a command line, without the program name:
+ * the commands of the line and their options, and the data file of the line as
+ * last argument. Blanks separate the arguments, double quotes group an argument
+ * with blanks, and a '#' at the start of an argument starts a comment. All the
+ * lines run on the same open session, so a memory region is unlocked once, by
+ * the first write to it, and the µC is only reset at the end of the script.
+ */
+#define SCRIPT_MAX_LINE		1024
+#define SCRIPT_MAX_ARGS		64
+
+/* Splits line into argv, in place. Returns the number of arguments, including
+ * the program name, or -1 if there are too many.
+ */
+static int
+script_split (char *line, char **argv)
+{
+  int   argc = 0;
+  char  *p = line;
+
+  argv[argc++] = "gmtflasher";
+  for (;;) {
+    while (isspace ((unsigned char)*p))
+      p++;
+    if (!*p || *p == '#')
+      return argc;
+    if (argc >= SCRIPT_MAX_ARGS)
+      return -1;
+
+    char *d = p;
+    argv[argc++] = d;
+    while (*p && !isspace ((unsigned char)*p)) {
+      if (*p == '"') {
+        p++;
+        while (*p && *p != '"')
+          *d++ = *p++;
+        if (*p)
+          p++;
+      } else {
+        *d++ = *p++;
+      }
+    }
+    if (*p)
+      p++;
+    *d = 0x00;
+  }
+}
+
+/* Runs the lines of the script file on the open session, with the options of
+ * a as default. Stops at the first line that fails and returns -1.
+ */
+static int
+run_script (gmt_ctx *ctx, cli_args *a)
+{
+  char      line[SCRIPT_MAX_LINE];
+  char      *argv[SCRIPT_MAX_ARGS];
+  cli_args  la;
+  uint32_t  mode = Gmt_Get_Mode (ctx);
+  int       argc, n = 0, q = 0;
+  FILE      *f;
+
+  f = fopen (a->script, "r");
+  if (!f) {
+    fprintf (ctx->out, "%s: %s\n", a->script, strerror(errno));
+    return -1;
+  }
+
+  while (!q && fgets (line, sizeof(line), f)) {
+    n++;
+    if (!strchr (line, '\n') && !feof (f)) {
+      fprintf (ctx->out, "Line too long!\n");
+      q = -1;
+      break;
+    }
+    argc = script_split (line, argv);
+    if (argc < 0) {
+      fprintf (ctx->out, "Too many arguments!\n");
+      q = -1;
+      break;
+    }
+    if (argc == 1)
+      continue;
+
+    memset (&la, 0x00, sizeof(la));
+    if (parse_args (ctx, argc, argv, &la)) {
+      q = -1;
+      break;
+    }
+    //the session is already open with the options of the command line
+    if (la.session_opt) {
+      fprintf (ctx->out, "%s can not be used in a script, only commands and -f, "
+          "-o, -p, -v, --bin, --compare, --crc, --plan!\n", la.session_opt);
+      q = -1;
+      break;
+    }
+    if (la.mcu_name && strcasecmp (la.mcu_name, ctx->uc.name)) {
+      fprintf (ctx->out, "A script can not change the µC!\n");
+      q = -1;
+      break;
+    }
+    la.mcu_name = a->mcu_name;
+    la.prog_mode |= mode;
+    q = check_jobs (ctx, &la);
+    if (q) {
+      //a line without commands is a mistake, unless it only prints
+      q = (q < 0 || !la.job) ? -1 : 0;
+      continue;
+    }
+
+    if (la.prog_mode & PROG_MODE_VERBOSE)
+      fprintf (ctx->out, "...script %s, line %d\n", a->script, n);
+    Gmt_Set_Mode (ctx, la.prog_mode);
+    if (la.hexfile_name && Gmt_Load_Hex (ctx, la.hexfile_name))
+      q = -1;
+    else
+      q = run_jobs (ctx, &la, argc, argv);
+    Gmt_Set_Mode (ctx, mode);
+  }
+
+  if (q)
+    fprintf (ctx->out, "Script %s aborted at line %d\n", a->script, n);
+  fclose (f);
+  return q;
+}
+
+/* Gang programming.
+ * A thread runs the jobs on each STLink selected in gang_mask (all if 0), as a
+ * normal session, on a context cloned from ctx after the input file was parsed,
+ * so the slots share the hex image. The output of each slot is kept in memory
+ * and printed when all are done, followed by the pass/fail summary per slot.
+ * The read commands write a file per slot, see read_mcu (), and the
+ * programming times of all the slots are saved at the end. Returns the exit
+ * status.
+ */
+typedef struct {
+  gmt_ctx   *ctx;
+  cli_args  *a;
+  int        argc;
+  char     **argv;
+  int        ok;
+  char      *log;	//output of the slot
+  size_t     log_size;
+} gang_slot;
+
+static void *
+gang_thread (void *arg)
+{
+  gang_slot *s = arg;
+  gmt_ctx   *ctx = s->ctx;
+
+  if (Gmt_Open (ctx) || run_jobs (ctx, s->a, s->argc, s->argv)
+      || (s->a->script && run_script (ctx, s->a)) || Gmt_Close (ctx))
+    return NULL;
+  if (s->a->prog_mode & PROG_MODE_VERBOSE)
+    Gmt_Print_Timings (ctx);
+  s->ok = 1;
+  return NULL;
+}
+
+/* Copies the last non empty line of the slot output in line */
+static void
+last_line (const char *log, size_t size, char *line, int lsize)
+{
+  const char *end = log + size;
+
+  line[0] = 0x00;
+  while (end > log && end[-1] == '\n')
+    end--;
+  const char *p = end;
+  while (p > log && p[-1] != '\n')
+    p--;
+  snprintf (line, lsize, "%.*s", (int)(end - p), p);
+}
+
+static int
+gang_run (gmt_ctx *ctx, cli_args *a, int argc, char **argv)
+{
+  char      serials[GANG_MAX_SLOTS][32];
+  gang_slot slot[GANG_MAX_SLOTS];
+  pthread_t thread[GANG_MAX_SLOTS];
+  char      line[128];
+  uint32_t  mask = a->gang_mask;
+  int       n, err, fails = 0;
+
+  n = Gmt_List_Probes (serials, GANG_MAX_SLOTS);
+  if (n > GANG_MAX_SLOTS)
+    n = GANG_MAX_SLOTS;
+  if (!mask)
+    mask = (n < 32) ? ((1u<<n) - 1) : 0xFFFFFFFF;
+  if (!mask) {
+    fprintf (ctx->out, "No STLinkV2 device connected!\n");
+    return EXIT_FAILURE;
+  }
+
+  fprintf (ctx->out, "...gang programming on %d probe(s)\n",
+      __builtin_popcount (mask));
+  fflush (ctx->out);
+  memset (slot, 0x00, sizeof(slot));
+  for (int i=0; i<GANG_MAX_SLOTS; i++) {
+    gang_slot *s = &slot[i];
+    FILE      *out;
+
+    //a selected probe that is not connected is a failed slot
+    if (!(mask & (1u<<i)) || i >= n)
+      continue;
+    s->a = a;
+    s->argc = argc;
+    s->argv = argv;
+    out = open_memstream (&s->log, &s->log_size);
+    if (!out) {
+      fprintf (ctx->out, "%s\n", strerror(errno));
+      continue;
+    }
+    s->ctx = Gmt_Ctx_Clone (ctx);
+    if (!s->ctx) {
+      fprintf (out, "%s\n", strerror(errno));
+      fclose (out);
+      continue;
+    }
+    Gmt_Set_Output (s->ctx, out);
+    Gmt_Set_Probe (s->ctx, i);
+    err = pthread_create (&thread[i], NULL, gang_thread, s);
+    if (err) {
+      fprintf (out, "%s\n", strerror(err));
+      fclose (out);
+      Gmt_Ctx_Free (s->ctx);
+      s->ctx = NULL;
+    }
+  }
+
+  for (int i=0; i<GANG_MAX_SLOTS; i++) {
+    gang_slot *s = &slot[i];
+
+    if (!s->ctx)
+      continue;
+    FILE *out = s->ctx->out;
+
+    pthread_join (thread[i], NULL);
+    Gmt_Add_Timings (ctx, s->ctx);
+    Gmt_Ctx_Free (s->ctx);
+    s->ctx = NULL;
+    fclose (out);
+  }
+  //one --timings file for the µC type, written once for all the slots
+  Gmt_Save_Timings (ctx);
+
+  for (int i=0; i<GANG_MAX_SLOTS; i++) {
+    if (!(mask & (1u<<i)) || !slot[i].log_size)
+      continue;
+    fprintf (ctx->out, "--- Slot %d [%s]\n", i, serials[i]);
+    fwrite (slot[i].log, 1, slot[i].log_size, ctx->out);
+  }
+  for (int i=0; i<GANG_MAX_SLOTS; i++) {
+    gang_slot *s = &slot[i];
+
+    if (!(mask & (1u<<i)))
+      continue;
+    if (!s->ok)
+      fails++;
+    if (i >= n) {
+      fprintf (ctx->out, "Slot %d: FAIL, not connected\n", i);
+      continue;
+    }
+    last_line (s->log, s->log_size, line, sizeof(line));
+    fprintf (ctx->out, "Slot %d [%s]: %s, %s\n", i, serials[i],
+        s->ok ? "PASS" : "FAIL", line);
+    free (s->log);
+  }
+  fprintf (ctx->out, "%s\n",
+      fails ? "Gang programming failed" : "Gang programming done");
+  return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Daemon mode.
+ * The daemon keeps the STLink open and runs the jobs sent by the --remote
+ * clients on a Unix socket, one client at a time. A request is the length of
+ * the data (uint32_t) followed by the NUL terminated strings: the client's
+ * working directory and its arguments. The answer is the text printed by the
+ * jobs, a NUL byte and the exit status. Between jobs the µC is reset and runs,
+ * a new job only rewrites SWIM_CSR, see Gmt_Resume ().
+ */
+#define DAEMON_SOCKET		"/tmp/gmtflasher/daemon%d.sock"
+#define DAEMON_MAX_REQUEST	0x10000
+#define DAEMON_MAX_ARGS		256
+
+static volatile sig_atomic_t daemon_stop;
+
+static void
+daemon_signal (int sig)
+{
+  daemon_stop = 1;
+}
 
-    (prog_mode & PROG_MODE_STM8L) ? (iaspr = 0x5054) : (iaspr = 0x505F);
-    Stlink_Write_Byte (iaspr, 0x00);
+static int
+daemon_socket_addr (struct sockaddr_un *sa, int probe)
+{
+  memset (sa, 0x00, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  snprintf (sa->sun_path, sizeof(sa->sun_path), DAEMON_SOCKET, probe);
+  return socket (AF_UNIX, SOCK_STREAM, 0);
+}
+
+static int
+read_full (int fd, void *buf, size_t cnt)
+{
+  while (cnt) {
+    ssize_t q = read (fd, buf, cnt);
+    if (q <= 0) {
+      if (q == -1 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf = (char *)buf + q;
+    cnt -= q;
   }
+  return 0;
+}
 
-//release CPU
-/*
-  Stlink_Write_Byte (0x7F80, 0x00);
-  Stlink_Write_Byte (STM8_DM_CSR2, 0x00);
-  Stlink_Swim_Cmd (STLINK_SWIM_RESET);
-*/
+static int
+write_full (int fd, const void *buf, size_t cnt)
+{
+  while (cnt) {
+    ssize_t q = write (fd, buf, cnt);
+    if (q <= 0) {
+      if (q == -1 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf = (const char *)buf + q;
+    cnt -= q;
+  }
+  return 0;
+}
 
-//reset device
-  Stlink_Swim_Cmd (STLINK_SWIM_GEN_RST);
-  if (stlink_wait_swim_idle ()) {
-    printf ("Error, µC reset: SWIM status not idle\n");
+/* Runs the jobs of one request, with the options of the daemon as default */
+static int
+daemon_exec (gmt_ctx *ctx, cli_args *da, char *cwd, int argc, char **argv)
+{
+  cli_args a;
+  int q;
+
+  memset (&a, 0x00, sizeof(a));
+  if (chdir (cwd)) {
+    fprintf (ctx->out, "%s: %s\n", cwd, strerror(errno));
+    return -1;
+  }
+  if (parse_args (ctx, argc, argv, &a))
+    return -1;
+  if (a.daemon || a.gang) {
+    fprintf (ctx->out, "--daemon and --gang can not be sent to a daemon!\n");
+    return -1;
+  }
+  if (a.ofile_name && !strcmp (a.ofile_name, "-")) {
+    fprintf (ctx->out, "-o - can not be sent to a daemon!\n");
+    return -1;
+  }
+  if (!a.mcu_name)
+    a.mcu_name = da->mcu_name;
+  q = check_jobs (ctx, &a);
+  if (q)
+    return (q < 0) ? -1 : 0;
+
+  //a different µC is only looked up for this job
+  if (strcasecmp (a.mcu_name, ctx->uc.name) && Gmt_Set_Mcu (ctx, a.mcu_name)) {
+    Gmt_Set_Mcu (ctx, da->mcu_name);
+    return -1;
+  }
+  Gmt_Set_Mode (ctx, a.prog_mode | da->prog_mode);
+  if ( (a.hexfile_name && Gmt_Load_Hex (ctx, a.hexfile_name))
+      || Gmt_Resume (ctx) ) {
+    q = -1;
+  } else {
+    q = run_jobs (ctx, &a, argc, argv);
+    if (!q && a.script)
+      q = run_script (ctx, &a);
+    if (Gmt_Release (ctx))
+      q = -1;
+  }
+  //after an error the STLink is reopened by the next job
+  if (q)
+    Gmt_Close (ctx);
+  if (ctx->prog_mode & PROG_MODE_VERBOSE)
+    Gmt_Print_Timings (ctx);
+  Gmt_Set_Mode (ctx, da->prog_mode);
+  return q;
+}
+
+static void
+daemon_job (gmt_ctx *ctx, cli_args *da, int fd)
+{
+  char     *argv[DAEMON_MAX_ARGS];
+  int      argc = 0;
+  uint32_t len;
+  char     *req, *p;
+  FILE     *out;
+  int      q = -1;
+
+  if (read_full (fd, &len, sizeof(len)) || !len || len > DAEMON_MAX_REQUEST)
+    return;
+  req = malloc (len + 1);
+  if (!req)
+    return;
+  if (read_full (fd, req, len)) {
+    free (req);
+    return;
+  }
+  req[len] = 0x00;
+
+  out = fdopen (dup (fd), "w");
+  if (!out) {
+    free (req);
+    return;
+  }
+  Gmt_Set_Output (ctx, out);
+
+  //the first string is the working directory of the client
+  argv[argc++] = "gmtflasher";
+  p = req + strlen (req) + 1;
+  while (p < req + len && argc < DAEMON_MAX_ARGS) {
+    argv[argc++] = p;
+    p += strlen (p) + 1;
+  }
+  if (p < req + len)
+    fprintf (out, "Too many arguments!\n");
+  else
+    q = daemon_exec (ctx, da, req, argc, argv);
+
+  fflush (out);
+  fputc (0x00, out);
+  fputc (q ? EXIT_FAILURE : EXIT_SUCCESS, out);
+  fclose (out);
+  Gmt_Set_Output (ctx, stdout);
+  free (req);
+}
+
+/* Opens the STLink and serves the --remote requests, until SIGINT or SIGTERM
+ */
+static int
+daemon_run (gmt_ctx *ctx, cli_args *da)
+{
+  struct sockaddr_un sa;
+  struct sigaction   sig;
+  int fd;
+
+  fd = daemon_socket_addr (&sa, da->probe);
+  if (fd == -1) {
+    printf ("%s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  unlink (sa.sun_path);
+  if (bind (fd, (struct sockaddr *)&sa, sizeof(sa)) || listen (fd, 8)) {
+    printf ("%s: %s\n", sa.sun_path, strerror(errno));
+    close (fd);
+    return EXIT_FAILURE;
+  }
+
+  //no SA_RESTART, so accept () returns on the signal
+  memset (&sig, 0x00, sizeof(sig));
+  sig.sa_handler = daemon_signal;
+  sigaction (SIGINT, &sig, NULL);
+  sigaction (SIGTERM, &sig, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  if (Gmt_Open (ctx) || Gmt_Release (ctx)) {
+    close (fd);
+    unlink (sa.sun_path);
+    return EXIT_FAILURE;
+  }
+  printf ("...daemon listening on %s\n", sa.sun_path);
+  fflush (stdout);
+
+  while (!daemon_stop) {
+    int cfd = accept (fd, NULL, NULL);
+    if (cfd == -1) {
+      if (errno == EINTR)
+        continue;
+      printf ("%s\n", strerror(errno));
+      break;
+    }
+    daemon_job (ctx, da, cfd);
+    close (cfd);
+  }
+
+  close (fd);
+  unlink (sa.sun_path);
+  printf ("...daemon stopped\n");
+  return Gmt_Close (ctx) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Sends the arguments to the daemon of the probe, prints its answer and
+ * returns the exit status of the jobs
+ */
+static int
+daemon_client (int argc, char **argv, int probe)
+{
+  struct sockaddr_un sa;
+  char     buf[4096];
+  char     *req;
+  uint32_t len;
+  ssize_t  q;
+  int      fd;
+
+  fd = daemon_socket_addr (&sa, probe);
+  if (fd == -1 || connect (fd, (struct sockaddr *)&sa, sizeof(sa))) {
+    printf ("No gmtflasher daemon on %s: %s\n", sa.sun_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (!getcwd (buf, sizeof(buf))) {
+    printf ("%s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  len = strlen (buf) + 1;
+  for (int i=1; i<argc; i++)
+    len += strlen (argv[i]) + 1;
+  if (len > DAEMON_MAX_REQUEST) {
+    printf ("Too many arguments!\n");
+    return EXIT_FAILURE;
+  }
+  req = malloc (len);
+  if (!req) {
+    printf ("%s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  char *p = stpcpy (req, buf) + 1;
+  for (int i=1; i<argc; i++)
+    p = stpcpy (p, argv[i]) + 1;
+  q = write_full (fd, &len, sizeof(len)) || write_full (fd, req, len);
+  free (req);
+  if (q) {
+    printf ("%s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  //print the answer up to the NUL byte, the exit status follows
+  int end = 0;
+  while ( (q = read (fd, buf, sizeof(buf))) > 0 ) {
+    char *z = memchr (buf, 0x00, q);
+    if (!z) {
+      fwrite (buf, 1, q, stdout);
+      continue;
+    }
+    fwrite (buf, 1, z - buf, stdout);
+    if (z + 1 < buf + q) {
+      end = 1;
+      q = z[1];
+      break;
+    }
+    if (read_full (fd, buf, 1) == 0) {
+      end = 1;
+      q = buf[0];
+    }
+    break;
+  }
+  close (fd);
+  if (!end) {
+    printf ("Connection to the gmtflasher daemon lost!\n");
+    return EXIT_FAILURE;
+  }
+  return q;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  cli_args      args;
+  gmt_ctx       *ctx;
+  int           q;
+
+  if ( atexit (exit_handler) ) {
+    printf (strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  ctx = gctx = Gmt_Ctx_New ();
+  if (!ctx) {
+    printf ("%s\n", strerror(errno));
+    exit (EXIT_FAILURE);
+  }
+
+//check user arguments, identify jobs and options
+  memset (&args, 0x00, sizeof(args));
+  if (parse_args (ctx, argc, argv, &args))
+    exit (EXIT_FAILURE);
+
+//with -o - the read data goes to stdout, the messages to stderr
+  if (args.ofile_name && !strcmp (args.ofile_name, "-"))
+    Gmt_Set_Output (ctx, stderr);
+
+  if (args.gang && args.ofile_name && !strcmp (args.ofile_name, "-")) {
+    fprintf (ctx->out, "-o - can not be used with --gang!\n");
     exit (EXIT_FAILURE);
   }
 
+//in remote mode the jobs are run by the daemon
+  if (args.remote)
+    exit (daemon_client (argc, argv, args.probe));
+
+  if (args.daemon) {
+    if (args.job & ~JOB_PRINT) {
+      printf ("No commands can be given with --daemon!\n");
+      exit (EXIT_FAILURE);
+    }
+    if (!args.mcu_name) {
+      printf ("No µC part number specified!\n");
+      exit (EXIT_FAILURE);
+    }
+  } else {
+    q = check_jobs (ctx, &args);
+    if (q)
+      exit ((q < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  Gmt_Set_Mode (ctx, args.prog_mode);
+  Gmt_Set_Probe (ctx, args.probe);
+  Gmt_Set_Chunk (ctx, args.swim_chunk);
+
+//identify the mcu from the xml file
+  if (Gmt_Set_Mcu (ctx, args.mcu_name))
+    exit (EXIT_FAILURE);
+
+//if we have an input file, we read its data blocks
+  if (args.hexfile_name && Gmt_Load_Hex (ctx, args.hexfile_name))
+    exit (EXIT_FAILURE);
+
+//check if /tmp/gmtflasher dir exists, if not create
+  if (mkdir ("/tmp/gmtflasher", 0777) && errno!=EEXIST) {
+    printf (strerror(errno));
+    printf ("\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (args.daemon)
+    exit (daemon_run (ctx, &args));
+
+  if (args.gang)
+    exit (gang_run (ctx, &args, argc, argv));
+
+//usb connection to STLINK and SWIM activation
+  if (Gmt_Open (ctx))
+    exit (EXIT_FAILURE);
+
+//rescan and execute jobs
+  if (run_jobs (ctx, &args, argc, argv))
+    exit (EXIT_FAILURE);
+
+//then the lines of the script, on the same session
+  if (args.script && run_script (ctx, &args))
+    exit (EXIT_FAILURE);
+
+//lock back the memory, reset the device and release the STLink
+  if (Gmt_Close (ctx))
+    exit (EXIT_FAILURE);
+
+  if (args.prog_mode & PROG_MODE_VERBOSE)
+    Gmt_Print_Timings (ctx);
+
 
   return 0;
 }
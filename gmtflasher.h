@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
 #include <string.h>
@@ -13,14 +14,28 @@
 #include <libxml/tree.h>
 #include <libusb.h>
 #include <stdarg.h>
+#include <setjmp.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <glob.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*----------------------------------------------------------------------------*/
 /* Local headers */
 
-#include "stlink.h"
+#include "libgmtflasher.h"
 #include "ihex.h"
+#include "stlink.h"
+#include "shadow.h"
+#include "rpipe.h"
 #include "version.h"
 
 
@@ -28,15 +43,26 @@
 /* Macros & defines */
 
 #define PRINT_IF_VERBOSE(...) do {		\
-  if (prog_mode & PROG_MODE_VERBOSE)		\
-    printf (__VA_ARGS__);			\
+  if (ctx->prog_mode & PROG_MODE_VERBOSE)	\
+    fprintf (ctx->out, __VA_ARGS__);		\
+} while (0)
+
+/* Errors are reported with GMT_FAIL, after the message was printed. Inside a
+ * library call it returns to the API function, that returns the error code,
+ * otherwise the process exits.
+ */
+#define GMT_FAIL(ctx, code) do {					\
+  (ctx)->err = (code);							\
+  if ((ctx)->jmp_set)							\
+    longjmp ((ctx)->jmp, 1);						\
+  exit (EXIT_FAILURE);							\
 } while (0)
 
 #define MALLOC_TST(ptr) do {						\
   if (!ptr) {								\
-    printf ("%s:%s:%i: %s\n", __FILE__, __func__, __LINE__,		\
+    fprintf (ctx->out, "%s:%s:%i: %s\n", __FILE__, __func__, __LINE__,	\
        strerror(errno));						\
-    exit (EXIT_FAILURE);						\
+    GMT_FAIL (ctx, GMT_ERR_NOMEM);					\
   }									\
 } while (0)
 
@@ -51,40 +77,71 @@ typedef struct {
   uint32_t add_1;
 } mcu;
 
-#define JOB_WRITE_ALL			0x000001
-#define JOB_READ_ALL			0x000002
-#define JOB_WRITE_FLASH			0x000004
-#define JOB_READ_FLASH			0x000008
-#define JOB_WRITE_EEPROM		0x000010
-#define JOB_READ_EEPROM			0x000020
-#define JOB_WRITE_OPT			0x000040
-#define JOB_READ_OPT			0x000080
-#define JOB_UNLOCK			0x000100
-#define JOB_LOCK			0x000200
-#define JOB_WRITE_BYTE			0x000400
-#define JOB_READ_BYTE			0x000800
-#define JOB_WRITE_WORD			0x001000
-#define JOB_READ_WORD			0x002000
-#define JOB_INC_BYTE			0x004000
-#define JOB_INC_WORD			0x008000
-#define JOB_READ_RANGE			0x010000
-#define JOB_PRINT			0x020000
+#define GANG_MAX_SLOTS			32
+
 /*----------------------------------------------------------------------------*/
-/* Globals */
+/* Flasher context */
 
-char *ghexfile_name;
-char *ofile_name;
-FILE *ghexfile;
+/* Everything a programming session needs lives here, so several sessions, on
+ * different probes, can run in the same process. Created by Gmt_Ctx_New ().
+ */
+struct gmt_ctx {
+  FILE                 *out;		//messages, stdout by default
+  libusb_context       *usbcontext;
+  libusb_device_handle *dev_handle;
+  int                   probe;		//index of the STLink to use
+  int                   clone;		//made by Gmt_Ctx_Clone ()
+  uint32_t              swim_chunk;	//SWIM read chunk size, 0 for default
+  int                   swim_hs;	//SWIM link at high speed
+  mcu                   uc;
 
-uint32_t prog_stat;
+  uint32_t              prog_stat;
   #define PROG_STAT_UL_FLASH		0x0001
   #define PROG_STAT_UL_EEPROM		0x0002
-  #define PROG_STAT_OFILE		0x0004
-uint32_t prog_mode;
-  #define PROG_MODE_VERBOSE		0x0001
-  #define PROG_MODE_STM8L		0x0002
-  #define PROG_MODE_FORCE_ALL		0x0004
-  #define PROG_MODE_PERSIST		0x0008
+  uint32_t              prog_mode;	//PROG_MODE_* flags
+
+  //input data, see Gmt_Load_Hex ()
+  char                 *hexfile_name;
+  unsigned char        *hexmap;		//hex file content, while loaded
+  size_t                hexmap_size;
+  int                   hexmap_mmap;	//mapped, else in a malloc buffer
+  int                   hex_shared;	//blk_add, data, ddef of another ctx
+  int                   mblocks;
+  uint32_t             *blk_add;
+  unsigned char        *data;
+  uint32_t             *ddef;		//defined bytes, see Ihex_Def_Get ()
+  unsigned char        *udata;		//µC content of the blocks, see diff_mcu ()
+  uint32_t             *dirty;		//per block, one bit per differing dword
+  rpipe                *rp;		//read pipeline of Gmt_Read ()
+  unsigned char        *rmap;		//raw output of Gmt_Read (), mapped
+  size_t                rmap_size;
+
+  //FLASH and EEPROM content known from previous sessions, see shadow.c
+  unsigned char        *shadow;
+  unsigned char        *shadow_known;	//one flag per block
+  int                   shadow_state;
+  char                  shadow_file[128];
+
+  //double buffered RAM flash loader, see stlink.c
+  int                   ldr_run;	//the loader routine runs
+  int                   ldr_next;	//buffer of the next block
+  uint32_t              ldr_add[2];	//block in each buffer, 0 if none
+  unsigned char         ldr_data[2][LOADER_BLOCK_MAX];
+
+  usb_txq_slot          txq[USB_TXQ_DEPTH];
+  int                   txq_pending;
+  int                   txq_next;
+  swim_batch            batch;
+  reg_shadow            regs;
+  swim_op_stat          swim_stat[SWIM_OP_CNT];
+  prog_op_stat          prog_op[PROG_OP_CNT];
+
+  jmp_buf               jmp;		//error return, see GMT_FAIL
+  int                   jmp_set;
+  int                   err;
+
+  unsigned char         scratch[0x10000];	//read buffer, one user at a time
+};
 
 /*----------------------------------------------------------------------------*/
 /* Project source files */
@@ -92,3 +149,5 @@ uint32_t prog_mode;
 #include "xml.c"
 #include "stlink.c"
 #include "ihex.c"
+#include "shadow.c"
+#include "rpipe.c"
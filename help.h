@@ -4,11 +4,42 @@ const char help_text[] =
 "Options:\n"
 "  -f          force, rewrite all, even if target memory already has the same content\n"
 "  -h          print this help\n"
-"  -o          output file, followed by name of output file in case of read commands\n"
+"  -o          output file, followed by name of output file in case of read commands,\n"
+"              - writes the data to stdout and the messages to stderr\n"
 "  -p          preserve, do not modify memory that is not defined in the input file\n"
 "  -v          verbose, show more what's being done\n"
+"  --bin       read commands write raw binary files instead of intel hex, with the\n"
+"              regions back to back and their addresses in the <file>.map sidecar\n"
+"  --chunk     SWIM read chunk size, followed by the size in bytes, default is the\n"
+"              STLink buffer size (6144) and it is reduced automatically if needed\n"
+"  --compare   read commands also compare the data read with the input file, and fail\n"
+"              if a byte defined in it differs\n"
+"  --crc       read commands also print the CRC-32 of the data read, the same as the\n"
+"              CRC-32 of the --bin file\n"
+"  --daemon    keep the STLink open and run the commands sent with --remote, on the\n"
+"              socket /tmp/gmtflasher/daemon<probe>.sock, until SIGINT or SIGTERM\n"
+"  --gang      gang programming, followed by 'all' or a comma separated list of probe\n"
+"              indexes (like 0,2,3); the commands run in parallel on all the probes,\n"
+"              then the output and a pass/fail summary are printed per probe; the\n"
+"              read commands write one file per probe, named with .slot<N> appended\n"
 "  --help      print this help, same as -h\n"
 "  --listmcu   print known µCs (from xml definition file, this is a user editable list)\n"
+"  --listprobes print the connected STLinkV2 probes and their indexes\n"
+"  --loader    programm the FLASH and EEPROM blocks from a routine in the µC RAM, that\n"
+"              programms a block while the next one is sent\n"
+"  --lowspeed  keep the SWIM link at low speed, high speed is used if supported\n"
+"  --plan      dry run of the -w, -wf, -we and -wo commands: print the strategy chosen\n"
+"              per memory region (unchanged, dword or block writes) and its estimated time\n"
+"  --probe     use the probe with the given index, see --listprobes, default 0\n"
+"  --remote    send the command line to the daemon of the probe, see --daemon, and\n"
+"              print its result; input and output files are opened by the daemon\n"
+"  --script    run the commands of the given file, one command line per line with its\n"
+"              own arguments and data file, all in one session; '#' starts a comment\n"
+"  --shadow    keep a copy of the written memory in /tmp/gmtflasher, per µC unique ID,\n"
+"              so unchanged blocks are skipped without reading them back; use -f to\n"
+"              refresh it if the µC was written by another tool\n"
+"  --timings   keep the measured programming times per µC type in /tmp/gmtflasher and\n"
+"              start the next sessions with them, for the dword/block write choice\n"
 "  --verbose   verbose, show more what's being done, same as -v\n"
 "  --version   print version information\n"
 "\n"
@@ -29,6 +60,10 @@ const char help_text[] =
 "  -wb   write byte, followed by address to be written and the byte value\n"
 "  -ww   write word, followed by address to be written and the word value\n"
 
+"  -c    check, verify all data of the input file against the µC (*)\n"
+"  -cf   check flash memory (*)\n"
+"  -ce   check eeprom memory (*)\n"
+
 "  -ib   incrememt byte, followed by address to be incremented\n"
 "  -iw   increment word, followed by address to be incremented\n"
 
@@ -40,7 +75,13 @@ const char help_text[] =
 "Multiple command arguments can be given, the processing order is the order in which they apper.\n"
 "If a combination of the commands: -wf, -we, -wo; is used, they can only access data from the same input file, the last argument. In this case the required data needs to be assembled into the same file. During the multiple write commnads, the device is not reset, so writing the option bytes does not activate the new configuration until all commands are executed.\n"
 "If the -w command is used, all defined data in the input file will be written. If the input file only contains the flash address range, the command is equivalent to -wf command.\n"
+"The check commands compute a CRC of the fully defined FLASH and EEPROM blocks on the µC, with a routine loaded in RAM, so only the CRC is read back; the other blocks are read back and compared.\n"
 "Assembling all data into one file has the advantage of full device definition, not needing separate files for flash, eeprom and option bytes, and selective programming can be used.\n"
+"With --script, each line of the file is a command line like the ones above, without the -u option and the options that apply to the whole session (--probe, --chunk, --lowspeed, --loader, --shadow, --timings, ...), and its data file or -o output file only apply to that line. The memory is unlocked once and the device is reset once, at the end of the script, e.g.:\n"
+"  -wf firmware.ihx\n"
+"  -we calibration.ihx\n"
+"  -wb 0x4000 0x5A\n"
+"  -rf -o \"flash dump.ihx\"\n"
 "When using the -o option with read commands, to define the output file, do not use multiple reads, as they will all rewrite the same file defined as output.\n"
 "\n"
 "Report bugs to cristian.gall@galmot.eu";
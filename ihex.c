@@ -1,94 +1,106 @@
+/* Hex digit decoding.
+ * hex_nibble gives the value of a hex digit ORed with HEX_DIGIT, 0 for the
+ * other characters, so a pair is valid if both have HEX_DIGIT. The data fields
+ * are decoded by ihex_decode (), 16 bytes at a time with SSE2, that also sums
+ * the bytes for the record checksum.
+ */
+#define HEX_DIGIT			0x10
+
+static const unsigned char hex_nibble[256] = {
+  ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+  ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+  ['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E,
+  ['F'] = 0x1F,
+  ['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D, ['e'] = 0x1E,
+  ['f'] = 0x1F,
+};
 
 static int
-read_next_byte (unsigned char *buffer, int offset)
+read_next_byte (const unsigned char *buffer, int offset)
 {
-  int qh, ql;
-
-  qh = *(buffer+offset);
-  ql = *(buffer+offset+1);
-
-  if ( qh<0x3A && qh>0x2F ) {
-    qh -= 0x30;
-  } else {
-    switch (qh) {
-    case 'f':
-    case 'F':
-      qh = 0xF;
-      break;
-    case 'e':
-    case 'E':
-      qh = 0xE;
-      break;
-    case 'd':
-    case 'D':
-      qh = 0xD;
-      break;
-    case 'c':
-    case 'C':
-      qh = 0xC;
-      break;
-    case 'b':
-    case 'B':
-      qh = 0xB;
-      break;
-    case 'a':
-    case 'A':
-      qh = 0xA;
-      break;
-    default:
-      return -1;
-    }
-  }
+  int qh = hex_nibble[buffer[offset]];
+  int ql = hex_nibble[buffer[offset+1]];
 
-  if ( ql<0x3A && ql>0x2F ) {
-    ql -= 0x30;
-  } else {
-    switch (ql) {
-    case 'f':
-    case 'F':
-      ql = 0xF;
-      break;
-    case 'e':
-    case 'E':
-      ql = 0xE;
-      break;
-    case 'd':
-    case 'D':
-      ql = 0xD;
-      break;
-    case 'c':
-    case 'C':
-      ql = 0xC;
-      break;
-    case 'b':
-    case 'B':
-      ql = 0xB;
-      break;
-    case 'a':
-    case 'A':
-      ql = 0xA;
-      break;
-    default:
-      return -1;
-    }
+  if ( !(qh & ql & HEX_DIGIT) )
+    return -1;
+  return ((qh & 0x0F)<<4) | (ql & 0x0F);
+}
+
+/* Decodes the cnt bytes of the 2*cnt hex digits at hex in out, and adds them to
+ * *sum. Returns -1 if a character is not a hex digit.
+ */
+static int
+ihex_decode_scalar (const unsigned char *hex, int cnt, unsigned char *out,
+    uint32_t *sum)
+{
+  uint32_t s = 0;
+  int      ok = HEX_DIGIT;
+
+  for (int i=0; i<cnt; i++) {
+    int qh = hex_nibble[hex[2*i]];
+    int ql = hex_nibble[hex[2*i+1]];
+
+    ok &= qh & ql;
+    out[i] = ((qh & 0x0F)<<4) | (ql & 0x0F);
+    s += out[i];
   }
+  *sum += s;
+  return ok ? 0 : -1;
+}
+
+#ifdef __SSE2__
+/* 16 hex digits to their values, the mask of the valid ones in *valid */
+static __m128i
+hex_digits_sse2 (__m128i c, int *valid)
+{
+  const __m128i minus1 = _mm_set1_epi8 (-1);
+  //'0'..'9'
+  __m128i d = _mm_sub_epi8 (c, _mm_set1_epi8 ('0'));
+  __m128i isdig = _mm_and_si128 (_mm_cmpgt_epi8 (d, minus1),
+      _mm_cmplt_epi8 (d, _mm_set1_epi8 (10)));
+  //'a'..'f' and 'A'..'F'
+  __m128i l = _mm_sub_epi8 (_mm_or_si128 (c, _mm_set1_epi8 (0x20)),
+      _mm_set1_epi8 ('a'));
+  __m128i islet = _mm_and_si128 (_mm_cmpgt_epi8 (l, minus1),
+      _mm_cmplt_epi8 (l, _mm_set1_epi8 (6)));
 
-  return (qh<<4)|ql;
+  *valid = _mm_movemask_epi8 (_mm_or_si128 (isdig, islet));
+  return _mm_or_si128 (_mm_and_si128 (isdig, d),
+      _mm_and_si128 (islet, _mm_add_epi8 (l, _mm_set1_epi8 (10))));
 }
 
 static int
-read_next_word (unsigned char *buffer, int offset)
+ihex_decode (const unsigned char *hex, int cnt, unsigned char *out,
+    uint32_t *sum)
 {
-  int h, l;
+  const __m128i low = _mm_set1_epi16 (0x00FF);
+  __m128i acc = _mm_setzero_si128 ();
+  int valid = 0xFFFF;
+  int i, v0, v1;
 
-  h = read_next_byte (buffer, offset);
-  if (h==-1)
-    return -1;
-  l = read_next_byte (buffer, offset + 2);
-  if (l==-1)
+  for (i=0; i+16<=cnt; i+=16) {
+    __m128i a = hex_digits_sse2 (_mm_loadu_si128 ((const __m128i *)(hex + 2*i)),
+        &v0);
+    __m128i b = hex_digits_sse2 (_mm_loadu_si128 ((const __m128i *)
+        (hex + 2*i + 16)), &v1);
+    valid &= v0 & v1;
+    //16-bit lanes of {high nibble, low nibble}
+    a = _mm_or_si128 (_mm_slli_epi16 (_mm_and_si128 (a, low), 4),
+        _mm_srli_epi16 (a, 8));
+    b = _mm_or_si128 (_mm_slli_epi16 (_mm_and_si128 (b, low), 4),
+        _mm_srli_epi16 (b, 8));
+    __m128i bytes = _mm_packus_epi16 (a, b);
+    _mm_storeu_si128 ((__m128i *)(out + i), bytes);
+    acc = _mm_add_epi64 (acc, _mm_sad_epu8 (bytes, _mm_setzero_si128 ()));
+  }
+  *sum += _mm_cvtsi128_si32 (acc) + _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8));
+  if (valid != 0xFFFF)
     return -1;
-  return (h<<8)|l;
+  return ihex_decode_scalar (hex + 2*i, cnt - i, out + i, sum);
 }
+#else
+#define ihex_decode			ihex_decode_scalar
+#endif
 
 /*
 From wiki:
@@ -123,221 +135,418 @@ hexadecimal digits-which make up a byte-as described below:
 */
 
 
-/* Extended memory segment address is not handled in the fucntion!!!
- * address is the 16-bit address to be written in the file, in case address > 0xFFFF
- * only the lower 16-bits are significant.
+/* Buffered intel hex output, for the read back of the µC memory.
+ * The records are formatted in the buffer of the writer, with the checksum
+ * summed on the way, and the buffer goes to the file descriptor with one
+ * write () when full. The descriptor may be a file, a pipe or stdout.
+ * The writer runs in the sink thread of the read pipeline, see rpipe.c, so it
+ * does not fail the session: the functions return -1 on a write error, with
+ * errno set, 0 otherwise.
  */
-void
-Ihex_Wr_Data (unsigned char *data, uint32_t address, uint32_t size, FILE *file)
+static const char hex_upper[] = "0123456789ABCDEF";
+
+ihex_wr *
+Ihex_Wr_New (gmt_ctx *ctx, int fd)
 {
-  uint32_t lcnt, dcnt, chksum;
+  ihex_wr *w = malloc (sizeof(ihex_wr));
+
+  MALLOC_TST (w);
+  w->fd = fd;
+  w->len = 0;
+  w->seg = 0;
+  return w;
+}
+
+int
+Ihex_Wr_Flush (ihex_wr *w)
+{
+  uint32_t done = 0;
+  ssize_t  n;
+
+  while (done < w->len) {
+    n = write (w->fd, w->buf + done, w->len - done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    done += n;
+  }
+  w->len = 0;
+  return 0;
+}
+
+static inline unsigned char *
+ihex_put_byte (unsigned char *p, uint32_t byte)
+{
+  p[0] = hex_upper[(byte>>4) & 0x0F];
+  p[1] = hex_upper[byte & 0x0F];
+  return p + 2;
+}
+
+/* Appends a record of type, with size bytes of data, to the output. Only the
+ * lower 16 bits of address are written.
+ */
+int
+Ihex_Wr_Record (ihex_wr *w, uint32_t type, uint32_t address,
+    const unsigned char *data, uint32_t size)
+{
+  unsigned char *p;
+  uint32_t       chksum;
+
+  if ( (w->len + IHEX_WR_RECORD_MAX > sizeof(w->buf)) && Ihex_Wr_Flush (w) )
+    return -1;
+  address &= 0xFFFF;
+  chksum = size + (address>>8) + (address & 0xFF) + type;
+  p = w->buf + w->len;
+  *p++ = ':';
+  p = ihex_put_byte (p, size);
+  p = ihex_put_byte (p, address>>8);
+  p = ihex_put_byte (p, address);
+  p = ihex_put_byte (p, type);
+  for (uint32_t i=0; i<size; i++) {
+    p = ihex_put_byte (p, data[i]);
+    chksum += data[i];
+  }
+  p = ihex_put_byte (p, 0x100 - chksum);
+  *p++ = '\n';
+  w->len = p - w->buf;
+  return 0;
+}
+
+/* Writes size bytes at the 20-bit address as data records of 32 bytes. An
+ * extended segment address record is written first when a record is outside
+ * of the current segment.
+ */
+int
+Ihex_Wr_Data (ihex_wr *w, uint32_t address, const unsigned char *data,
+    uint32_t size)
+{
+  unsigned char usba[2];
+  uint32_t      lcnt;
 
-  dcnt = 0;
   while (size) {
-    (size > 32) ? (lcnt=32) : (lcnt=size);
-    fprintf (file, ":%02X%04X00", lcnt, address);
-    chksum = lcnt + (address>>8) + (address & 0xFF);
-    for (int i=0; i<lcnt; i++) {
-      fprintf (file, "%02X", data[dcnt]);
-      chksum += data[dcnt++];
+    lcnt = (size > 32) ? 32 : size;
+    if ( (address - w->seg + lcnt) > 0x10000 ) {
+      w->seg = address & 0xFFFF0;
+      usba[0] = w->seg>>12;
+      usba[1] = w->seg>>4;
+      if (Ihex_Wr_Record (w, 0x02, 0, usba, 2))
+        return -1;
     }
-    fprintf (file, "%02X\n", (0x100 - chksum) & 0xFF);
+    if (Ihex_Wr_Record (w, 0x00, address - w->seg, data, lcnt))
+      return -1;
     address += lcnt;
+    data += lcnt;
     size -= lcnt;
   }
+  return 0;
 }
 
-/* La apelare pointerul trebuie sa fie la inceputul fisierului. Functia se
- * apeleaza dupa deschiderea fisierului si returneaza numarul de blocuri
- * definite in fisier.
- * block_add reprezinta adresa aliniata de start a blocului curent.
- * blk_size trebuie să fie de forma 2^x (32, 64...)
- */
+/* Writes the end-of-file record and flushes the output */
 int
-Ihex_Count_Blocks (FILE *file, int blk_size)
+Ihex_Wr_End (ihex_wr *w)
 {
-  unsigned char line[512+32];
-  int off, line_index, line_sta, line_end;
-  int block_add, block_index;
+  if (Ihex_Wr_Record (w, 0x01, 0, NULL, 0))
+    return -1;
+  return Ihex_Wr_Flush (w);
+}
 
-  line_index  = 0;
-  off = 0;
-  block_index = 0;
-  block_add = 0;
+/* Definition mask of the hex image.
+ * ctx->ddef has one bit per byte of ctx->data, set if the byte is defined in
+ * the hex file, in DEF_WORDS (block size) 32-bit words per block: the byte j of
+ * a block is the bit j%32 of its word j/32. A word is tested for any or all
+ * bytes defined at once, see Ihex_Def_Full () and dirty_dwords ().
+ */
+int
+Ihex_Def_Get (const uint32_t *def, uint32_t i)
+{
+  return (def[i/32] >> (i%32)) & 1;
+}
 
-  while ( fgets((char *)line, sizeof(line), file) ) {
-    line_index++;
-    if (line[0]!=':')
-      goto file_err;
-    //read the number of data bytes in the record
-    line_end = read_next_byte (line, 1);
-    if (line_end==-1)
-      goto file_err;
-    //read the address of the record
-    line_sta = read_next_word (line, 3);
-    if (line_sta==-1)
-      goto file_err;
-    line_sta += off;
-    line_end += line_sta;
-    //read the record type
-    switch (read_next_byte (line, 7)) {
-    case -1:
-      goto file_err;
-    case 0x00:
-    //data record
-      if (line_sta >= (block_add + blk_size)) {
-        block_add = line_sta & ~(blk_size - 1);
-        block_index++;
-      } else if (line_sta < block_add) {
-        block_add = line_sta & ~(blk_size - 1);
-        block_index++;
-      }
-      while (line_end > (block_add + blk_size)) {
-        block_add += blk_size;
-        block_index++;
-      }
-      break;
-    case 0x01:
-    //end of file record
-      break;
-    case 0x02:
-    //extended address
-      off = read_next_word (line, 9);
-      if (off==-1)
-        goto file_err;
-      off <<= 4;
-      break;
-    case 0x04:
-    //extended linear address record
-      off = read_next_word (line, 9);
-      if (off==-1)
-        goto file_err;
-      off <<= 16;
-      break;
-    default:
-      printf (
-	      "Not supported record type found in %s file, line no. %d\n",
-          ghexfile_name, line_index);
-      exit (EXIT_FAILURE);
-    }
+//marks the n bytes from i as defined
+void
+Ihex_Def_Set (uint32_t *def, uint32_t i, uint32_t n)
+{
+  while (n) {
+    uint32_t cnt = 32 - i%32;
+    if (cnt > n)
+      cnt = n;
+    def[i/32] |= ((cnt == 32) ? ~0u : ((1u << cnt) - 1)) << (i%32);
+    i += cnt;
+    n -= cnt;
   }
-  return block_index;
+}
 
-file_err:
-  printf ("Error in %s file, line no. %d, not an intel hex file?\n",
-      ghexfile_name, line_index);
-  exit (EXIT_FAILURE);
+//returns 1 if the size bytes are all defined, size is a multiple of 32
+int
+Ihex_Def_Full (const uint32_t *def, uint32_t size)
+{
+  uint32_t all = ~0u;
+
+  for (uint32_t w=0; w<size/32; w++)
+    all &= def[w];
+  return all == ~0u;
 }
 
+//Ihex_Def_Merge () without SSE2, also for the checks of bench_ihex.c
+static inline void
+ihex_def_merge_scalar (unsigned char *out, const unsigned char *data,
+    const uint32_t *def, const unsigned char *uc, uint32_t size)
+{
+  for (uint32_t i=0; i<size; i++)
+    out[i] = Ihex_Def_Get (def, i) ? data[i] : uc[i];
+}
 
-/* La apelare *data si *ddef trebuie sa fie resetate, functia scrie in *data
- * doar octetii definiti in fisier, iar in *ddef se indica octetii definiti
- * cu valoarea 0xFF pentru a se putea folosi ca mask la programarea selectiva
+/* Merges with the µC content: out gets the defined bytes of data and the other
+ * ones from uc, size bytes, a multiple of 32. out may be uc.
  */
 void
-Ihex_Read_Data_Blocks (FILE *file, int blk_size, uint32_t *blk_ads,
-    unsigned char *data, unsigned char *ddef)
+Ihex_Def_Merge (unsigned char *out, const unsigned char *data,
+    const uint32_t *def, const unsigned char *uc, uint32_t size)
+{
+#ifdef __SSE2__
+  //the mask bit of each byte, for the bytes 0..7 and 8..15 of 16 bits
+  const __m128i sel = _mm_set_epi8 (-128, 64, 32, 16, 8, 4, 2, 1,
+      -128, 64, 32, 16, 8, 4, 2, 1);
+
+  for (uint32_t i=0; i<size; i+=16) {
+    uint32_t bits = (def[i/32] >> (i%32)) & 0xFFFF;
+    __m128i m = _mm_cvtsi32_si128 (bits);
+    //16 bits to 16 bytes of 0x00/0xFF
+    m = _mm_unpacklo_epi8 (m, m);
+    m = _mm_unpacklo_epi16 (m, m);
+    m = _mm_unpacklo_epi32 (m, m);
+    m = _mm_cmpeq_epi8 (_mm_and_si128 (m, sel), sel);
+    __m128i d = _mm_loadu_si128 ((const __m128i *)(data + i));
+    __m128i u = _mm_loadu_si128 ((const __m128i *)(uc + i));
+    _mm_storeu_si128 ((__m128i *)(out + i),
+        _mm_or_si128 (_mm_and_si128 (m, d), _mm_andnot_si128 (m, u)));
+  }
+#else
+  ihex_def_merge_scalar (out, data, def, uc, size);
+#endif
+}
+
+/* Appends a block at address to the block image of ctx, that grows by doubling
+ * its capacity, *cap blocks. The new blocks are all undefined.
+ */
+static void
+ihex_new_block (gmt_ctx *ctx, int *cap, uint32_t blk_size, uint32_t address)
 {
-  unsigned char line[512+32];
-  int  off, i;
-  int  line_index, line_cnt, line_add, line_rec;
-  int  block_add, block_index;
-  uint32_t checksum;
+  if (ctx->mblocks == *cap) {
+    int n = *cap ? 2 * *cap : 64;
+    uint32_t *add = realloc (ctx->blk_add, n*sizeof(*add));
+    MALLOC_TST (add);
+    ctx->blk_add = add;
+    unsigned char *data = realloc (ctx->data, n*blk_size);
+    MALLOC_TST (data);
+    ctx->data = data;
+    uint32_t *ddef = realloc (ctx->ddef, n*DEF_WORDS(blk_size)*4);
+    MALLOC_TST (ddef);
+    ctx->ddef = ddef;
+    memset (ctx->data + *cap*blk_size, 0x00, (n - *cap)*blk_size);
+    memset (ctx->ddef + *cap*DEF_WORDS(blk_size), 0x00,
+        (n - *cap)*DEF_WORDS(blk_size)*4);
+    *cap = n;
+  }
+  ctx->blk_add[ctx->mblocks++] = address;
+}
+
+//orders {address, index} pairs by address, then by index
+static int
+ihex_cmp_block (const void *a, const void *b)
+{
+  const uint32_t *x = a;
+  const uint32_t *y = b;
+
+  if (x[0] != y[0])
+    return (x[0] > y[0]) - (x[0] < y[0]);
+  return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+/* Sorts the blocks by address and merges the blocks of the same address, the
+ * bytes defined later in the file overwriting the earlier ones. Nothing is done
+ * for a file already in address order, the usual case.
+ */
+static void
+ihex_merge_blocks (gmt_ctx *ctx, uint32_t blk_size)
+{
+  int            n = ctx->mblocks;
+  int            u = 0;
+  int            i;
+  uint32_t       dw = DEF_WORDS(blk_size);
+  uint32_t     (*order)[2];
+  uint32_t      *add, *ddef;
+  unsigned char *data;
 
-  line_index = 0;
-  off = 0;
-  block_index = 0;
-  block_add = 0;
+  for (i=1; i<n && ctx->blk_add[i-1] < ctx->blk_add[i]; i++)
+    ;
+  if (i >= n)
+    return;
 
-  fseek (file, 0, SEEK_SET);
+  order = malloc (n*sizeof(*order));
+  add = malloc (n*sizeof(*add));
+  data = calloc (n, blk_size);
+  ddef = calloc (n, dw*4);
+  if (!order || !add || !data || !ddef) {
+    free (order);
+    free (add);
+    free (data);
+    free (ddef);
+    fprintf (ctx->out, "%s: %s\n", __func__, strerror(ENOMEM));
+    GMT_FAIL (ctx, GMT_ERR_NOMEM);
+  }
+  for (i=0; i<n; i++) {
+    order[i][0] = ctx->blk_add[i];
+    order[i][1] = i;
+  }
+  qsort (order, n, sizeof(*order), ihex_cmp_block);
 
-  while ( fgets((char *)line, sizeof(line), file) ) {
+  for (i=0; i<n; i++) {
+    const unsigned char *sd = ctx->data + order[i][1]*blk_size;
+    const uint32_t      *sm = ctx->ddef + order[i][1]*dw;
+
+    if (!u || add[u-1] != order[i][0])
+      add[u++] = order[i][0];
+    Ihex_Def_Merge (data + (u-1)*blk_size, sd, sm, data + (u-1)*blk_size,
+        blk_size);
+    for (uint32_t w=0; w<dw; w++)
+      ddef[(u-1)*dw + w] |= sm[w];
+  }
+  free (order);
+  free (ctx->blk_add);
+  free (ctx->data);
+  free (ctx->ddef);
+  ctx->blk_add = add;
+  ctx->data = data;
+  ctx->ddef = ddef;
+  ctx->mblocks = u;
+}
+
+/* Decodes the intel hex file in map, size bytes, in one pass, in the blocks of
+ * ctx (blk_add, data, ddef and mblocks, that must be empty). The blocks are
+ * then in address order, one per address, whatever the order of the records in
+ * the file: a byte defined several times keeps its last value. data gets only
+ * the bytes defined in the file, marked in the ddef bitmap, to be used as mask
+ * when programming. blk_size must be a power of 2. The lines have no length
+ * limit, the last one may miss its end of line. A record line may end with
+ * blanks only, and the end of file record ends the decoding: what follows is
+ * ignored, with a warning if it is not blank.
+ */
+void
+Ihex_Load (gmt_ctx *ctx, const unsigned char *map, size_t size,
+    uint32_t blk_size)
+{
+  const unsigned char *line = map;
+  const unsigned char *end = map + size;
+  const unsigned char *eol;
+  int       cap = 0;
+  int       line_index = 0;
+  int       line_cnt, line_add, line_rec;
+  int       eof = 0;
+  uint32_t  off = 0;
+  uint32_t  block_add = 0;
+  uint32_t  checksum;
+  size_t    len;
+  //address, type, data and checksum of a record
+  unsigned char rec[3 + 255 + 1];
+  unsigned char *rdata = rec + 3;
+
+  for ( ; line < end; line = eol + 1) {
+    eol = memchr (line, '\n', end - line);
+    if (!eol)
+      eol = end;
+    len = eol - line;
+    if (len && line[len-1] == '\r')
+      len--;
     line_index++;
-    //read the number of data bytes in the record
-    i = 1;
-    line_cnt = read_next_byte (line, i);
-    i += 2;
-    //read the address of the record
-    line_add = read_next_word (line, i);
-    i += 4;
-    checksum = line_cnt + (line_add>>8) + (line_add & 0xFF);
-    line_add += off;
-    //read the record type
-    line_rec = read_next_byte (line, i);
-    i += 2;
-    checksum += line_rec;
+
+    if (len < 11 || line[0] != ':')
+      goto file_err;
+    //read the number of data bytes in the record, then the rest in one go
+    line_cnt = read_next_byte (line, 1);
+    if (line_cnt == -1 || len < 11 + 2*(size_t)line_cnt)
+      goto file_err;
+    checksum = line_cnt;
+    if (ihex_decode (line + 3, 3 + line_cnt + 1, rec, &checksum))
+      goto file_err;
+    //only blanks may follow the checksum
+    for (size_t i=11 + 2*line_cnt; i<len; i++) {
+      if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r')
+        goto file_err;
+    }
+    line_add = ((rec[0]<<8) | rec[1]) + off;
+    line_rec = rec[2];
+
     switch (line_rec) {
     case 0x00:
     //data record
       if (line_cnt==0)
         goto file_err;
-      if (line_add >= (block_add + blk_size)) {
+      if (!ctx->mblocks || line_add < block_add
+          || line_add >= block_add + blk_size) {
         block_add = line_add & ~(blk_size - 1);
-        *(blk_ads + block_index) = block_add;
-        block_index++;
-      } else if (line_add < block_add) {
-        block_add = line_add & ~(blk_size - 1);
-        *(blk_ads + block_index) = block_add;
-        block_index++;
+        ihex_new_block (ctx, &cap, blk_size, block_add);
       }
-      for (int j=0, q; j<line_cnt; j++) {
+      //the record may span several blocks
+      for (int j=0, n; j<line_cnt; j+=n) {
         if ((line_add + j) >= (block_add + blk_size)) {
           block_add += blk_size;
-          *(blk_ads + block_index) = block_add;
-          block_index++;
+          ihex_new_block (ctx, &cap, blk_size, block_add);
         }
-        q = read_next_byte (line, i);
-        if (q==-1)
-          goto file_err;
-        checksum += q;
-        i += 2;
-        uint32_t po = (block_index-1)*blk_size + line_add - block_add + j;
-        *(data + po) = q;
-        *(ddef + po) = 0xFF;
+        n = block_add + blk_size - (line_add + j);
+        if (n > line_cnt - j)
+          n = line_cnt - j;
+        uint32_t po = line_add - block_add + j;
+        memcpy (ctx->data + (ctx->mblocks-1)*blk_size + po, rdata + j, n);
+        Ihex_Def_Set (ctx->ddef + (ctx->mblocks-1)*DEF_WORDS(blk_size), po, n);
       }
       break;
     case 0x01:
     //end of file record
       if (line_cnt)
         goto file_err;
+      eof = 1;
       break;
     case 0x02:
     //extended segment address
-      if (line_cnt != 2)
-        goto file_err;
-      off = read_next_word (line, 9);
-      checksum += (off>>8);
-      checksum += (off & 0xFF);
-      off <<= 4;
-      i += 4;
-      break;
     case 0x04:
     //extended linear address record
       if (line_cnt != 2)
         goto file_err;
-      off = read_next_word (line, 9);
-      checksum += (off>>8);
-      checksum += (off && 0xFF);
-      off <<= 16;
-      i += 4;
+      off = (rdata[0]<<8) | rdata[1];
+      off <<= (line_rec == 0x02) ? 4 : 16;
       break;
     default:
-      printf ("Not supported record type found in %s file, line no. %d\n",
-          ghexfile_name, line_index);
-      exit (EXIT_FAILURE);
+      fprintf (ctx->out,
+          "Not supported record type found in %s file, line no. %d\n",
+          ctx->hexfile_name, line_index);
+      GMT_FAIL (ctx, GMT_ERR_HEX);
     }
-    //read the checksum end byte
-    checksum += read_next_byte (line, i);
+    //the checksum end byte is in the sum
     if (checksum & 0xFF) {
-      printf ("Checksum error in %s intel hex file, line no. %d!\n",
-          ghexfile_name, line_index);
-      exit (EXIT_FAILURE);
+      fprintf (ctx->out, "Checksum error in %s intel hex file, line no. %d!\n",
+          ctx->hexfile_name, line_index);
+      GMT_FAIL (ctx, GMT_ERR_HEX);
+    }
+    if (eof)
+      break;
+  }
+  //the file ends with its end record, what follows is not loaded
+  for (line = eof ? eol + 1 : end; line < end; line++) {
+    if (!isspace (*line)) {
+      fprintf (ctx->out, "Warning: data after the end of file record of %s, "
+          "line no. %d, ignored\n", ctx->hexfile_name, line_index);
+      break;
     }
   }
+  //a record out of order started a new block, even at a known address
+  ihex_merge_blocks (ctx, blk_size);
   return;
 
 file_err:
-  printf ("Error in %s file, line no. %d, not an intel hex file?\n",
-      ghexfile_name, line_index);
-  exit (EXIT_FAILURE);
+  fprintf (ctx->out, "Error in %s file, line no. %d, not an intel hex file?\n",
+      ctx->hexfile_name, line_index);
+  GMT_FAIL (ctx, GMT_ERR_HEX);
 }
@@ -1,6 +1,30 @@
+/* Definition mask words per block, one bit per byte, see ihex.c */
+#define DEF_WORDS(blk_size)		((blk_size)/32)
 
-void Ihex_Wr_Data (unsigned char *data, uint32_t address, uint32_t size,
-    FILE *file);
-int  Ihex_Count_Blocks (FILE *file, int blk_size);
-void Ihex_Read_Data_Blocks (FILE *file, int blk_size, uint32_t *blk_ads,
-    unsigned char *data, unsigned char *ddef);
+
+/* Buffered intel hex output, see ihex.c */
+#define IHEX_WR_BUF_SIZE		0x10000
+#define IHEX_WR_RECORD_MAX		(1 + 2*(4 + 255 + 1) + 1)
+
+typedef struct {
+  int           fd;
+  uint32_t      len;			//bytes in buf
+  uint32_t      seg;			//extended segment address in use
+  unsigned char buf[IHEX_WR_BUF_SIZE];
+} ihex_wr;
+
+
+ihex_wr *Ihex_Wr_New (gmt_ctx *ctx, int fd);
+int  Ihex_Wr_Flush (ihex_wr *w);
+int  Ihex_Wr_Record (ihex_wr *w, uint32_t type, uint32_t address,
+    const unsigned char *data, uint32_t size);
+int  Ihex_Wr_Data (ihex_wr *w, uint32_t address, const unsigned char *data,
+    uint32_t size);
+int  Ihex_Wr_End (ihex_wr *w);
+void Ihex_Load (gmt_ctx *ctx, const unsigned char *map, size_t size,
+    uint32_t blk_size);
+int  Ihex_Def_Get (const uint32_t *def, uint32_t i);
+void Ihex_Def_Set (uint32_t *def, uint32_t i, uint32_t n);
+int  Ihex_Def_Full (const uint32_t *def, uint32_t size);
+void Ihex_Def_Merge (unsigned char *out, const unsigned char *data,
+    const uint32_t *def, const unsigned char *uc, uint32_t size);
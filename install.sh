@@ -13,13 +13,19 @@
  #rm /tmp/gmtflasher_project_tags
 
 
-BASE_FLAGS="-Wall -o2 -std=gnu99"
+BASE_FLAGS="-Wall -o2 -std=gnu99 -pthread"
 
 LIB_USB_FLAGS=`pkg-config --cflags --libs libusb-1.0`
 LIB_XML_FLAGS=`xml2-config --cflags --libs`
 
 gcc $BASE_FLAGS gmtflasher.c -o /usr/local/bin/gmtflasher $LIB_USB_FLAGS $LIB_XML_FLAGS
 
+#the library, for embedding the flasher in other programs
+gcc $BASE_FLAGS -fPIC -shared libgmtflasher.c -o /usr/local/lib/libgmtflasher.so \
+	$LIB_USB_FLAGS $LIB_XML_FLAGS
+cp -u libgmtflasher.h /usr/local/include/
+ldconfig
+
 #check existance of /usr/share/gmtflasher folder, create if needed
 if [ ! -d "/usr/share/gmtflasher" ]; then
 	mkdir /usr/share/gmtflasher
@@ -0,0 +1,1338 @@
+/* GmtFlasher library, see libgmtflasher.h
+ * Cristian Gyorgy, 2021 */
+
+#include "gmtflasher.h"
+
+
+/* Every API function runs its work between GMT_ENTER and GMT_LEAVE. A
+ * GMT_FAIL anywhere below jumps back in GMT_ENTER, that returns the error code.
+ * The work is done in separate functions, so no local variable of the API
+ * function is live across the longjmp. Nested API calls keep the outer jump.
+ */
+#define GMT_ENTER(ctx)							\
+  int gmt_nested = (ctx)->jmp_set;					\
+  if (!gmt_nested) {							\
+    if (setjmp ((ctx)->jmp)) {						\
+      (ctx)->jmp_set = 0;						\
+      gmt_cleanup (ctx);						\
+      return (ctx)->err;						\
+    }									\
+    (ctx)->jmp_set = 1;							\
+  }
+
+#define GMT_LEAVE(ctx) do {						\
+  if (!gmt_nested)							\
+    (ctx)->jmp_set = 0;							\
+  return GMT_OK;							\
+} while (0)
+
+
+static const char *gmt_errors[GMT_ERR_CNT] = {
+  [GMT_OK]           = "no error",
+  [GMT_ERR_NOMEM]    = "memory allocation failure",
+  [GMT_ERR_ARG]      = "wrong argument",
+  [GMT_ERR_FILE]     = "file error",
+  [GMT_ERR_XML]      = "device xml file error",
+  [GMT_ERR_MCU]      = "µC not supported",
+  [GMT_ERR_HEX]      = "intel hex file error",
+  [GMT_ERR_USB]      = "STLink USB error",
+  [GMT_ERR_NO_PROBE] = "no STLinkV2 device connected",
+  [GMT_ERR_SWIM]     = "SWIM error",
+  [GMT_ERR_UNLOCK]   = "memory unlock failed",
+  [GMT_ERR_PROG]     = "programming error",
+  [GMT_ERR_VERIFY]   = "verification failed",
+};
+
+static void
+unmap_hex (gmt_ctx *ctx)
+{
+  if (ctx->hexmap_mmap)
+    munmap (ctx->hexmap, ctx->hexmap_size);
+  else
+    free (ctx->hexmap);
+  ctx->hexmap = NULL;
+  ctx->hexmap_size = 0;
+  ctx->hexmap_mmap = 0;
+}
+
+/* Releases what a failed call may have left open */
+static void
+gmt_cleanup (gmt_ctx *ctx)
+{
+  unmap_hex (ctx);
+  //the sink thread is stopped before its mapped file goes
+  Rpipe_Free (ctx);
+  if (ctx->rmap) {
+    munmap (ctx->rmap, ctx->rmap_size);
+    ctx->rmap = NULL;
+    ctx->rmap_size = 0;
+  }
+  //the µC content is not sure after a failure
+  Shadow_Free (ctx);
+  //a running loader is stopped by the µC reset
+  ctx->ldr_run = 0;
+  ctx->batch.active = 0;
+  ctx->batch.cnt = 0;
+  Stlink_Reg_Forget (ctx);
+}
+
+static void
+free_hex_data (gmt_ctx *ctx)
+{
+  //a shared image is freed by the context that loaded it
+  if (!ctx->hex_shared) {
+    free (ctx->blk_add);
+    free (ctx->data);
+    free (ctx->ddef);
+  }
+  ctx->hex_shared = 0;
+  free (ctx->udata);
+  free (ctx->dirty);
+  ctx->blk_add = NULL;
+  ctx->data = NULL;
+  ctx->ddef = NULL;
+  ctx->udata = NULL;
+  ctx->dirty = NULL;
+  ctx->mblocks = 0;
+}
+
+const char *
+Gmt_Strerror (int err)
+{
+  if (err < 0 || err >= GMT_ERR_CNT)
+    return "unknown error";
+  return gmt_errors[err];
+}
+
+gmt_ctx *
+Gmt_Ctx_New (void)
+{
+  gmt_ctx *ctx = calloc (1, sizeof(gmt_ctx));
+
+  if (ctx)
+    ctx->out = stdout;
+  return ctx;
+}
+
+void
+Gmt_Ctx_Free (gmt_ctx *ctx)
+{
+  if (!ctx)
+    return;
+  Stlink_Usb_Close (ctx);
+  gmt_cleanup (ctx);
+  free_hex_data (ctx);
+  free (ctx->hexfile_name);
+  free (ctx);
+}
+
+/* New context with the options, the µC and the hex image of ctx, for a session
+ * on another probe. The image is shared, both contexts only read it, so ctx
+ * must not load another file or be freed while the copy is used. The copy does
+ * not save the programming times, they are added to ctx by Gmt_Add_Timings ().
+ * Returns NULL if out of memory.
+ */
+gmt_ctx *
+Gmt_Ctx_Clone (gmt_ctx *ctx)
+{
+  gmt_ctx *c = Gmt_Ctx_New ();
+
+  if (!c)
+    return NULL;
+  c->out = ctx->out;
+  c->clone = 1;
+  c->probe = ctx->probe;
+  c->swim_chunk = ctx->swim_chunk;
+  c->uc = ctx->uc;
+  c->prog_mode = ctx->prog_mode;
+  if (!ctx->hexfile_name)
+    return c;
+
+  c->hex_shared = 1;
+  c->mblocks = ctx->mblocks;
+  c->blk_add = ctx->blk_add;
+  c->data = ctx->data;
+  c->ddef = ctx->ddef;
+  //the µC content is per session
+  c->hexfile_name = strdup (ctx->hexfile_name);
+  c->udata = calloc (ctx->mblocks, ctx->uc.block_size);
+  c->dirty = calloc (ctx->mblocks, sizeof(*c->dirty));
+  if (!c->hexfile_name || !c->udata || !c->dirty) {
+    Gmt_Ctx_Free (c);
+    return NULL;
+  }
+  return c;
+}
+
+void
+Gmt_Set_Output (gmt_ctx *ctx, FILE *out)
+{
+  ctx->out = out ? out : stdout;
+}
+
+/* Sets the PROG_MODE_* options, PROG_MODE_STM8L is kept as set by the µC */
+void
+Gmt_Set_Mode (gmt_ctx *ctx, uint32_t mode)
+{
+  ctx->prog_mode = (ctx->prog_mode & PROG_MODE_STM8L)
+      | (mode & ~PROG_MODE_STM8L);
+}
+
+uint32_t
+Gmt_Get_Mode (gmt_ctx *ctx)
+{
+  return ctx->prog_mode;
+}
+
+void
+Gmt_Set_Probe (gmt_ctx *ctx, int probe)
+{
+  ctx->probe = probe;
+}
+
+void
+Gmt_Set_Chunk (gmt_ctx *ctx, uint32_t chunk)
+{
+  ctx->swim_chunk = chunk;
+}
+
+int
+Gmt_List_Probes (char (*serials)[32], int max)
+{
+  return Stlink_Usb_List (serials, max);
+}
+
+int
+Gmt_List_Mcu (gmt_ctx *ctx)
+{
+  GMT_ENTER (ctx);
+  List_Devices (ctx);
+  GMT_LEAVE (ctx);
+}
+
+static void
+set_mcu (gmt_ctx *ctx, const char *name)
+{
+  Shadow_Free (ctx);
+  memset (&ctx->uc, 0x00, sizeof(ctx->uc));
+  strncpy (ctx->uc.name, name, sizeof(ctx->uc.name) - 1);
+  PRINT_IF_VERBOSE ("...reading device xml file and identify device: ");
+  Get_Xml_Mcu_Data (ctx, &ctx->uc);
+  PRINT_IF_VERBOSE ("done\n");
+}
+
+/* Identifies the µC in the device xml file */
+int
+Gmt_Set_Mcu (gmt_ctx *ctx, const char *name)
+{
+  GMT_ENTER (ctx);
+  set_mcu (ctx, name);
+  GMT_LEAVE (ctx);
+}
+
+/* Maps the hex file, or reads it in a malloc buffer if it can not be mapped
+ * (a pipe)
+ */
+static void
+map_hex (gmt_ctx *ctx, const char *fname)
+{
+  struct stat  st;
+  size_t       cap = 0;
+  ssize_t      n;
+  int          fd;
+
+  fd = open (fname, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st))
+    goto file_err;
+
+  if (S_ISREG (st.st_mode)) {
+    //an empty file has no mapping and no blocks
+    if (st.st_size) {
+      ctx->hexmap = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ctx->hexmap == MAP_FAILED) {
+        ctx->hexmap = NULL;
+        goto file_err;
+      }
+      ctx->hexmap_size = st.st_size;
+      ctx->hexmap_mmap = 1;
+      madvise (ctx->hexmap, ctx->hexmap_size, MADV_SEQUENTIAL);
+    }
+    close (fd);
+    return;
+  }
+
+  do {
+    if (ctx->hexmap_size == cap) {
+      cap = cap ? 2*cap : 0x10000;
+      unsigned char *buf = realloc (ctx->hexmap, cap);
+      if (!buf) {
+        close (fd);
+        MALLOC_TST (buf);
+      }
+      ctx->hexmap = buf;
+    }
+    n = read (fd, ctx->hexmap + ctx->hexmap_size, cap - ctx->hexmap_size);
+    if (n < 0)
+      goto file_err;
+    ctx->hexmap_size += n;
+  } while (n);
+  close (fd);
+  return;
+
+file_err:
+  fprintf (ctx->out, "%s\n", strerror(errno));
+  if (fd >= 0)
+    close (fd);
+  GMT_FAIL (ctx, GMT_ERR_FILE);
+}
+
+static void
+load_hex (gmt_ctx *ctx, const char *fname)
+{
+  mcu *uc = &ctx->uc;
+
+  if (!uc->block_size) {
+    fprintf (ctx->out, "No µC part number specified!\n");
+    GMT_FAIL (ctx, GMT_ERR_ARG);
+  }
+
+  free_hex_data (ctx);
+  free (ctx->hexfile_name);
+  ctx->hexfile_name = strdup (fname);
+  MALLOC_TST (ctx->hexfile_name);
+
+  PRINT_IF_VERBOSE ("...opening data file %s: ", fname);
+  //the whole file is decoded in one pass
+  map_hex (ctx, fname);
+  Ihex_Load (ctx, ctx->hexmap, ctx->hexmap_size, uc->block_size);
+  unmap_hex (ctx);
+
+  ctx->udata = calloc (ctx->mblocks, uc->block_size);
+  MALLOC_TST (ctx->udata);
+  ctx->dirty = calloc (ctx->mblocks, sizeof(*ctx->dirty));
+  MALLOC_TST (ctx->dirty);
+  PRINT_IF_VERBOSE ("%d blocks of data\n", ctx->mblocks);
+}
+
+/* Reads the data to write from an intel hex file, in blocks of the µC block
+ * size, so the µC must be set before.
+ */
+int
+Gmt_Load_Hex (gmt_ctx *ctx, const char *fname)
+{
+  GMT_ENTER (ctx);
+  load_hex (ctx, fname);
+  GMT_LEAVE (ctx);
+}
+
+/* Opens the STLink and activates the SWIM connection to the µC */
+int
+Gmt_Open (gmt_ctx *ctx)
+{
+  GMT_ENTER (ctx);
+  Stlink_Usb_Init (ctx);
+  Stlink_Open (ctx);
+  Stlink_Load_Timings (ctx);
+  GMT_LEAVE (ctx);
+}
+
+static void
+release_session (gmt_ctx *ctx)
+{
+  Stlink_Loader_Stop (ctx);
+  Shadow_Save (ctx);
+  Stlink_Save_Timings (ctx);
+
+  //if memory is unlocked, lock back
+  if (ctx->prog_stat & (PROG_STAT_UL_EEPROM | PROG_STAT_UL_FLASH)) {
+    uint32_t iaspr;
+
+    (ctx->prog_mode & PROG_MODE_STM8L) ? (iaspr = 0x5054) : (iaspr = 0x505F);
+    ctx->prog_stat &= ~(PROG_STAT_UL_EEPROM | PROG_STAT_UL_FLASH);
+    Stlink_Write_Byte (ctx, iaspr, 0x00);
+  }
+
+//release CPU
+/*
+  Stlink_Write_Byte (ctx, 0x7F80, 0x00);
+  Stlink_Write_Byte (ctx, STM8_DM_CSR2, 0x00);
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_RESET);
+*/
+
+  //reset device
+  Stlink_Reg_Forget (ctx);
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_GEN_RST);
+  if (stlink_wait_swim_idle (ctx, SWIM_OP_CMD, 0)) {
+    fprintf (ctx->out, "Error, µC reset: SWIM status not idle\n");
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
+  }
+}
+
+/* Locks back the memory and resets the µC, that starts running. The STLink is
+ * kept open, so the next jobs only need Gmt_Resume ().
+ */
+int
+Gmt_Release (gmt_ctx *ctx)
+{
+  if (!ctx->dev_handle)
+    return GMT_OK;
+  GMT_ENTER (ctx);
+  release_session (ctx);
+  GMT_LEAVE (ctx);
+}
+
+static void
+resume_session (gmt_ctx *ctx)
+{
+  if (!ctx->dev_handle) {
+    Stlink_Usb_Init (ctx);
+    Stlink_Open (ctx);
+    Stlink_Load_Timings (ctx);
+  } else {
+    Stlink_Swim_Resume (ctx);
+  }
+}
+
+/* Stalls the µC again after Gmt_Release (), for new jobs. If the STLink was
+ * closed it is opened, like Gmt_Open () does.
+ */
+int
+Gmt_Resume (gmt_ctx *ctx)
+{
+  GMT_ENTER (ctx);
+  resume_session (ctx);
+  GMT_LEAVE (ctx);
+}
+
+/* Releases the µC, like Gmt_Release (), and the STLink, that is closed even if
+ * the µC reset fails. The statistics are kept, for Gmt_Print_Timings ().
+ */
+int
+Gmt_Close (gmt_ctx *ctx)
+{
+  int q = Gmt_Release (ctx);
+
+  Stlink_Usb_Close (ctx);
+  return q;
+}
+
+void
+Gmt_Print_Timings (gmt_ctx *ctx)
+{
+  Stlink_Print_Timings (ctx, ctx->uc.name);
+}
+
+/* Adds the programming times of the session of from, a clone of ctx, to ctx,
+ * for Gmt_Save_Timings ()
+ */
+void
+Gmt_Add_Timings (gmt_ctx *ctx, gmt_ctx *from)
+{
+  for (int i=0; i<PROG_OP_CNT; i++) {
+    prog_op_stat *st = &ctx->prog_op[i];
+    prog_op_stat *f = &from->prog_op[i];
+
+    st->calls += f->calls;
+    st->total_us += f->total_us;
+    if (f->max_us > st->max_us)
+      st->max_us = f->max_us;
+    if (!st->expect_us)
+      st->expect_us = f->expect_us;
+  }
+}
+
+/* Saves the programming times of ctx, with PROG_MODE_TIMINGS, as the end of a
+ * session does
+ */
+void
+Gmt_Save_Timings (gmt_ctx *ctx)
+{
+  Stlink_Save_Timings (ctx);
+}
+
+/* Whole image diff of the write jobs.
+ * Before the writes, diff_mcu () reads the µC content of all the FLASH, EEPROM
+ * and OPT blocks to write in ctx->udata: the runs of blocks closer than
+ * DIFF_GAP_MAX bytes, in address order, are read with one SWIM read each, and
+ * the blocks known from the shadow cache are taken from it. Then the bitmap of
+ * the 4-byte words that differ in their defined bytes is computed for every
+ * block, in ctx->dirty, so the programming engine gets its whole input without
+ * further reads.
+ */
+#define DIFF_GAP_MAX			256
+
+//one bit per byte of the 32 at data that differs from uc
+static inline uint32_t
+diff_bytes_scalar (const unsigned char *data, const unsigned char *uc)
+{
+  uint32_t x = 0;
+
+  for (int j=0; j<32; j++)
+    x |= (uint32_t)(data[j] != uc[j]) << j;
+  return x;
+}
+
+#ifdef __SSE2__
+static uint32_t
+diff_bytes (const unsigned char *data, const unsigned char *uc)
+{
+  __m128i d0 = _mm_loadu_si128 ((const __m128i *)data);
+  __m128i d1 = _mm_loadu_si128 ((const __m128i *)(data + 16));
+  __m128i u0 = _mm_loadu_si128 ((const __m128i *)uc);
+  __m128i u1 = _mm_loadu_si128 ((const __m128i *)(uc + 16));
+
+  return ~((uint32_t)_mm_movemask_epi8 (_mm_cmpeq_epi8 (d0, u0))
+      | ((uint32_t)_mm_movemask_epi8 (_mm_cmpeq_epi8 (d1, u1)) << 16));
+}
+#else
+#define diff_bytes			diff_bytes_scalar
+#endif
+
+/* Returns one bit per 4-byte word of the block where a defined byte (bit set
+ * in the def mask) of data differs from uc
+ */
+static uint32_t
+dirty_dwords (const unsigned char *data, const uint32_t *def,
+    const unsigned char *uc, uint32_t size)
+{
+  uint32_t dirty = 0;
+
+  for (uint32_t i=0; i<size; i+=32) {
+    uint32_t m = def[i/32];
+    uint32_t x;
+
+    //no defined byte in the 32
+    if (!m)
+      continue;
+    x = diff_bytes (data + i, uc + i) & m;
+    //one bit per word with a differing byte
+    x |= x >> 1;
+    x |= x >> 2;
+    for (int w=0; w<8; w++)
+      dirty |= ((x >> (4*w)) & 1) << (i/4 + w);
+  }
+  return dirty;
+}
+
+static int
+diff_selected (gmt_ctx *ctx, uint32_t add, int job)
+{
+  mcu *uc = &ctx->uc;
+  int flash  = (add>=0x8000) && (add<(0x8000 + uc->flash_size));
+  int eeprom = (add>=uc->eeprom_add)
+      && (add<(uc->eeprom_add + uc->eeprom_size));
+  int opt    = (add>=0x4800) && (add<0x4880);
+
+  return (flash && (job & (JOB_WRITE_ALL | JOB_WRITE_FLASH)))
+      || (eeprom && (job & (JOB_WRITE_ALL | JOB_WRITE_EEPROM)))
+      || (opt && (job & (JOB_WRITE_ALL | JOB_WRITE_OPT)));
+}
+
+/* Returns 1 if the option byte j of block i must be written: defined, and
+ * different from the µC content unless PROG_MODE_FORCE_ALL
+ */
+static int
+opt_byte_changed (gmt_ctx *ctx, int i, int j)
+{
+  uint32_t k = i*ctx->uc.block_size + j;
+
+  if (!Ihex_Def_Get (ctx->ddef, k))
+    return 0;
+  return (ctx->prog_mode & PROG_MODE_FORCE_ALL)
+      || (ctx->data[k] != ctx->udata[k]);
+}
+
+static void
+diff_block (gmt_ctx *ctx, int i)
+{
+  uint32_t bs = ctx->uc.block_size;
+
+  ctx->dirty[i] = dirty_dwords (ctx->data + i*bs,
+      ctx->ddef + i*DEF_WORDS(bs), ctx->udata + i*bs, bs);
+}
+
+static void
+diff_mcu (gmt_ctx *ctx, int job)
+{
+  uint32_t *blk_add = ctx->blk_add;
+  uint32_t  bs = ctx->uc.block_size;
+
+  for (int i=0; i<ctx->mblocks; ) {
+    uint32_t add = blk_add[i];
+
+    if (!diff_selected (ctx, add, job)) {
+      i++;
+      continue;
+    }
+    if (Shadow_Get_Block (ctx, add, bs, ctx->udata + i*bs)) {
+      diff_block (ctx, i);
+      i++;
+      continue;
+    }
+
+    //a run of blocks, read in scratch
+    int n = 1;
+    uint32_t end = add + bs;
+    while (i+n < ctx->mblocks) {
+      uint32_t a = blk_add[i+n];
+      if ( !diff_selected (ctx, a, job) || (a > end + DIFF_GAP_MAX)
+          || (a + bs - add > sizeof(ctx->scratch)) )
+        break;
+      end = a + bs;
+      n++;
+    }
+    Stlink_Read_Block (ctx, add, end - add, ctx->scratch);
+    Shadow_Update (ctx, add, ctx->scratch, end - add);
+    for (int j=i; j<i+n; j++) {
+      memcpy (ctx->udata + j*bs, ctx->scratch + blk_add[j] - add, bs);
+      diff_block (ctx, j);
+    }
+    i += n;
+  }
+}
+
+/* Write plan of a memory region, see plan_mcu () */
+typedef struct {
+  const char *name;
+  int         blocks;
+  int         how[3];		//per BLK_*
+  int         op[PROG_OP_CNT];	//block writes per operation
+  uint32_t    dwords;
+  uint64_t    cost_us;
+} plan_region;
+
+static void
+print_plan (gmt_ctx *ctx, plan_region *r)
+{
+  if (!r->blocks)
+    return;
+  fprintf (ctx->out, "%s: %d blocks, %d unchanged, %d standard, %d fast, "
+      "%d erase-only, %d by dwords (%u dwords), estimated %u ms\n", r->name,
+      r->blocks, r->how[BLK_SKIP], r->op[PROG_OP_BLOCK], r->op[PROG_OP_FAST],
+      r->op[PROG_OP_ERASE], r->how[BLK_DWORDS], r->dwords,
+      (uint32_t)((r->cost_us + 500) / 1000));
+}
+
+/* Dry run of write_mcu () for PROG_MODE_PLAN: the µC blocks are read back and
+ * the write strategy chosen for each block and its estimated time are printed
+ * per memory region, nothing is written.
+ */
+static void
+plan_mcu (gmt_ctx *ctx, int job)
+{
+  mcu           *uc = &ctx->uc;
+  uint32_t       bs = uc->block_size;
+  plan_region    flash = {"FLASH"}, eeprom = {"EEPROM"};
+  int            opt_cnt = 0;
+  blk_plan       plan;
+  static const char *how_name[3] = {"unchanged", "dwords", "block"};
+
+  PRINT_IF_VERBOSE ("plan only, nothing is written\n");
+  for (int i=0; i<ctx->mblocks; i++) {
+    uint32_t add = ctx->blk_add[i];
+    int is_flash  = (add>=0x8000) && (add<(0x8000 + uc->flash_size));
+    int is_eeprom = (add>=uc->eeprom_add)
+        && (add<(uc->eeprom_add + uc->eeprom_size));
+    plan_region *r;
+
+    if ( (add>=0x4800) && (add<0x4880)
+        && (job & (JOB_WRITE_ALL | JOB_WRITE_OPT)) ) {
+      for (int j=0; j<bs; j++)
+        opt_cnt += opt_byte_changed (ctx, i, j);
+      continue;
+    }
+    if (is_flash && (job & (JOB_WRITE_ALL | JOB_WRITE_FLASH)))
+      r = &flash;
+    else if (is_eeprom && (job & (JOB_WRITE_ALL | JOB_WRITE_EEPROM)))
+      r = &eeprom;
+    else
+      continue;
+
+    Stlink_Plan_Block (ctx, add, bs, ctx->data + i*bs,
+        ctx->ddef + i*DEF_WORDS(bs), ctx->udata + i*bs, ctx->dirty[i], &plan);
+    r->blocks++;
+    r->how[plan.how]++;
+    if (plan.how == BLK_WRITE)
+      r->op[plan.op]++;
+    if (plan.how == BLK_DWORDS)
+      r->dwords += plan.dwords;
+    r->cost_us += plan.cost_us;
+    if (plan.how != BLK_SKIP)
+      PRINT_IF_VERBOSE ("...0x%04X: %s%s, %u us\n", add, how_name[plan.how],
+          (plan.how == BLK_WRITE) ? (plan.op == PROG_OP_FAST ? " fast" :
+          (plan.op == PROG_OP_ERASE ? " erase-only" : "")) : "",
+          plan.cost_us);
+  }
+
+  print_plan (ctx, &flash);
+  print_plan (ctx, &eeprom);
+  if (opt_cnt)
+    fprintf (ctx->out, "OPT: %d bytes, estimated %u ms\n", opt_cnt,
+        (opt_cnt * Stlink_Cost_Us (ctx, 0x4800, 1, PROG_OP_OPT) + 500) / 1000);
+  if (!(flash.blocks + eeprom.blocks + opt_cnt))
+    fprintf (ctx->out, "No data to write defined in %s\n", ctx->hexfile_name);
+}
+
+/* Writes the blocks of the loaded hex file that fall in the memory selected by
+ * job: JOB_WRITE_ALL, JOB_WRITE_FLASH, JOB_WRITE_EEPROM or JOB_WRITE_OPT.
+ */
+static void
+write_mcu (gmt_ctx *ctx, int job)
+{
+  mcu           *uc = &ctx->uc;
+  uint32_t      *blk_add = ctx->blk_add;
+  unsigned char *data = ctx->data;
+  uint32_t      *ddef = ctx->ddef;
+  int blk_cnt = 0;
+  int wrd_cnt = 0;
+  int byt_cnt = 0;
+  int byt_skip = 0;
+  int skip = 0;
+
+  switch (job) {
+  case JOB_WRITE_ALL:
+    PRINT_IF_VERBOSE ("...writing device: ");
+    break;
+  case JOB_WRITE_FLASH:
+    PRINT_IF_VERBOSE ("...writing FLASH: ");
+    break;
+  case JOB_WRITE_EEPROM:
+    PRINT_IF_VERBOSE ("...writing EEPROM: ");
+    break;
+  case JOB_WRITE_OPT:
+    PRINT_IF_VERBOSE ("...writing OPT: ");
+    break;
+  default:
+    fprintf (ctx->out, "%s: wrong job 0x%X\n", __func__, job);
+    GMT_FAIL (ctx, GMT_ERR_ARG);
+  }
+
+  if (!(ctx->prog_mode & PROG_MODE_FORCE_ALL))
+    diff_mcu (ctx, job);
+  if (ctx->prog_mode & PROG_MODE_PLAN) {
+    plan_mcu (ctx, job);
+    return;
+  }
+
+  for (int i=0; i<ctx->mblocks; i++) {
+    uint32_t add = *(blk_add+i);
+    int flash  = (add>=0x8000) && (add<(0x8000 + uc->flash_size));
+    int eeprom = (add>=uc->eeprom_add)
+        && (add<(uc->eeprom_add + uc->eeprom_size));
+    int opt    = (add>=0x4800) && (add<0x4880);
+
+    if ( (flash && (job & (JOB_WRITE_ALL | JOB_WRITE_FLASH)))
+        || (eeprom && (job & (JOB_WRITE_ALL | JOB_WRITE_EEPROM))) ) {
+      Stlink_Unlock_Memory (ctx, uc, add);
+      int q = Stlink_Prog_Block (ctx, add, uc->block_size,
+          data+i*uc->block_size, ddef+i*DEF_WORDS(uc->block_size),
+          ctx->udata+i*uc->block_size, ctx->dirty[i]);
+      if (q==0)
+        blk_cnt++;
+      else if (q>0)
+        wrd_cnt+=q;
+      else
+        skip++;
+    } else if (opt && (job & (JOB_WRITE_ALL | JOB_WRITE_OPT))) {
+      //each option byte costs a full programming time, only the changed ones
+      //are written
+      for (int j=0; j<uc->block_size; j++) {
+        if (opt_byte_changed (ctx, i, j)) {
+          Stlink_Unlock_Memory (ctx, uc, add);
+          Stlink_Prog_Byte (ctx, add+j, *(data+i*uc->block_size+j));
+          byt_cnt++;
+        } else if (Ihex_Def_Get (ddef, i*uc->block_size+j)) {
+          byt_skip++;
+        }
+      }
+    }
+  }
+  //the programming errors of the last queued blocks are reported here
+  Stlink_Loader_Stop (ctx);
+
+  switch (job) {
+  case JOB_WRITE_ALL:
+    fprintf (ctx->out, "Written %d blocks, %d dwords, %d bytes, skipped %d\n",
+        blk_cnt, wrd_cnt, byt_cnt, skip + byt_skip);
+    break;
+  case JOB_WRITE_FLASH:
+  case JOB_WRITE_EEPROM:
+    if (!(blk_cnt + wrd_cnt + skip))
+      fprintf (ctx->out, "No %s data defined in %s\n",
+          (job == JOB_WRITE_FLASH) ? "FLASH" : "EEPROM", ctx->hexfile_name);
+    else if (wrd_cnt)
+      fprintf (ctx->out, "Written %d blocks + %d dwords, skipped %d blocks\n",
+          blk_cnt, wrd_cnt, skip);
+    else
+      fprintf (ctx->out, "Written %d blocks, skipped %d blocks\n", blk_cnt,
+          skip);
+    break;
+  case JOB_WRITE_OPT:
+    if (!(byt_cnt + byt_skip))
+      fprintf (ctx->out, "No OPT data defined in %s\n", ctx->hexfile_name);
+    else
+      fprintf (ctx->out, "Written %d OPT data bytes, skipped %d\n", byt_cnt,
+          byt_skip);
+    break;
+  }
+}
+
+int
+Gmt_Write (gmt_ctx *ctx, int job)
+{
+  GMT_ENTER (ctx);
+  write_mcu (ctx, job);
+  GMT_LEAVE (ctx);
+}
+
+/* Reads back the block of index i and compares the defined bytes. Returns the
+ * number of bytes that differ, the first one is printed.
+ */
+static int
+verify_block (gmt_ctx *ctx, int i)
+{
+  uint32_t       bs = ctx->uc.block_size;
+  uint32_t       add = ctx->blk_add[i];
+  unsigned char *data = ctx->data + i*bs;
+  uint32_t      *ddef = ctx->ddef + i*DEF_WORDS(bs);
+  unsigned char *ucblock = ctx->scratch;
+  int err = 0;
+
+  Stlink_Read_Block (ctx, add, bs, ucblock);
+  for (uint32_t j=0; j<bs; j++) {
+    if (!Ihex_Def_Get (ddef, j) || ucblock[j] == data[j])
+      continue;
+    if (!err)
+      fprintf (ctx->out, "\n...address 0x%04X: read 0x%02X, expected 0x%02X",
+          add + j, ucblock[j], data[j]);
+    err++;
+  }
+  return err;
+}
+
+/* Verifies the data of the loaded hex file selected by job: JOB_VERIFY_ALL,
+ * JOB_VERIFY_FLASH or JOB_VERIFY_EEPROM. Runs of consecutive fully defined
+ * blocks below 0x10000 are checked with the CRC computed by the µC, the other
+ * blocks, and the runs with a wrong CRC, are read back and compared.
+ */
+static void
+verify_mcu (gmt_ctx *ctx, int job)
+{
+  mcu      *uc = &ctx->uc;
+  uint32_t  bs = uc->block_size;
+  uint32_t (*crc_blk)[2];		//address and index, in address order
+  int       crc_cnt = 0;
+  int       blk_cnt = 0;
+  int       by_crc = 0;
+  int       err = 0;
+  int       nl = 0;			//a message was printed after the title
+
+  switch (job) {
+  case JOB_VERIFY_ALL:
+    PRINT_IF_VERBOSE ("...verifying device: ");
+    break;
+  case JOB_VERIFY_FLASH:
+    PRINT_IF_VERBOSE ("...verifying FLASH: ");
+    break;
+  case JOB_VERIFY_EEPROM:
+    PRINT_IF_VERBOSE ("...verifying EEPROM: ");
+    break;
+  default:
+    fprintf (ctx->out, "%s: wrong job 0x%X\n", __func__, job);
+    GMT_FAIL (ctx, GMT_ERR_ARG);
+  }
+  fflush (ctx->out);
+
+  //the list follows the read back block in the scratch buffer
+  crc_blk = (void *)(ctx->scratch + bs);
+  if (ctx->mblocks * sizeof(*crc_blk) > sizeof(ctx->scratch) - bs) {
+    fprintf (ctx->out, "%s: too many blocks\n", __func__);
+    GMT_FAIL (ctx, GMT_ERR_ARG);
+  }
+
+  //blocks checked by CRC or read back, the read back ones are done first
+  for (int i=0; i<ctx->mblocks; i++) {
+    uint32_t add = ctx->blk_add[i];
+    int flash  = (add>=0x8000) && (add<(0x8000 + uc->flash_size));
+    int eeprom = (add>=uc->eeprom_add)
+        && (add<(uc->eeprom_add + uc->eeprom_size));
+    int opt    = (add>=0x4800) && (add<0x4880);
+
+    if ( !(flash && (job & (JOB_VERIFY_ALL | JOB_VERIFY_FLASH)))
+        && !(eeprom && (job & (JOB_VERIFY_ALL | JOB_VERIFY_EEPROM)))
+        && !(opt && (job & JOB_VERIFY_ALL)) )
+      continue;
+    blk_cnt++;
+    if (!opt && (add + bs <= 0x10000)
+        && Ihex_Def_Full (ctx->ddef + i*DEF_WORDS(bs), bs)) {
+      crc_blk[crc_cnt][0] = add;
+      crc_blk[crc_cnt][1] = i;
+      crc_cnt++;
+    } else {
+      err += verify_block (ctx, i);
+    }
+  }
+
+  if (crc_cnt) {
+    uint32_t (*list)[2] = crc_blk;
+
+    Stlink_Crc_Load (ctx);
+    for (int k=0; k<crc_cnt; ) {
+      uint32_t add = list[k][0];
+      uint32_t crc = 0xFFFF;
+      int n = 0;
+
+      while (k+n < crc_cnt && list[k+n][0] == add + n*bs) {
+        crc = crc16_ccitt (crc, ctx->data + list[k+n][1]*bs, bs);
+        n++;
+      }
+      int q = Stlink_Crc (ctx, add, n*bs);
+      if (q == crc) {
+        by_crc += n;
+      } else {
+        if (ctx->prog_mode & PROG_MODE_VERBOSE) {
+          fprintf (ctx->out, "\n...CRC of [0x%X, 0x%X) %s, reading back", add,
+              add + n*bs, (q < 0) ? "not computed by the µC" : "differs");
+          nl = 1;
+        }
+        for (int j=0; j<n; j++)
+          err += verify_block (ctx, list[k+j][1]);
+      }
+      k += n;
+    }
+  }
+
+  if (!blk_cnt) {
+    fprintf (ctx->out, "No %sdata defined in %s\n", (job == JOB_VERIFY_FLASH) ?
+        "FLASH " : (job == JOB_VERIFY_EEPROM) ? "EEPROM " : "",
+        ctx->hexfile_name);
+    return;
+  }
+  if (err) {
+    fprintf (ctx->out, "\nVerify failed, %d bytes differ\n", err);
+    GMT_FAIL (ctx, GMT_ERR_VERIFY);
+  }
+  if (nl)
+    fprintf (ctx->out, "\n");
+  fprintf (ctx->out, "Verified %d blocks, %d by on-target CRC\n", blk_cnt,
+      by_crc);
+}
+
+int
+Gmt_Verify (gmt_ctx *ctx, int job)
+{
+  GMT_ENTER (ctx);
+  verify_mcu (ctx, job);
+  GMT_LEAVE (ctx);
+}
+
+/* Memory regions read by a read job, in the order they are written */
+#define READ_REGIONS_MAX		3
+
+typedef struct {
+  uint32_t add;
+  uint32_t size;
+} read_region;
+
+/* Fills rg with the regions of job, returns their number. For JOB_READ_RANGE
+ * the range is [add_0, add_1).
+ */
+static int
+read_regions (gmt_ctx *ctx, int job, uint32_t add_0, uint32_t add_1,
+    read_region *rg)
+{
+  mcu *uc = &ctx->uc;
+
+  switch (job) {
+  case JOB_READ_ALL:
+    fprintf (ctx->out, "...reading device: ");
+    rg[0] = (read_region){uc->eeprom_add, uc->eeprom_size};
+    rg[1] = (read_region){0x4800, uc->block_size};
+    rg[2] = (read_region){0x8000, uc->flash_size};
+    return 3;
+  case JOB_READ_FLASH:
+    fprintf (ctx->out, "...reading FLASH: ");
+    rg[0] = (read_region){0x8000, uc->flash_size};
+    return 1;
+  case JOB_READ_EEPROM:
+    fprintf (ctx->out, "...reading EEPROM: ");
+    rg[0] = (read_region){uc->eeprom_add, uc->eeprom_size};
+    return 1;
+  case JOB_READ_OPT:
+    fprintf (ctx->out, "...reading OPT: ");
+    rg[0] = (read_region){0x4800, uc->block_size};
+    return 1;
+  case JOB_READ_RANGE:
+    if (add_1 <= add_0) {
+      fprintf (ctx->out, "Wrong address range [0x%X, 0x%X)\n", add_0, add_1);
+      GMT_FAIL (ctx, GMT_ERR_ARG);
+    }
+    uc->add_0 = add_0;
+    uc->add_1 = add_1;
+    fprintf (ctx->out, "...reading address range [0x%X, 0x%X): ", uc->add_0,
+        uc->add_1);
+    rg[0] = (read_region){uc->add_0, uc->add_1 - uc->add_0};
+    return 1;
+  default:
+    fprintf (ctx->out, "%s: wrong job 0x%X\n", __func__, job);
+    GMT_FAIL (ctx, GMT_ERR_ARG);
+  }
+}
+
+/* Opens the output file of a read, returns STDOUT_FILENO if fname is "-" */
+static int
+read_open (gmt_ctx *ctx, const char *fname, int flags)
+{
+  int fd;
+
+  //stdout is written past its FILE buffer
+  if (!strcmp (fname, "-")) {
+    fflush (stdout);
+    return STDOUT_FILENO;
+  }
+  fd = open (fname, flags | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fprintf (ctx->out, "%s\n", strerror(errno));
+    GMT_FAIL (ctx, GMT_ERR_FILE);
+  }
+  return fd;
+}
+
+static void
+read_hex_sink (gmt_ctx *ctx, const char *fname)
+{
+  rpipe_sink *s = Rpipe_Add_Sink (ctx, RPIPE_SINK_HEX);
+
+  s->fd = read_open (ctx, fname, O_WRONLY);
+  s->w = Ihex_Wr_New (ctx, s->fd);
+}
+
+/* Writes the fname.map sidecar of a raw binary read, one line per region with
+ * its offset in the file, its address and its size
+ */
+static void
+read_bin_map (gmt_ctx *ctx, const read_region *rg, int n, const char *fname)
+{
+  char     name[FILENAME_MAX];
+  uint32_t off = 0;
+  FILE     *f;
+
+  snprintf (name, sizeof(name), "%s.map", fname);
+  f = fopen (name, "w");
+  if (!f) {
+    fprintf (ctx->out, "%s: %s\n", name, strerror(errno));
+    GMT_FAIL (ctx, GMT_ERR_FILE);
+  }
+  fprintf (f, "# %s, offset address size\n", ctx->uc.name);
+  for (int i=0; i<n; i++) {
+    fprintf (f, "0x%06X 0x%06X 0x%06X\n", off, rg[i].add, rg[i].size);
+    off += rg[i].size;
+  }
+  if (fclose (f)) {
+    fprintf (ctx->out, "%s: %s\n", name, strerror(errno));
+    GMT_FAIL (ctx, GMT_ERR_FILE);
+  }
+}
+
+/* The regions of a raw binary read are back to back in the file, that is
+ * sized to them and mapped, so the sink copies the data in the page cache. A
+ * pipe can not be mapped, stdout is written.
+ */
+static void
+read_bin_sink (gmt_ctx *ctx, uint32_t size, const char *fname)
+{
+  rpipe_sink *s = Rpipe_Add_Sink (ctx, RPIPE_SINK_BIN);
+
+  s->fd = read_open (ctx, fname, O_RDWR);
+  if (s->fd == STDOUT_FILENO || !size)
+    return;
+  if (ftruncate (s->fd, size)) {
+    fprintf (ctx->out, "%s\n", strerror(errno));
+    GMT_FAIL (ctx, GMT_ERR_FILE);
+  }
+  ctx->rmap = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+  if (ctx->rmap == MAP_FAILED) {
+    ctx->rmap = NULL;
+    fprintf (ctx->out, "%s\n", strerror(errno));
+    GMT_FAIL (ctx, GMT_ERR_FILE);
+  }
+  ctx->rmap_size = size;
+  s->map = ctx->rmap;
+}
+
+/* Reads mcu memory according to job and writes the data into the file fname,
+ * or to stdout if fname is "-". The file is intel hex, or raw binary with
+ * PROG_MODE_READ_BIN. For JOB_READ_RANGE the range is [add_0, add_1).
+ * The data goes through the read pipeline, that also computes its CRC with
+ * PROG_MODE_READ_CRC and compares it with the loaded hex file with
+ * PROG_MODE_READ_CMP, in the same pass.
+ */
+static void
+read_to_file (gmt_ctx *ctx, int job, uint32_t add_0, uint32_t add_1,
+    const char *fname)
+{
+  read_region  rg[READ_REGIONS_MAX];
+  rpipe_sink  *crc = NULL;
+  rpipe_sink  *cmp = NULL;
+  uint32_t     size = 0;
+  int          n;
+
+  if ( (ctx->prog_mode & PROG_MODE_READ_CMP) && !ctx->hexfile_name ) {
+    fprintf (ctx->out, "No hex file to compare the read data with!\n");
+    GMT_FAIL (ctx, GMT_ERR_ARG);
+  }
+  n = read_regions (ctx, job, add_0, add_1, rg);
+  fflush (ctx->out);
+  for (int i=0; i<n; i++)
+    size += rg[i].size;
+
+  Rpipe_New (ctx);
+  if (ctx->prog_mode & PROG_MODE_READ_BIN)
+    read_bin_sink (ctx, size, fname);
+  else
+    read_hex_sink (ctx, fname);
+  if (ctx->prog_mode & PROG_MODE_READ_CRC)
+    crc = Rpipe_Add_Sink (ctx, RPIPE_SINK_CRC);
+  if (ctx->prog_mode & PROG_MODE_READ_CMP)
+    cmp = Rpipe_Add_Sink (ctx, RPIPE_SINK_CMP);
+  Rpipe_Start (ctx);
+
+  //do actual reading from mcu to file
+  for (int i=0; i<n; i++)
+    Stlink_Read_Memory (ctx, rg[i].add, rg[i].size);
+  Rpipe_End (ctx);
+  if (ctx->rmap) {
+    munmap (ctx->rmap, ctx->rmap_size);
+    ctx->rmap = NULL;
+    ctx->rmap_size = 0;
+  }
+  if ( (ctx->prog_mode & PROG_MODE_READ_BIN) && strcmp (fname, "-") )
+    read_bin_map (ctx, rg, n, fname);
+
+  fprintf (ctx->out, "done\n");
+  if (strcmp (fname, "-"))
+    fprintf (ctx->out, "See file %s\n", fname);
+  if (crc)
+    fprintf (ctx->out, "...CRC-32 of the %u bytes read: 0x%08X\n", size,
+        ~crc->crc);
+  if (cmp && cmp->err) {
+    fprintf (ctx->out, "...%u of %u bytes differ from %s, the first at 0x%04X:"
+        " read 0x%02X, expected 0x%02X\n", cmp->err, cmp->cnt,
+        ctx->hexfile_name, cmp->err_add, cmp->err_rd, cmp->err_exp);
+    GMT_FAIL (ctx, GMT_ERR_VERIFY);
+  }
+  if (cmp)
+    fprintf (ctx->out, "...%u bytes same as %s\n", cmp->cnt,
+        ctx->hexfile_name);
+  Rpipe_Free (ctx);
+}
+
+int
+Gmt_Read (gmt_ctx *ctx, int job, uint32_t add_0, uint32_t add_1,
+    const char *fname)
+{
+  GMT_ENTER (ctx);
+  read_to_file (ctx, job, add_0, add_1, fname);
+  GMT_LEAVE (ctx);
+}
+
+/* Disables (Gmt_Unlock) or enables (Gmt_Lock) the read out protection. The
+ * protection is on for a ROP byte of 0xAA on STM8S, and for any value but 0xAA
+ * on STM8L. The byte is not written if its value read back already gives the
+ * state asked for, unless PROG_MODE_FORCE_ALL.
+ */
+static void
+set_rop (gmt_ctx *ctx, int enable)
+{
+  uint32_t rop, rd;
+  int      on;
+
+  if (enable)
+    PRINT_IF_VERBOSE ("...Locking device (enable read out protection): ");
+  else
+    PRINT_IF_VERBOSE ("...Unlocking device (disable read out protection): ");
+  if (ctx->prog_mode & PROG_MODE_STM8L)
+    rop = enable ? 0x00 : 0xAA;
+  else
+    rop = enable ? 0xAA : 0x00;
+  if ( !(ctx->prog_mode & PROG_MODE_FORCE_ALL) ) {
+    rd = Stlink_Read_Byte (ctx, 0x4800);
+    on = (ctx->prog_mode & PROG_MODE_STM8L) ? (rd != 0xAA) : (rd == 0xAA);
+    if (on == enable) {
+      PRINT_IF_VERBOSE ("already set, ");
+      return;
+    }
+  }
+  Stlink_Unlock_Memory (ctx, &ctx->uc, 0x4800);
+  Stlink_Prog_Byte (ctx, 0x4800, rop);
+  //removing the read out protection erases the memory
+  if (!enable)
+    Shadow_Drop (ctx);
+}
+
+int
+Gmt_Unlock (gmt_ctx *ctx)
+{
+  GMT_ENTER (ctx);
+  set_rop (ctx, 0);
+  GMT_LEAVE (ctx);
+}
+
+int
+Gmt_Lock (gmt_ctx *ctx)
+{
+  GMT_ENTER (ctx);
+  set_rop (ctx, 1);
+  GMT_LEAVE (ctx);
+}
+
+static void
+write_byte (gmt_ctx *ctx, uint32_t add, uint32_t byte)
+{
+  PRINT_IF_VERBOSE ("...writing 0x%02X to address 0x%04X: ", byte, add);
+  Stlink_Unlock_Memory (ctx, &ctx->uc, add);
+  Stlink_Prog_Byte (ctx, add, byte);
+  PRINT_IF_VERBOSE ("done\n");
+
+  PRINT_IF_VERBOSE ("...verify address 0x%04X: ", add);
+  if (byte != Stlink_Read_Byte (ctx, add))
+    GMT_FAIL (ctx, GMT_ERR_VERIFY);
+}
+
+/* Writes and verifies one byte, GMT_ERR_VERIFY is returned without a message
+ */
+int
+Gmt_Write_Byte (gmt_ctx *ctx, uint32_t address, uint32_t byte)
+{
+  GMT_ENTER (ctx);
+  write_byte (ctx, address, byte);
+  GMT_LEAVE (ctx);
+}
+
+static void
+write_word (gmt_ctx *ctx, uint32_t add, uint32_t word)
+{
+  uint32_t data;
+
+  PRINT_IF_VERBOSE ("...writing 0x%04X to address 0x%04X: ", add, word);
+  Stlink_Unlock_Memory (ctx, &ctx->uc, add);
+  switch (add & 0x03) {
+  case 0x00:
+    data = stlink_read_dword (ctx, add);
+    data &= 0xFFFF;
+    data |= (word<<16);
+    Stlink_Prog_Dword (ctx, add, data);
+    break;
+  case 0x01:
+  case 0x03:
+    Stlink_Prog_Byte (ctx, add+1, word & 0xFF);
+    Stlink_Prog_Byte (ctx, add, word>>8);
+    break;
+  case 0x02:
+    data = stlink_read_dword (ctx, add);
+    data &= 0xFFFF0000;
+    data |= (word & 0xFFFF);
+    Stlink_Prog_Dword (ctx, add, data);
+  }
+  PRINT_IF_VERBOSE ("done\n");
+
+  PRINT_IF_VERBOSE ("...verify address 0x%04X: ", add);
+  if (word != Stlink_Read_Word (ctx, add))
+    GMT_FAIL (ctx, GMT_ERR_VERIFY);
+}
+
+/* Writes and verifies one word, GMT_ERR_VERIFY is returned without a message
+ */
+int
+Gmt_Write_Word (gmt_ctx *ctx, uint32_t address, uint32_t word)
+{
+  GMT_ENTER (ctx);
+  write_word (ctx, address, word);
+  GMT_LEAVE (ctx);
+}
+
+static void
+read_byte (gmt_ctx *ctx, uint32_t add, uint32_t *byte)
+{
+  PRINT_IF_VERBOSE ("...reading address 0x%04X: ", add);
+  *byte = Stlink_Read_Byte (ctx, add);
+}
+
+int
+Gmt_Read_Byte (gmt_ctx *ctx, uint32_t address, uint32_t *byte)
+{
+  GMT_ENTER (ctx);
+  read_byte (ctx, address, byte);
+  GMT_LEAVE (ctx);
+}
+
+static void
+read_word (gmt_ctx *ctx, uint32_t add, uint32_t *word)
+{
+  PRINT_IF_VERBOSE ("...reading address 0x%04X: ", add);
+  *word = Stlink_Read_Word (ctx, add);
+}
+
+int
+Gmt_Read_Word (gmt_ctx *ctx, uint32_t address, uint32_t *word)
+{
+  GMT_ENTER (ctx);
+  read_word (ctx, address, word);
+  GMT_LEAVE (ctx);
+}
+
+static void
+inc_byte (gmt_ctx *ctx, uint32_t add, uint32_t *byte)
+{
+  PRINT_IF_VERBOSE ("...reading address 0x%04X: ", add);
+  *byte = Stlink_Read_Byte (ctx, add);
+  PRINT_IF_VERBOSE ("0x%02X\n", *byte);
+
+  *byte = (*byte + 1) & 0xFF;
+  PRINT_IF_VERBOSE ("...writing back 0x%02X to address 0x%04X: ", *byte, add);
+  Stlink_Unlock_Memory (ctx, &ctx->uc, add);
+  Stlink_Prog_Byte (ctx, add, *byte);
+  PRINT_IF_VERBOSE ("done\n");
+
+  PRINT_IF_VERBOSE ("...verify address 0x%04X: ", add);
+  if (*byte != Stlink_Read_Byte (ctx, add))
+    GMT_FAIL (ctx, GMT_ERR_VERIFY);
+}
+
+/* Increments the byte at address, the new value is returned in byte */
+int
+Gmt_Inc_Byte (gmt_ctx *ctx, uint32_t address, uint32_t *byte)
+{
+  GMT_ENTER (ctx);
+  inc_byte (ctx, address, byte);
+  GMT_LEAVE (ctx);
+}
+
+static void
+inc_word (gmt_ctx *ctx, uint32_t add, uint32_t *word)
+{
+  PRINT_IF_VERBOSE ("...reading address 0x%04X: ", add);
+  *word = Stlink_Read_Word (ctx, add);
+  PRINT_IF_VERBOSE ("0x%04X\n", *word);
+
+  *word = (*word + 1) & 0xFFFF;
+  PRINT_IF_VERBOSE ("...writing back 0x%04X to address 0x%04X: ", *word, add);
+  Stlink_Unlock_Memory (ctx, &ctx->uc, add);
+  Stlink_Prog_Byte (ctx, add+1, *word & 0xFF);
+  if (!(*word & 0xFF))
+    Stlink_Prog_Byte (ctx, add, *word>>8);
+  PRINT_IF_VERBOSE ("done\n");
+
+  PRINT_IF_VERBOSE ("...verify address 0x%04X: ", add);
+  if (*word != Stlink_Read_Word (ctx, add))
+    GMT_FAIL (ctx, GMT_ERR_VERIFY);
+}
+
+/* Increments the word at address, the new value is returned in word */
+int
+Gmt_Inc_Word (gmt_ctx *ctx, uint32_t address, uint32_t *word)
+{
+  GMT_ENTER (ctx);
+  inc_word (ctx, address, word);
+  GMT_LEAVE (ctx);
+}
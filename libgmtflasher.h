@@ -0,0 +1,125 @@
+/* GmtFlasher library interface
+ * Cristian Gyorgy, 2021
+ *
+ * All the state of a programming session is kept in a gmt_ctx, so several
+ * sessions (one per STLink) can be used in the same process, one thread per
+ * context; Gmt_Ctx_Clone () gives the context of another probe the same hex
+ * image, without loading it again. Gmt_Read () writes its output from a thread
+ * of its own, that ends with the call. The functions returning int return
+ * GMT_OK or one of the GMT_ERR_* codes, the error message is printed on the
+ * context output.
+ *
+ * A typical session:
+ *   ctx = Gmt_Ctx_New ();
+ *   Gmt_Set_Mcu (ctx, "stm8s003f3");
+ *   Gmt_Load_Hex (ctx, "firmware.ihx");
+ *   Gmt_Open (ctx);
+ *   Gmt_Write (ctx, JOB_WRITE_ALL);
+ *   Gmt_Close (ctx);
+ *   Gmt_Ctx_Free (ctx);
+ *
+ * To keep the STLink open between jobs, Gmt_Release () resets the µC, that
+ * runs, and Gmt_Resume () takes it back, without the full SWIM entry sequence.
+ */
+
+#ifndef LIBGMTFLASHER_H
+#define LIBGMTFLASHER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct gmt_ctx gmt_ctx;
+
+enum gmt_error {
+  GMT_OK = 0,
+  GMT_ERR_NOMEM,		//memory allocation failure
+  GMT_ERR_ARG,			//wrong argument or call order
+  GMT_ERR_FILE,			//file open error
+  GMT_ERR_XML,			//device xml file error
+  GMT_ERR_MCU,			//µC not found in the device xml file
+  GMT_ERR_HEX,			//intel hex file error
+  GMT_ERR_USB,			//USB or STLink error
+  GMT_ERR_NO_PROBE,		//no STLink, or not the one selected
+  GMT_ERR_SWIM,			//SWIM error
+  GMT_ERR_UNLOCK,		//memory unlock failed
+  GMT_ERR_PROG,			//programming error
+  GMT_ERR_VERIFY,		//written data verification failed
+  GMT_ERR_CNT
+};
+
+/* Options, see Gmt_Set_Mode () */
+#define PROG_MODE_VERBOSE		0x0001
+#define PROG_MODE_STM8L			0x0002	//set by Gmt_Set_Mcu ()
+#define PROG_MODE_FORCE_ALL		0x0004
+#define PROG_MODE_PERSIST		0x0008
+#define PROG_MODE_LOW_SPEED		0x0010
+#define PROG_MODE_SHADOW		0x0020	//skip readback of known blocks
+#define PROG_MODE_LOADER		0x0040	//programm blocks from a RAM loader
+#define PROG_MODE_TIMINGS		0x0080	//keep programming times per µC
+#define PROG_MODE_PLAN			0x0100	//writes only print their plan
+#define PROG_MODE_READ_BIN		0x0200	//reads write raw binary files
+#define PROG_MODE_READ_CRC		0x0400	//reads print the CRC-32 of the data
+#define PROG_MODE_READ_CMP		0x0800	//reads compare with the hex file
+
+/* Jobs */
+#define JOB_WRITE_ALL			0x000001
+#define JOB_READ_ALL			0x000002
+#define JOB_WRITE_FLASH			0x000004
+#define JOB_READ_FLASH			0x000008
+#define JOB_WRITE_EEPROM		0x000010
+#define JOB_READ_EEPROM			0x000020
+#define JOB_WRITE_OPT			0x000040
+#define JOB_READ_OPT			0x000080
+#define JOB_UNLOCK			0x000100
+#define JOB_LOCK			0x000200
+#define JOB_WRITE_BYTE			0x000400
+#define JOB_READ_BYTE			0x000800
+#define JOB_WRITE_WORD			0x001000
+#define JOB_READ_WORD			0x002000
+#define JOB_INC_BYTE			0x004000
+#define JOB_INC_WORD			0x008000
+#define JOB_READ_RANGE			0x010000
+#define JOB_PRINT			0x020000
+#define JOB_VERIFY_ALL			0x040000
+#define JOB_VERIFY_FLASH		0x080000
+#define JOB_VERIFY_EEPROM		0x100000
+
+/* Context */
+gmt_ctx *Gmt_Ctx_New (void);
+void     Gmt_Ctx_Free (gmt_ctx *ctx);
+gmt_ctx *Gmt_Ctx_Clone (gmt_ctx *ctx);
+void     Gmt_Set_Output (gmt_ctx *ctx, FILE *out);
+void     Gmt_Set_Mode (gmt_ctx *ctx, uint32_t mode);
+uint32_t Gmt_Get_Mode (gmt_ctx *ctx);
+void     Gmt_Set_Probe (gmt_ctx *ctx, int probe);
+void     Gmt_Set_Chunk (gmt_ctx *ctx, uint32_t chunk);
+int      Gmt_Set_Mcu (gmt_ctx *ctx, const char *name);
+int      Gmt_Load_Hex (gmt_ctx *ctx, const char *fname);
+const char *Gmt_Strerror (int err);
+
+/* Listings, printed on the context output */
+int      Gmt_List_Mcu (gmt_ctx *ctx);
+int      Gmt_List_Probes (char (*serials)[32], int max);
+
+/* Session */
+int      Gmt_Open (gmt_ctx *ctx);
+int      Gmt_Close (gmt_ctx *ctx);
+int      Gmt_Release (gmt_ctx *ctx);
+int      Gmt_Resume (gmt_ctx *ctx);
+int      Gmt_Write (gmt_ctx *ctx, int job);
+int      Gmt_Verify (gmt_ctx *ctx, int job);
+int      Gmt_Read (gmt_ctx *ctx, int job, uint32_t add_0, uint32_t add_1,
+    const char *fname);
+int      Gmt_Unlock (gmt_ctx *ctx);
+int      Gmt_Lock (gmt_ctx *ctx);
+int      Gmt_Write_Byte (gmt_ctx *ctx, uint32_t address, uint32_t byte);
+int      Gmt_Write_Word (gmt_ctx *ctx, uint32_t address, uint32_t word);
+int      Gmt_Read_Byte (gmt_ctx *ctx, uint32_t address, uint32_t *byte);
+int      Gmt_Read_Word (gmt_ctx *ctx, uint32_t address, uint32_t *word);
+int      Gmt_Inc_Byte (gmt_ctx *ctx, uint32_t address, uint32_t *byte);
+int      Gmt_Inc_Word (gmt_ctx *ctx, uint32_t address, uint32_t *word);
+void     Gmt_Print_Timings (gmt_ctx *ctx);
+void     Gmt_Add_Timings (gmt_ctx *ctx, gmt_ctx *from);
+void     Gmt_Save_Timings (gmt_ctx *ctx);
+
+#endif
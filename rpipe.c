@@ -0,0 +1,310 @@
+/* Read pipeline, for the read commands.
+ * Stlink_Read_Memory () reads the µC memory chunk by chunk in the slots of a
+ * ring, and a second thread hands each chunk to the sinks of the read: the
+ * output file, intel hex or raw binary, the CRC-32 of the data and the compare
+ * with the loaded hex file, all in one pass. The sinks run while the next
+ * chunks are read, so the USB link does not wait for the file output.
+ * The sink thread does not touch the session: a sink failure is kept in the
+ * pipeline and reported by the reader, with GMT_FAIL. After a failure of the
+ * session, Rpipe_Free () stops the thread.
+ */
+
+/* CRC-32 (IEEE 802.3, as zlib) of data, to be started and ended with ~crc */
+static uint32_t
+rpipe_crc32 (uint32_t crc, const unsigned char *data, uint32_t size)
+{
+  while (size--) {
+    crc ^= *data++;
+    for (int i=0; i<8; i++)
+      crc = (crc & 1) ? ((crc>>1) ^ 0xEDB88320) : (crc>>1);
+  }
+  return crc;
+}
+
+static int
+rpipe_write (int fd, const unsigned char *data, uint32_t size)
+{
+  ssize_t n;
+
+  while (size) {
+    n = write (fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* Compares the chunk with the defined bytes of the hex image, the blocks of
+ * the image are in address order
+ */
+static void
+rpipe_cmp (rpipe *p, rpipe_sink *s, uint32_t address,
+    const unsigned char *data, uint32_t cnt)
+{
+  gmt_ctx  *ctx = p->ctx;
+  uint32_t  bs = ctx->uc.block_size;
+  int       lo = 0, hi = ctx->mblocks;
+
+  //first block that ends after address
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ctx->blk_add[mid] + bs <= address)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (int k=lo; k<ctx->mblocks && ctx->blk_add[k] < address + cnt; k++) {
+    uint32_t             add = ctx->blk_add[k];
+    const unsigned char *img = ctx->data + k*bs;
+    const uint32_t      *def = ctx->ddef + k*DEF_WORDS(bs);
+    uint32_t             j0 = (address > add) ? address - add : 0;
+    uint32_t             j1 = (address + cnt < add + bs) ? address + cnt - add
+        : bs;
+
+    for (uint32_t j=j0; j<j1; j++) {
+      unsigned char rd = data[add + j - address];
+
+      if (!Ihex_Def_Get (def, j))
+        continue;
+      s->cnt++;
+      if (rd == img[j])
+        continue;
+      if (!s->err) {
+        s->err_add = add + j;
+        s->err_rd = rd;
+        s->err_exp = img[j];
+      }
+      s->err++;
+    }
+  }
+}
+
+/* Hands a chunk to a sink, returns -1 with errno set if it failed */
+static int
+rpipe_put (rpipe *p, rpipe_sink *s, uint32_t address,
+    const unsigned char *data, uint32_t cnt)
+{
+  switch (s->type) {
+  case RPIPE_SINK_HEX:
+    return Ihex_Wr_Data (s->w, address, data, cnt);
+  case RPIPE_SINK_BIN:
+    if (!s->map)
+      return rpipe_write (s->fd, data, cnt);
+    memcpy (s->map + s->pos, data, cnt);
+    s->pos += cnt;
+    return 0;
+  case RPIPE_SINK_CRC:
+    s->crc = rpipe_crc32 (s->crc, data, cnt);
+    return 0;
+  case RPIPE_SINK_CMP:
+    rpipe_cmp (p, s, address, data, cnt);
+    return 0;
+  }
+  return 0;
+}
+
+static void *
+rpipe_thread (void *arg)
+{
+  rpipe    *p = arg;
+  uint32_t  i;
+  int       err = 0;
+
+  pthread_mutex_lock (&p->lock);
+  for (;;) {
+    while (p->tail == p->head && !p->done)
+      pthread_cond_wait (&p->filled, &p->lock);
+    if (p->abort || p->tail == p->head)
+      break;
+    i = p->tail % RPIPE_SLOTS;
+    pthread_mutex_unlock (&p->lock);
+
+    //after a failure the slots are only freed, the reader stops on p->err
+    for (int k=0; k<p->nsinks && !err; k++) {
+      if (rpipe_put (p, &p->sink[k], p->add[i], p->buf + i*p->slot_size,
+          p->cnt[i]))
+        err = errno;
+    }
+
+    pthread_mutex_lock (&p->lock);
+    if (err && !p->err)
+      p->err = err;
+    p->tail++;
+    pthread_cond_signal (&p->freed);
+  }
+
+  //all the data is in, the hex files get their end record
+  for (int k=0; k<p->nsinks && !p->abort && !p->err; k++) {
+    if (p->sink[k].type == RPIPE_SINK_HEX && Ihex_Wr_End (p->sink[k].w))
+      p->err = errno;
+  }
+  pthread_mutex_unlock (&p->lock);
+  return NULL;
+}
+
+/* Sets up the pipeline of a read, without sinks. The slots take a SWIM read
+ * chunk each.
+ */
+void
+Rpipe_New (gmt_ctx *ctx)
+{
+  rpipe *p;
+
+  Rpipe_Free (ctx);
+  p = calloc (1, sizeof(rpipe));
+  MALLOC_TST (p);
+  ctx->rp = p;
+  p->ctx = ctx;
+  pthread_mutex_init (&p->lock, NULL);
+  pthread_cond_init (&p->filled, NULL);
+  pthread_cond_init (&p->freed, NULL);
+  p->slot_size = ctx->swim_chunk ? ctx->swim_chunk : STLINK_SWIM_BUF_SIZE;
+  p->buf = malloc (RPIPE_SLOTS * p->slot_size);
+  MALLOC_TST (p->buf);
+}
+
+/* Adds a sink of type, the caller sets its output */
+rpipe_sink *
+Rpipe_Add_Sink (gmt_ctx *ctx, int type)
+{
+  rpipe      *p = ctx->rp;
+  rpipe_sink *s;
+
+  if (p->running || p->nsinks == RPIPE_SINKS_MAX) {
+    fprintf (ctx->out, "%s: no more sinks\n", __func__);
+    GMT_FAIL (ctx, GMT_ERR_ARG);
+  }
+  s = &p->sink[p->nsinks++];
+  s->type = type;
+  s->fd = -1;
+  if (type == RPIPE_SINK_CRC)
+    s->crc = 0xFFFFFFFF;
+  return s;
+}
+
+void
+Rpipe_Start (gmt_ctx *ctx)
+{
+  rpipe *p = ctx->rp;
+  int    err;
+
+  err = pthread_create (&p->thread, NULL, rpipe_thread, p);
+  if (err) {
+    fprintf (ctx->out, "%s: %s\n", __func__, strerror(err));
+    GMT_FAIL (ctx, GMT_ERR_NOMEM);
+  }
+  p->running = 1;
+}
+
+/* Returns the next free slot, of *size bytes, waits for the sinks if the ring
+ * is full
+ */
+unsigned char *
+Rpipe_Slot (gmt_ctx *ctx, uint32_t *size)
+{
+  rpipe *p = ctx->rp;
+  int    err;
+
+  pthread_mutex_lock (&p->lock);
+  if (p->head - p->tail == RPIPE_SLOTS)
+    p->waits++;
+  while (p->head - p->tail == RPIPE_SLOTS && !p->err)
+    pthread_cond_wait (&p->freed, &p->lock);
+  err = p->err;
+  pthread_mutex_unlock (&p->lock);
+  if (err) {
+    fprintf (ctx->out, "%s\n", strerror(err));
+    GMT_FAIL (ctx, GMT_ERR_FILE);
+  }
+  *size = p->slot_size;
+  return p->buf + (p->head % RPIPE_SLOTS) * p->slot_size;
+}
+
+/* Passes the slot got by Rpipe_Slot () to the sinks, with cnt bytes read from
+ * address
+ */
+void
+Rpipe_Push (gmt_ctx *ctx, uint32_t address, uint32_t cnt)
+{
+  rpipe *p = ctx->rp;
+
+  pthread_mutex_lock (&p->lock);
+  p->add[p->head % RPIPE_SLOTS] = address;
+  p->cnt[p->head % RPIPE_SLOTS] = cnt;
+  p->head++;
+  pthread_cond_signal (&p->filled);
+  pthread_mutex_unlock (&p->lock);
+}
+
+/* Waits for the sinks to take all the data, then closes the output files.
+ * The results of the sinks stay in ctx->rp until Rpipe_Free ().
+ */
+void
+Rpipe_End (gmt_ctx *ctx)
+{
+  rpipe *p = ctx->rp;
+
+  pthread_mutex_lock (&p->lock);
+  p->done = 1;
+  pthread_cond_signal (&p->filled);
+  pthread_mutex_unlock (&p->lock);
+  pthread_join (p->thread, NULL);
+  p->running = 0;
+  PRINT_IF_VERBOSE ("\n...read pipeline: %u chunks, the reader waited %u "
+      "times for the sinks\n", p->head, p->waits);
+
+  if (p->err) {
+    fprintf (ctx->out, "%s\n", strerror(p->err));
+    GMT_FAIL (ctx, GMT_ERR_FILE);
+  }
+  for (int k=0; k<p->nsinks; k++) {
+    rpipe_sink *s = &p->sink[k];
+
+    if (s->fd >= 0 && s->fd != STDOUT_FILENO) {
+      int q = close (s->fd);
+
+      s->fd = -1;
+      if (q) {
+        fprintf (ctx->out, "%s\n", strerror(errno));
+        GMT_FAIL (ctx, GMT_ERR_FILE);
+      }
+    }
+  }
+}
+
+/* Stops the sink thread, if still running after a failure, and releases the
+ * pipeline
+ */
+void
+Rpipe_Free (gmt_ctx *ctx)
+{
+  rpipe *p = ctx->rp;
+
+  if (!p)
+    return;
+  if (p->running) {
+    pthread_mutex_lock (&p->lock);
+    p->done = 1;
+    p->abort = 1;
+    pthread_cond_signal (&p->filled);
+    pthread_mutex_unlock (&p->lock);
+    pthread_join (p->thread, NULL);
+  }
+  for (int k=0; k<p->nsinks; k++) {
+    if (p->sink[k].fd >= 0 && p->sink[k].fd != STDOUT_FILENO)
+      close (p->sink[k].fd);
+    free (p->sink[k].w);
+  }
+  pthread_mutex_destroy (&p->lock);
+  pthread_cond_destroy (&p->filled);
+  pthread_cond_destroy (&p->freed);
+  free (p->buf);
+  free (p);
+  ctx->rp = NULL;
+}
@@ -0,0 +1,52 @@
+/* Read pipeline, see rpipe.c */
+#define RPIPE_SLOTS			8
+#define RPIPE_SINKS_MAX			4
+
+#define RPIPE_SINK_HEX			0	//intel hex file, see Ihex_Wr_Data ()
+#define RPIPE_SINK_BIN			1	//raw binary, mapped file or pipe
+#define RPIPE_SINK_CRC			2	//CRC-32 of the data
+#define RPIPE_SINK_CMP			3	//compare with the loaded hex file
+
+typedef struct {
+  int            type;
+  int            fd;		//HEX and BIN output, -1 if none
+  ihex_wr       *w;		//HEX
+  unsigned char *map;		//BIN to a mapped file, else written to fd
+  size_t         pos;		//BIN, bytes written
+  uint32_t       crc;		//CRC
+  uint32_t       cnt;		//CMP, defined bytes compared
+  uint32_t       err;		//CMP, bytes that differ
+  uint32_t       err_add;	//CMP, first byte that differs
+  unsigned char  err_rd;
+  unsigned char  err_exp;
+} rpipe_sink;
+
+typedef struct {
+  pthread_t       thread;	//runs the sinks
+  int             running;
+  pthread_mutex_t lock;
+  pthread_cond_t  filled;	//a slot was filled, or done
+  pthread_cond_t  freed;	//a slot was consumed
+  unsigned char  *buf;		//RPIPE_SLOTS slots of slot_size bytes
+  uint32_t        slot_size;
+  uint32_t        add[RPIPE_SLOTS];
+  uint32_t        cnt[RPIPE_SLOTS];
+  uint32_t        head;		//slots filled
+  uint32_t        tail;		//slots consumed
+  int             done;		//no more slots are filled
+  int             abort;	//stop without finishing the sinks
+  int             err;		//errno of the first sink failure
+  uint32_t        waits;	//the reader waited for a free slot
+  gmt_ctx        *ctx;		//hex image of RPIPE_SINK_CMP, only read
+  int             nsinks;
+  rpipe_sink      sink[RPIPE_SINKS_MAX];
+} rpipe;
+
+
+void           Rpipe_New (gmt_ctx *ctx);
+rpipe_sink    *Rpipe_Add_Sink (gmt_ctx *ctx, int type);
+void           Rpipe_Start (gmt_ctx *ctx);
+unsigned char *Rpipe_Slot (gmt_ctx *ctx, uint32_t *size);
+void           Rpipe_Push (gmt_ctx *ctx, uint32_t address, uint32_t cnt);
+void           Rpipe_End (gmt_ctx *ctx);
+void           Rpipe_Free (gmt_ctx *ctx);
@@ -0,0 +1,331 @@
+/* Host side shadow of the µC FLASH and EEPROM, for PROG_MODE_SHADOW.
+ * The shadow keeps the content of the blocks written or read back in previous
+ * sessions, in /tmp/gmtflasher/shadow_<mcu>_<uid>.bin, where uid is the unique
+ * ID of the µC. The write diff, diff_mcu (), takes a known block from the
+ * shadow instead of reading it back from the µC, so an unchanged block is
+ * skipped without SWIM traffic.
+ * The shadow is loaded by the first memory unlock of a session, and checked
+ * against the µC, that may have been written by something else meanwhile: each
+ * run of known blocks by its on-target CRC, see Stlink_Crc (), and the blocks
+ * the CRC can not cover by one dword each. If one differs the shadow is
+ * discarded. A session that writes the µC without PROG_MODE_SHADOW removes its
+ * shadow, the unique ID is only read if there is a shadow of the same µC type.
+ * The file is removed when loaded and written back by Gmt_Release (), so a
+ * session that fails leaves no shadow behind.
+ */
+
+#define SHADOW_UID_STM8S	0x4865
+#define SHADOW_UID_STM8L	0x4926
+#define SHADOW_UID_SIZE		12
+
+#define SHADOW_NONE		0	//not loaded in this session
+#define SHADOW_LOADED		1
+#define SHADOW_OFF		2	//µC without unique ID
+
+typedef struct {
+  char     magic[4];
+  char     mcu[64];
+  uint32_t flash_size;
+  uint32_t eeprom_add;
+  uint32_t eeprom_size;
+  uint32_t block_size;
+} shadow_hdr;
+
+/* Returns the offset of address in the shadow, or -1 if not shadowed */
+static int
+shadow_offset (gmt_ctx *ctx, uint32_t address)
+{
+  mcu *uc = &ctx->uc;
+
+  if (address >= 0x8000 && address < (0x8000 + uc->flash_size))
+    return address - 0x8000;
+  if (address >= uc->eeprom_add && address < (uc->eeprom_add + uc->eeprom_size))
+    return uc->flash_size + address - uc->eeprom_add;
+  return -1;
+}
+
+static uint32_t
+shadow_address (gmt_ctx *ctx, uint32_t offset)
+{
+  if (offset < ctx->uc.flash_size)
+    return 0x8000 + offset;
+  return ctx->uc.eeprom_add + offset - ctx->uc.flash_size;
+}
+
+static void
+shadow_header (gmt_ctx *ctx, shadow_hdr *hdr)
+{
+  memset (hdr, 0x00, sizeof(*hdr));
+  memcpy (hdr->magic, "GMTS", 4);
+  snprintf (hdr->mcu, sizeof(hdr->mcu), "%s", ctx->uc.name);
+  for (int i=0; hdr->mcu[i]; i++)
+    hdr->mcu[i] = toupper (hdr->mcu[i]);
+  hdr->flash_size = ctx->uc.flash_size;
+  hdr->eeprom_add = ctx->uc.eeprom_add;
+  hdr->eeprom_size = ctx->uc.eeprom_size;
+  hdr->block_size = ctx->uc.block_size;
+}
+
+/* Compares one dword of each of the n known blocks from b with the µC, returns
+ * 0 if they are all the same
+ */
+static int
+shadow_check_dwords (gmt_ctx *ctx, uint32_t b, uint32_t n)
+{
+  uint32_t bs = ctx->uc.block_size;
+
+  for ( ; n--; b++) {
+    //the dword position changes from block to block
+    uint32_t off = b*bs + ((b*12) % bs & ~0x03);
+    unsigned char *s = ctx->shadow + off;
+    uint32_t dword = (s[0]<<24) | (s[1]<<16) | (s[2]<<8) | s[3];
+    if (stlink_read_dword (ctx, shadow_address (ctx, off)) != dword)
+      return -1;
+  }
+  return 0;
+}
+
+/* Compares the known blocks with the µC, returns 0 if they are all the same.
+ * A run of known blocks below 0x10000 is checked by its on-target CRC, the
+ * other blocks, and all of them if the µC does not run the CRC routine, by one
+ * dword per block.
+ */
+static int
+shadow_check (gmt_ctx *ctx, uint32_t nblk)
+{
+  uint32_t bs = ctx->uc.block_size;
+  int      crc = 0;			//0 not loaded, 1 loaded, -1 not working
+
+  for (uint32_t b=0, n; b<nblk; b+=n) {
+    uint32_t add = shadow_address (ctx, b*bs);
+
+    n = 1;
+    if (!ctx->shadow_known[b])
+      continue;
+    //blocks consecutive in the µC address space, in the reach of the routine
+    while (b+n < nblk && ctx->shadow_known[b+n]
+        && shadow_address (ctx, (b+n)*bs) == add + n*bs
+        && add + (n+1)*bs <= 0x10000)
+      n++;
+    if (crc >= 0 && add + n*bs <= 0x10000) {
+      if (!crc)
+        Stlink_Crc_Load (ctx);
+      crc = 1;
+      int q = Stlink_Crc (ctx, add, n*bs);
+      if (q == (int)crc16_ccitt (0xFFFF, ctx->shadow + b*bs, n*bs))
+        continue;
+      if (q >= 0)
+        return -1;
+      PRINT_IF_VERBOSE ("\n...CRC not computed by the µC, shadow checked by "
+          "samples");
+      crc = -1;
+    }
+    if (shadow_check_dwords (ctx, b, n))
+      return -1;
+  }
+  return 0;
+}
+
+/* Writes the file name prefix of the shadows of the µC type in name, returns
+ * its length
+ */
+static int
+shadow_file_prefix (gmt_ctx *ctx, char *name, int size)
+{
+  int n = snprintf (name, size, "/tmp/gmtflasher/shadow_");
+
+  for (int i=0; ctx->uc.name[i] && n<size-1; i++)
+    name[n++] = toupper (ctx->uc.name[i]);
+  n += snprintf (name + n, size - n, "_");
+  return n;
+}
+
+/* Sets the shadow file name from the unique ID of the µC, returns -1 if the µC
+ * has no unique ID
+ */
+static int
+shadow_file_name (gmt_ctx *ctx)
+{
+  unsigned char uid[SHADOW_UID_SIZE];
+  int           n, i;
+
+  Stlink_Read_Block (ctx, (ctx->prog_mode & PROG_MODE_STM8L) ?
+      SHADOW_UID_STM8L : SHADOW_UID_STM8S, SHADOW_UID_SIZE, uid);
+  for (i=1; i<SHADOW_UID_SIZE && uid[i] == uid[0]; i++)
+    ;
+  if (i == SHADOW_UID_SIZE)
+    return -1;
+  n = shadow_file_prefix (ctx, ctx->shadow_file, sizeof(ctx->shadow_file));
+  for (i=0; i<SHADOW_UID_SIZE; i++)
+    n += snprintf (ctx->shadow_file + n, sizeof(ctx->shadow_file) - n, "%02X",
+        uid[i]);
+  snprintf (ctx->shadow_file + n, sizeof(ctx->shadow_file) - n, ".bin");
+  return 0;
+}
+
+static void
+shadow_load (gmt_ctx *ctx)
+{
+  mcu          *uc = &ctx->uc;
+  shadow_hdr    hdr, fhdr;
+  uint32_t      nblk = (uc->flash_size + uc->eeprom_size) / uc->block_size;
+  uint32_t      known = 0;
+  FILE          *f;
+
+  ctx->shadow_state = SHADOW_OFF;
+  if (shadow_file_name (ctx)) {
+    PRINT_IF_VERBOSE ("\n...no µC unique ID, shadow cache not used\n");
+    return;
+  }
+
+  ctx->shadow = malloc (uc->flash_size + uc->eeprom_size);
+  MALLOC_TST (ctx->shadow);
+  ctx->shadow_known = calloc (nblk, 1);
+  MALLOC_TST (ctx->shadow_known);
+  ctx->shadow_state = SHADOW_LOADED;
+
+  shadow_header (ctx, &hdr);
+  f = fopen (ctx->shadow_file, "r");
+  if (f) {
+    if ( (fread (&fhdr, sizeof(fhdr), 1, f) != 1)
+        || memcmp (&fhdr, &hdr, sizeof(hdr))
+        || (fread (ctx->shadow_known, nblk, 1, f) != 1)
+        || (fread (ctx->shadow, uc->flash_size + uc->eeprom_size, 1, f) != 1) )
+      memset (ctx->shadow_known, 0x00, nblk);
+    fclose (f);
+    unlink (ctx->shadow_file);
+  }
+
+  if (shadow_check (ctx, nblk)) {
+    PRINT_IF_VERBOSE ("\n...shadow cache out of date, discarded\n");
+    memset (ctx->shadow_known, 0x00, nblk);
+  }
+  for (uint32_t b=0; b<nblk; b++)
+    known += ctx->shadow_known[b];
+  PRINT_IF_VERBOSE ("\n...shadow cache %s: %u of %u blocks known\n",
+      ctx->shadow_file, known, nblk);
+}
+
+/* Loads the shadow once per session, if PROG_MODE_SHADOW is set. Must be done
+ * before the µC memory is changed, the changes are then recorded by
+ * Shadow_Update (). Without PROG_MODE_SHADOW the shadow of the µC, if there is
+ * one, is removed, as it will be out of date.
+ */
+void
+Shadow_Load (gmt_ctx *ctx)
+{
+  char   pattern[sizeof(ctx->shadow_file)];
+  glob_t g;
+  int    n;
+
+  if (ctx->shadow_state != SHADOW_NONE)
+    return;
+  if (ctx->prog_mode & PROG_MODE_SHADOW) {
+    shadow_load (ctx);
+    return;
+  }
+
+  //no SWIM traffic unless there is a shadow of the same µC type
+  ctx->shadow_state = SHADOW_OFF;
+  n = shadow_file_prefix (ctx, pattern, sizeof(pattern) - 5);
+  snprintf (pattern + n, sizeof(pattern) - n, "*.bin");
+  if (glob (pattern, 0, NULL, &g))
+    return;
+  globfree (&g);
+  if (!shadow_file_name (ctx))
+    unlink (ctx->shadow_file);
+}
+
+/* Copies the block at address from the shadow in data. Returns 1 if done, 0 if
+ * the block is not known and must be read from the µC.
+ */
+int
+Shadow_Get_Block (gmt_ctx *ctx, uint32_t address, uint32_t size,
+    unsigned char *data)
+{
+  Shadow_Load (ctx);
+  if (ctx->shadow_state != SHADOW_LOADED)
+    return 0;
+
+  int off = shadow_offset (ctx, address);
+  if (off < 0 || size != ctx->uc.block_size || (off % size)
+      || !ctx->shadow_known[off / size])
+    return 0;
+  memcpy (data, ctx->shadow + off, size);
+  return 1;
+}
+
+/* Records size bytes of µC memory content, just written or read. A block
+ * becomes known when it is fully covered, the other bytes only update blocks
+ * already known.
+ */
+void
+Shadow_Update (gmt_ctx *ctx, uint32_t address, unsigned char *data,
+    uint32_t size)
+{
+  uint32_t bs = ctx->uc.block_size;
+  uint32_t cnt;
+
+  if (ctx->shadow_state != SHADOW_LOADED)
+    return;
+  while (size) {
+    cnt = bs - (address % bs);
+    if (cnt > size)
+      cnt = size;
+    int off = shadow_offset (ctx, address);
+    if (off >= 0 && (cnt == bs || ctx->shadow_known[off / bs])) {
+      memcpy (ctx->shadow + off, data, cnt);
+      ctx->shadow_known[off / bs] = 1;
+    }
+    address += cnt;
+    data += cnt;
+    size -= cnt;
+  }
+}
+
+/* Forgets the µC content, after the read out protection removal erased it */
+void
+Shadow_Drop (gmt_ctx *ctx)
+{
+  Shadow_Load (ctx);
+  if (ctx->shadow_state != SHADOW_LOADED)
+    return;
+  memset (ctx->shadow_known, 0x00, (ctx->uc.flash_size + ctx->uc.eeprom_size)
+      / ctx->uc.block_size);
+}
+
+/* Writes the shadow back to its file at the end of a session */
+void
+Shadow_Save (gmt_ctx *ctx)
+{
+  mcu        *uc = &ctx->uc;
+  shadow_hdr  hdr;
+  FILE        *f;
+
+  if (ctx->shadow_state == SHADOW_LOADED) {
+    shadow_header (ctx, &hdr);
+    f = fopen (ctx->shadow_file, "w");
+    if ( !f || (fwrite (&hdr, sizeof(hdr), 1, f) != 1)
+        || (fwrite (ctx->shadow_known, (uc->flash_size + uc->eeprom_size)
+          / uc->block_size, 1, f) != 1)
+        || (fwrite (ctx->shadow, uc->flash_size + uc->eeprom_size, 1, f) != 1) )
+    {
+      PRINT_IF_VERBOSE ("...shadow cache %s: %s\n", ctx->shadow_file,
+          strerror(errno));
+      unlink (ctx->shadow_file);
+    }
+    if (f)
+      fclose (f);
+  }
+  Shadow_Free (ctx);
+}
+
+void
+Shadow_Free (gmt_ctx *ctx)
+{
+  free (ctx->shadow);
+  free (ctx->shadow_known);
+  ctx->shadow = NULL;
+  ctx->shadow_known = NULL;
+  ctx->shadow_state = SHADOW_NONE;
+}
@@ -0,0 +1,8 @@
+void Shadow_Load (gmt_ctx *ctx);
+int  Shadow_Get_Block (gmt_ctx *ctx, uint32_t address, uint32_t size,
+    unsigned char *data);
+void Shadow_Update (gmt_ctx *ctx, uint32_t address, unsigned char *data,
+    uint32_t size);
+void Shadow_Drop (gmt_ctx *ctx);
+void Shadow_Save (gmt_ctx *ctx);
+void Shadow_Free (gmt_ctx *ctx);
@@ -1,19 +1,84 @@
 
 
+static int
+stlink_is_probe (libusb_device *dev)
+{
+  struct libusb_device_descriptor desc;
+
+  if (libusb_get_device_descriptor (dev, &desc))
+    return 0;
+  return desc.idVendor==STLINK_USB_VENDOR_ID
+      && desc.idProduct==STLINK_USB_PRODUCT_ID;
+}
+
+/* Lists the attached STLinkV2 probes, in the order used by ctx->probe, and
+ * returns their number. If serials is not NULL, the serial number of each
+ * probe, or its bus/address if it cannot be opened, is copied in serials, up to
+ * max entries. It uses its own libusb context, which is released on return.
+ */
+int
+Stlink_Usb_List (char (*serials)[32], int max)
+{
+  libusb_context *ctx;
+  libusb_device **devs;
+  int n = 0;
+
+  if (libusb_init (&ctx))
+    return 0;
+  ssize_t cnt = libusb_get_device_list (ctx, &devs);
+  for (int i=0; i<cnt; i++) {
+    if (!stlink_is_probe (devs[i]))
+      continue;
+    if (serials && n<max) {
+      libusb_device_handle *h;
+      struct libusb_device_descriptor desc;
+      unsigned char sn[32];
+      int k = -1;
+
+      libusb_get_device_descriptor (devs[i], &desc);
+      if (!libusb_open (devs[i], &h)) {
+        k = libusb_get_string_descriptor_ascii (h, desc.iSerialNumber, sn,
+            sizeof(sn));
+        libusb_close (h);
+      }
+      if (k > 0) {
+        //the STLinkV2 serial is often not printable, show it in hex then
+        int j;
+        for (j=0; j<k && isprint (sn[j]); j++);
+        if (j==k) {
+          snprintf (serials[n], 32, "%.*s", k, sn);
+        } else {
+          for (j=0; j<k && j<15; j++)
+            sprintf (serials[n] + 2*j, "%02X", sn[j]);
+        }
+      } else {
+        snprintf (serials[n], 32, "bus %d, address %d",
+            libusb_get_bus_number (devs[i]),
+            libusb_get_device_address (devs[i]));
+      }
+    }
+    n++;
+  }
+  if (cnt > 0)
+    libusb_free_device_list (devs, 1);
+  libusb_exit (ctx);
+  return n;
+}
+
 void
-Stlink_Usb_Init (void)
+Stlink_Usb_Init (gmt_ctx *ctx)
 {
   libusb_device **devs;
-  int i, k;
+  int i, k, n;
 
   /* Initialize libusb. This function must be called before calling any other
    * libusb function.
    */
-  k = libusb_init (&gusbcontext);
+  k = libusb_init (&ctx->usbcontext);
   if (k) {
-    printf ("%s:%s:%i: %s\n", __FILE__, __func__, __LINE__,
+    fprintf (ctx->out, "%s:%s:%i: %s\n", __FILE__, __func__, __LINE__,
         libusb_error_name (k));
-    exit (EXIT_FAILURE);
+    GMT_FAIL (ctx, GMT_ERR_USB);
   }
 
   /* Returns a list of USB devices currently attached to the system. This is
@@ -21,57 +86,52 @@ Stlink_Usb_Init (void)
    * this function indicates the number of devices in the resultant list. The
    * list is actually one element larger, as it is NULL-terminated.
    */
-  ssize_t cnt = libusb_get_device_list (gusbcontext, &devs);
+  ssize_t cnt = libusb_get_device_list (ctx->usbcontext, &devs);
   if (cnt<1) {
-    printf ("%s:%s:%i: %s\n", __FILE__, __func__, __LINE__,
+    fprintf (ctx->out, "%s:%s:%i: %s\n", __FILE__, __func__, __LINE__,
         libusb_error_name (cnt));
-    exit (EXIT_FAILURE);
+    GMT_FAIL (ctx, GMT_ERR_USB);
   }
 
-  for (i=0; i<(cnt-1); i++) {
-    struct libusb_device_descriptor desc;
-
-    k = libusb_get_device_descriptor(devs[i], &desc);
-    if (k) {
-      printf ("%s:%s:%i: %s\n", __FILE__, __func__, __LINE__,
-          libusb_error_name (k));
-      libusb_free_device_list (devs, 1);
-      exit (EXIT_FAILURE);
-    }
-    if (desc.idVendor==STLINK_USB_VENDOR_ID
-        && desc.idProduct==STLINK_USB_PRODUCT_ID)
+  //take the STLink with index ctx->probe
+  for (i=0, n=0; i<cnt; i++) {
+    if (stlink_is_probe (devs[i]) && n++ == ctx->probe)
       break;
   }
 
-  if (i==(cnt-1)) {
+  if (i==cnt) {
     libusb_free_device_list (devs, 1);
-    printf ("No STLinkV2 device connected!\n");
-    exit (EXIT_FAILURE);
+    if (ctx->probe)
+      fprintf (ctx->out, "No STLinkV2 device with index %d connected!\n",
+          ctx->probe);
+    else
+      fprintf (ctx->out, "No STLinkV2 device connected!\n");
+    GMT_FAIL (ctx, GMT_ERR_USB);
   }
 
   /* We found the StLink, devs[i], try to open it */
-  k = libusb_open (devs[i], &gdev_handle);
+  k = libusb_open (devs[i], &ctx->dev_handle);
   switch (k) {
   case 0:
     break;
   case LIBUSB_ERROR_NO_MEM:
-    printf (
+    fprintf (ctx->out,
         "libusb_open() returned error: memory allocation failure\n");
     break;
   case LIBUSB_ERROR_ACCESS:
-    printf (
+    fprintf (ctx->out,
         "libusb_open() returned error: user has insufficient permissions\n");
     break;
   case LIBUSB_ERROR_NO_DEVICE:
-    printf (
+    fprintf (ctx->out,
         "libusb_open() returned error: device has been disconnected\n");
     break;
   default:
-    printf ("libusb_open() returned error: %i\n", k);
+    fprintf (ctx->out, "libusb_open() returned error: %i\n", k);
   }
   if (k) {
     libusb_free_device_list (devs, 1);
-    exit (EXIT_FAILURE);
+    GMT_FAIL (ctx, GMT_ERR_NO_PROBE);
   }
 
   /* After we opened the device, we must free the list and unref the devices in
@@ -83,157 +143,371 @@ Stlink_Usb_Init (void)
    * is active, you cannot claim the interface, and libusb will be unable to
    * perform I/O.
    */
-  k = libusb_kernel_driver_active (gdev_handle, 0);
+  k = libusb_kernel_driver_active (ctx->dev_handle, 0);
   switch (k) {
   case 0:
   //no kernel driver active
     break;
   case 1:
   //a kernel driver is active
-    if (libusb_detach_kernel_driver(gdev_handle, 0)) {
-      printf ("libusb_detach_kernel_driver() returned error\n");
-      exit (EXIT_FAILURE);
+    if (libusb_detach_kernel_driver(ctx->dev_handle, 0)) {
+      fprintf (ctx->out, "libusb_detach_kernel_driver() returned error\n");
+      GMT_FAIL (ctx, GMT_ERR_USB);
     }
     break;
   case LIBUSB_ERROR_NO_DEVICE:
-    printf (
+    fprintf (ctx->out,
         "libusb_kernel_driver_active() returned error: no device\n");
-    exit (EXIT_FAILURE);
+    GMT_FAIL (ctx, GMT_ERR_USB);
     break;
   case LIBUSB_ERROR_NOT_SUPPORTED:
-    printf (
+    fprintf (ctx->out,
         "libusb_kernel_driver_active() returned error: not supported\n");
-    exit (EXIT_FAILURE);
+    GMT_FAIL (ctx, GMT_ERR_USB);
     break;
   default:
   //other error
-    printf ("libusb_kernel_driver_active() returned error: %i\n", k);
-    exit (EXIT_FAILURE);
+    fprintf (ctx->out, "libusb_kernel_driver_active() returned error: %i\n", k);
+    GMT_FAIL (ctx, GMT_ERR_USB);
   }
 
-  if (libusb_claim_interface (gdev_handle, 0)) {
-    printf ("libusb_claim_interface: unable to claim interface\n");
-    exit (EXIT_FAILURE);
+  if (libusb_claim_interface (ctx->dev_handle, 0)) {
+    fprintf (ctx->out, "libusb_claim_interface: unable to claim interface\n");
+    GMT_FAIL (ctx, GMT_ERR_USB);
   }
 }
 
-static void
-usb_tx_cmd (unsigned char *buf)
+/* Asynchronous transmit queue.
+ * All OUT transfers to the STLink (commands and block data) are submitted with
+ * the libusb async API and are not waited for, so the next command can be
+ * built and queued while the previous one is still on the bus. The endpoint
+ * keeps the order of the submitted transfers. The queue is drained, and the
+ * transfer status checked, after every IN transfer and before the device is
+ * closed.
+ */
+static void LIBUSB_CALL
+usb_txq_done (struct libusb_transfer *xfer)
 {
-  int txcnt = 0;
-  int try = 0;
-  int q;
+  usb_txq_slot *slot = xfer->user_data;
+  gmt_ctx *ctx = slot->ctx;
+
+  if ( (xfer->status == LIBUSB_TRANSFER_COMPLETED
+      && xfer->actual_length == xfer->length)
+      || xfer->status == LIBUSB_TRANSFER_CANCELLED ) {
+    slot->busy = 0;
+    ctx->txq_pending--;
+    return;
+  }
+  //keep the slot busy, the error is handled in usb_txq_check ()
+  slot->busy = -1;
+}
 
-utc_try:
-  q = libusb_bulk_transfer (gdev_handle, STLINK_USB_ENDPOINT_OUT2, buf, 16,
-      &txcnt, 100);
+static void
+usb_txq_submit (gmt_ctx *ctx, usb_txq_slot *slot)
+{
+  int q = libusb_submit_transfer (slot->xfer);
   if (q) {
-    printf ("%s:%s:%d: %s, buf[0,1]=0x%02X%02X\n", __FILE__, __func__,
-        __LINE__, libusb_error_name (q), buf[0], buf[1]);
-    if (q==LIBUSB_ERROR_PIPE) {
-    //endpoint halted
-      try++;
-      if (try>=2)
-        exit (EXIT_FAILURE);
-      libusb_clear_halt (gdev_handle, STLINK_USB_ENDPOINT_OUT2);
-      usleep (2000);
-      goto utc_try;
-    } else {
-      //libusb_reset_device (gdev_handle);
-      exit (EXIT_FAILURE);
+    fprintf (ctx->out, "%s:%s:%d: %s, buf[0,1]=0x%02X%02X\n", __FILE__,
+        __func__, __LINE__, libusb_error_name (q), slot->buf[0], slot->buf[1]);
+    GMT_FAIL (ctx, GMT_ERR_USB);
+  }
+}
+
+/* Number of transfers still owned by libusb */
+static int
+usb_txq_in_flight (gmt_ctx *ctx)
+{
+  int n = 0;
+  for (int i=0; i<USB_TXQ_DEPTH; i++)
+    n += ctx->txq[i].busy == 1;
+  return n;
+}
+
+/* Cancels the transfers in flight and waits until libusb gives them back. It
+ * does not exit on errors, so it is also used by the exit handler.
+ */
+static void
+usb_txq_cancel (gmt_ctx *ctx)
+{
+  for (int i=0; i<USB_TXQ_DEPTH; i++) {
+    if (ctx->txq[i].busy == 1)
+      libusb_cancel_transfer (ctx->txq[i].xfer);
+  }
+  for (int i=0; i<USB_TXQ_DEPTH && usb_txq_in_flight (ctx); i++) {
+    struct timeval tv = {0, 100000};
+    libusb_handle_events_timeout (ctx->usbcontext, &tv);
+  }
+}
+
+/* Handles the failed transfers. A failed transfer can not be resubmitted: the
+ * ones queued after it may already be on the bus and the device would get a
+ * command header after its data. So the rest of the queue is cancelled and
+ * the job fails, a halted endpoint is cleared for the next session.
+ */
+static void
+usb_txq_check (gmt_ctx *ctx)
+{
+  for (int i=0; i<USB_TXQ_DEPTH; i++) {
+    usb_txq_slot *slot = &ctx->txq[i];
+
+    if (slot->busy != -1)
+      continue;
+    struct libusb_transfer *xfer = slot->xfer;
+    if (xfer->status == LIBUSB_TRANSFER_COMPLETED)
+      fprintf (ctx->out, "%s:%s:%d: libusb_submit_transfer: wrong number of "
+          "tx bytes, asked %d, transmitted %d\n", __FILE__, __func__, __LINE__,
+          xfer->length, xfer->actual_length);
+    else
+      fprintf (ctx->out, "%s:%s:%d: transfer status %d, buf[0,1]=0x%02X%02X\n",
+          __FILE__, __func__, __LINE__, xfer->status, slot->buf[0],
+          slot->buf[1]);
+    usb_txq_cancel (ctx);
+    if (xfer->status == LIBUSB_TRANSFER_STALL)
+      libusb_clear_halt (ctx->dev_handle, STLINK_USB_ENDPOINT_OUT2);
+    GMT_FAIL (ctx, GMT_ERR_USB);
+  }
+}
+
+/* Waits until at most max_pending transfers are still in flight */
+static void
+usb_txq_wait (gmt_ctx *ctx, int max_pending)
+{
+  while (ctx->txq_pending > max_pending) {
+    int q = libusb_handle_events (ctx->usbcontext);
+    if (q && q != LIBUSB_ERROR_INTERRUPTED) {
+      fprintf (ctx->out, "%s:%s:%d: %s\n", __FILE__, __func__, __LINE__,
+          libusb_error_name (q));
+      GMT_FAIL (ctx, GMT_ERR_USB);
     }
+    usb_txq_check (ctx);
   }
-  if(txcnt != 16) {
-    printf ("%s:%s:%d: libusb_bulk_transfer: wrong number of tx bytes,"
-        " asked 16, transmitted %d\n", __FILE__, __func__, __LINE__, txcnt);
-    exit (EXIT_FAILURE);
+}
+
+/* Queues cnt bytes from buf for transmission on the OUT endpoint, the data is
+ * copied so the caller may reuse buf immediately
+ */
+static void
+usb_tx_queue (gmt_ctx *ctx, unsigned char *buf, int cnt)
+{
+  usb_txq_slot *slot;
+
+  if (cnt > USB_TXQ_SLOT_SIZE) {
+    fprintf (ctx->out, "%s:%s:%d: %d bytes do not fit in a tx slot\n", __FILE__,
+        __func__, __LINE__, cnt);
+    GMT_FAIL (ctx, GMT_ERR_USB);
   }
+
+  usb_txq_wait (ctx, USB_TXQ_DEPTH - 1);
+  //slots are used round robin, so the next one is the oldest
+  while (ctx->txq[ctx->txq_next].busy)
+    ctx->txq_next = (ctx->txq_next + 1) % USB_TXQ_DEPTH;
+  slot = &ctx->txq[ctx->txq_next];
+  if (!slot->xfer) {
+    slot->xfer = libusb_alloc_transfer (0);
+    MALLOC_TST (slot->xfer);
+  }
+
+  memcpy (slot->buf, buf, cnt);
+  slot->ctx = ctx;
+  libusb_fill_bulk_transfer (slot->xfer, ctx->dev_handle,
+      STLINK_USB_ENDPOINT_OUT2, slot->buf, cnt, usb_txq_done, slot, 100);
+  slot->busy = 1;
+  ctx->txq_pending++;
+  usb_txq_submit (ctx, slot);
+}
+
+static void
+usb_tx_flush (gmt_ctx *ctx)
+{
+  usb_txq_wait (ctx, 0);
+}
+
+static void
+usb_tx_cmd (gmt_ctx *ctx, unsigned char *buf)
+{
+  usb_tx_queue (ctx, buf, 16);
 }
 
 static void
-usb_rx (unsigned char *buf, int cnt)
+usb_rx (gmt_ctx *ctx, unsigned char *buf, int cnt)
 {
   int rxcnt = 0;
   int try = 0;
   int q;
 
 ur_try:
-  q = libusb_bulk_transfer (gdev_handle, STLINK_USB_ENDPOINT_IN1, buf, cnt,
+  q = libusb_bulk_transfer (ctx->dev_handle, STLINK_USB_ENDPOINT_IN1, buf, cnt,
       &rxcnt, 100);
   if (q) {
-    printf ("%s:%s:%d: %s\n", __FILE__, __func__,__LINE__,
+    fprintf (ctx->out, "%s:%s:%d: %s\n", __FILE__, __func__,__LINE__,
         libusb_error_name (q));
     if (q==LIBUSB_ERROR_PIPE) {
     //endpoint halted
       try++;
       if (try>=2)
-        exit (EXIT_FAILURE);
-      libusb_clear_halt (gdev_handle, STLINK_USB_ENDPOINT_IN1);
+        GMT_FAIL (ctx, GMT_ERR_USB);
+      libusb_clear_halt (ctx->dev_handle, STLINK_USB_ENDPOINT_IN1);
       usleep (2000);
       goto ur_try;
     } else {
-      exit (EXIT_FAILURE);
+      GMT_FAIL (ctx, GMT_ERR_USB);
     }
   }
   if(rxcnt != cnt) {
-    printf ("%s:%s:%d: libusb_bulk_transfer: wrong number of rx bytes,"
-        " asked %d, received %d\n", __FILE__, __func__, __LINE__, cnt, rxcnt);
-    exit (EXIT_FAILURE);
+    fprintf (ctx->out, "%s:%s:%d: libusb_bulk_transfer: wrong number of rx "
+        "bytes, asked %d, received %d\n", __FILE__, __func__, __LINE__, cnt,
+        rxcnt);
+    GMT_FAIL (ctx, GMT_ERR_USB);
   }
+  /* the IN transfer only completes after the device processed the commands
+   * queued before it, check their status too
+   */
+  usb_tx_flush (ctx);
 }
 
+/* Releases the STLink. Called from the exit handler, so it must not exit on
+ * errors: transfers still in flight are cancelled, not checked. The queue is
+ * left empty, the daemon opens the probe again after a failed job.
+ */
 void
-Stlink_Swim_Cmd (uint32_t cmd)
+Stlink_Usb_Close (gmt_ctx *ctx)
+{
+  if (ctx->dev_handle) {
+    usb_txq_cancel (ctx);
+    for (int i=0; i<USB_TXQ_DEPTH; i++) {
+      //a transfer libusb did not give back is leaked, not freed under it
+      if (ctx->txq[i].xfer && ctx->txq[i].busy != 1)
+        libusb_free_transfer (ctx->txq[i].xfer);
+      ctx->txq[i].xfer = NULL;
+      ctx->txq[i].busy = 0;
+    }
+    ctx->txq_pending = 0;
+    ctx->txq_next = 0;
+    libusb_release_interface (ctx->dev_handle, 0);
+    libusb_close (ctx->dev_handle);
+    ctx->dev_handle = NULL;
+  }
+  if (ctx->usbcontext) {
+    libusb_exit (ctx->usbcontext);
+    ctx->usbcontext = NULL;
+  }
+}
+
+void
+Stlink_Swim_Cmd (gmt_ctx *ctx, uint32_t cmd)
 {
   unsigned char buf[16];
 
   memset (buf, 0x00, sizeof(buf));
   buf[0] = STLINK_SWIM_COMMAND;
   buf[1] = cmd;
-  usb_tx_cmd (buf);
+  usb_tx_cmd (ctx, buf);
 }
 
 uint32_t
-Stlink_Get_Mode (void)
+Stlink_Get_Mode (gmt_ctx *ctx)
 {
   unsigned char buf[16];
 
   memset (buf, 0x00, sizeof(buf));
   buf[0] = STLINK_GET_CURRENT_MODE;
-  usb_tx_cmd (buf);
-  usb_rx (buf, 2);
+  usb_tx_cmd (ctx, buf);
+  usb_rx (ctx, buf, 2);
   return (buf[0]<<8) | buf[1];
 }
 
 uint32_t
-Stlink_Get_Swim_Status (void)
+Stlink_Get_Swim_Status (gmt_ctx *ctx)
 {
   unsigned char buf[16];
 
   memset (buf, 0x00, sizeof(buf));
   buf[0] = STLINK_SWIM_COMMAND;
   buf[1] = STLINK_SWIM_READSTATUS;
-  usb_tx_cmd (buf);
-  usb_rx (buf, 4);
+  usb_tx_cmd (ctx, buf);
+  usb_rx (ctx, buf, 4);
   return (buf[3]<<24) | (buf[2]<<16) | (buf[1]<<8) | buf[0];
 }
 
-static uint32_t
-stlink_wait_swim_idle (void)
+/* Adaptive SWIM status polling.
+ * The status is polled once right after the command, then again after the
+ * latency learned for the operation class, then with an exponential backoff.
+ * For memory block reads the learned latency is kept per byte, so it scales
+ * with the chunk size; the timeout always does.
+ */
+#define SWIM_IDLE_TIMEOUT_US		20000
+#define SWIM_BYTE_TIMEOUT_US		100
+#define SWIM_POLL_MIN_US		100
+#define SWIM_POLL_MAX_US		2000
+
+static const struct {
+  const char *name;
+  int         per_byte;
+} swim_op_info[SWIM_OP_CNT] = {
+  [SWIM_OP_CMD]   = {"command"},
+  [SWIM_OP_WRITE] = {"write"},
+  [SWIM_OP_READ]  = {"read"},
+  [SWIM_OP_READ_MEM] = {"memory read", 1},
+};
+
+static uint64_t
+time_us (void)
 {
-  uint32_t q;
+  struct timespec ts;
 
-  for (int i=8; i>0; i--) {
-    usleep (2000);
-    q = Stlink_Get_Swim_Status ();
-    if (!(q & 0xFF))
-      return 0;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static uint32_t
+stlink_wait_swim_idle (gmt_ctx *ctx, int op, uint32_t cnt)
+{
+  swim_op_stat *st = &ctx->swim_stat[op];
+  uint64_t t0 = time_us ();
+  uint32_t delay = SWIM_POLL_MIN_US;
+  uint32_t elapsed, q;
+  uint32_t timeout = SWIM_IDLE_TIMEOUT_US + cnt*SWIM_BYTE_TIMEOUT_US;
+  uint32_t expect  = st->expect_us;
+  int      per_byte = swim_op_info[op].per_byte;
+
+  if (per_byte)
+    expect *= cnt;
+
+  st->polls++;
+  q = Stlink_Get_Swim_Status (ctx);
+  while (q & 0xFF) {
+    elapsed = time_us () - t0;
+    if (elapsed > timeout)
+      return q;
+    if (expect > elapsed + delay) {
+      usleep (expect - elapsed);
+    } else {
+      usleep (delay);
+      if (delay < SWIM_POLL_MAX_US)
+        delay <<= 1;
+    }
+    st->polls++;
+    q = Stlink_Get_Swim_Status (ctx);
   }
-  return q;
+
+  elapsed = time_us () - t0;
+  st->calls++;
+  st->total_us += elapsed;
+  if (elapsed > st->max_us)
+    st->max_us = elapsed;
+  //moving average, 1/8 weight for the new sample
+  if (per_byte && cnt)
+    elapsed /= cnt;
+  if (st->calls == 1)
+    st->expect_us = elapsed;
+  else
+    st->expect_us = (7*st->expect_us + elapsed) / 8;
+  return 0;
 }
 
-void
-Stlink_Write_Byte (uint32_t address, uint32_t byte)
+/* Writes one byte and returns the SWIM status, 0 on success */
+static uint32_t
+stlink_try_write_byte (gmt_ctx *ctx, uint32_t address, uint32_t byte)
 {
   unsigned char buf[16];
 
@@ -250,18 +524,24 @@ Stlink_Write_Byte (uint32_t address, uint32_t byte)
   buf[7] = address;
   //byte
   buf[8] = byte;
-  usb_tx_cmd (buf);
+  usb_tx_cmd (ctx, buf);
+
+  return stlink_wait_swim_idle (ctx, SWIM_OP_WRITE, 1);
+}
 
-  uint32_t stat = stlink_wait_swim_idle ();
+void
+Stlink_Write_Byte (gmt_ctx *ctx, uint32_t address, uint32_t byte)
+{
+  uint32_t stat = stlink_try_write_byte (ctx, address, byte);
   if (stat) {
-    printf ("Error, %s: SWIM status returned 0x%02X\n", __func__,
+    fprintf (ctx->out, "Error, %s: SWIM status returned 0x%02X\n", __func__,
         stat);
-    exit (EXIT_FAILURE);
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
   }
 }
 
 void
-Stlink_Write_Word (uint32_t address, uint32_t word)
+Stlink_Write_Word (gmt_ctx *ctx, uint32_t address, uint32_t word)
 {
   unsigned char buf[16];
 
@@ -279,18 +559,289 @@ Stlink_Write_Word (uint32_t address, uint32_t word)
   //word
   buf[8] = word>>8;
   buf[9] = word;
-  usb_tx_cmd (buf);
+  usb_tx_cmd (ctx, buf);
 
-  uint32_t stat = stlink_wait_swim_idle ();
+  uint32_t stat = stlink_wait_swim_idle (ctx, SWIM_OP_WRITE, 2);
   if (stat) {
-    printf ("Error, %s: SWIM status returned 0x%02X\n", __func__,
+    fprintf (ctx->out, "Error, %s: SWIM status returned 0x%02X\n", __func__,
         stat);
-    exit (EXIT_FAILURE);
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
+  }
+}
+
+/* Micro-batch of SWIM writes.
+ * Between Stlink_Batch_Begin () and Stlink_Batch_End () the writes of
+ * Stlink_Batch_Write () are recorded, a write to the address that follows the
+ * previous one being merged in the same WRITEMEM (like FLASH_CR2 and NCR2).
+ * Stlink_Batch_End () sends the commands in order and waits for the SWIM idle
+ * status after each one: the STLink is not known to queue a WRITEMEM while the
+ * previous one is busy on SWIM, so only the merge saves commands.
+ */
+static void
+stlink_batch_send (gmt_ctx *ctx)
+{
+  swim_batch *b = &ctx->batch;
+  unsigned char buf[16];
+  uint32_t stat;
+
+  for (int i=0; i<b->cnt; i++) {
+    memset (buf, 0x00, sizeof(buf));
+    buf[0] = STLINK_SWIM_COMMAND;
+    buf[1] = STLINK_SWIM_WRITEMEM;
+    //cnt
+    buf[2] = 0x00;
+    buf[3] = b->len[i];
+    //address
+    buf[4] = 0x00;
+    buf[5] = b->add[i]>>16;
+    buf[6] = b->add[i]>>8;
+    buf[7] = b->add[i];
+    memcpy (buf+8, b->data[i], b->len[i]);
+    usb_tx_cmd (ctx, buf);
+    stat = stlink_wait_swim_idle (ctx, SWIM_OP_WRITE, b->len[i]);
+    if (stat) {
+      b->cnt = 0;
+      fprintf (ctx->out, "Error, %s: SWIM status returned 0x%02X\n", __func__,
+          stat);
+      GMT_FAIL (ctx, GMT_ERR_SWIM);
+    }
+  }
+  b->cnt = 0;
+}
+
+void
+Stlink_Batch_Begin (gmt_ctx *ctx)
+{
+  ctx->batch.active = 1;
+  ctx->batch.cnt = 0;
+}
+
+/* Records a byte write, or does it at once outside a batch */
+void
+Stlink_Batch_Write (gmt_ctx *ctx, uint32_t address, uint32_t byte)
+{
+  swim_batch *b = &ctx->batch;
+  int i = b->cnt - 1;
+
+  if (!b->active) {
+    Stlink_Write_Byte (ctx, address, byte);
+    return;
+  }
+  if ( (i < 0) || (b->add[i] + b->len[i] != address)
+      || (b->len[i] == SWIM_BATCH_DATA) ) {
+    if (b->cnt == SWIM_BATCH_CMDS)
+      stlink_batch_send (ctx);
+    i = b->cnt++;
+    b->add[i] = address;
+    b->len[i] = 0;
+  }
+  b->data[i][b->len[i]++] = byte;
+}
+
+void
+Stlink_Batch_End (gmt_ctx *ctx)
+{
+  ctx->batch.active = 0;
+  stlink_batch_send (ctx);
+}
+
+/* Register shadow.
+ * The values written to the µC control registers (FLASH_CR2, NCR2, CLK_CKDIVR)
+ * are kept, so Stlink_Reg_Write () drops a write that would not change the
+ * register. The programming mode bits of FLASH_CR2 are cleared by the µC at the
+ * end of the operation, see stlink_reg_prog_done (). A register is not known
+ * until written in the session, and everything is forgotten by a µC reset, a
+ * RAM routine start or an error, with Stlink_Reg_Forget ().
+ */
+static int
+stlink_reg_find (gmt_ctx *ctx, uint32_t address)
+{
+  for (int i=0; i<ctx->regs.cnt; i++)
+    if (ctx->regs.add[i] == address)
+      return i;
+  return -1;
+}
+
+static void
+stlink_reg_set (gmt_ctx *ctx, uint32_t address, uint32_t byte)
+{
+  reg_shadow *r = &ctx->regs;
+  int i = stlink_reg_find (ctx, address);
+
+  if (i < 0) {
+    if (r->cnt == REG_SHADOW_MAX)
+      return;
+    i = r->cnt++;
+    r->add[i] = address;
+  }
+  r->val[i] = byte;
+}
+
+static void
+stlink_reg_drop (gmt_ctx *ctx, uint32_t address)
+{
+  reg_shadow *r = &ctx->regs;
+  int i = stlink_reg_find (ctx, address);
+
+  if (i < 0)
+    return;
+  r->cnt--;
+  r->add[i] = r->add[r->cnt];
+  r->val[i] = r->val[r->cnt];
+}
+
+/* Writes a register, in the current batch if any, unless it already holds
+ * byte
+ */
+void
+Stlink_Reg_Write (gmt_ctx *ctx, uint32_t address, uint32_t byte)
+{
+  int i = stlink_reg_find (ctx, address);
+
+  byte &= 0xFF;
+  if (i >= 0 && ctx->regs.val[i] == byte) {
+    ctx->regs.skipped++;
+    return;
   }
+  Stlink_Batch_Write (ctx, address, byte);
+  stlink_reg_set (ctx, address, byte);
 }
 
 void
-Stlink_Open (void)
+Stlink_Reg_Forget (gmt_ctx *ctx)
+{
+  ctx->regs.cnt = 0;
+}
+
+static void
+stlink_swim_speed (gmt_ctx *ctx, int high)
+{
+  unsigned char buf[16];
+
+  memset (buf, 0x00, sizeof(buf));
+  buf[0] = STLINK_SWIM_COMMAND;
+  buf[1] = STLINK_SWIM_SPEED;
+  buf[2] = high ? 1 : 0;
+  usb_tx_cmd (ctx, buf);
+  ctx->swim_hs = high;
+}
+
+/* Resets the target with NRES and enters the SWIM active mode, with the CPU
+ * stalled
+ */
+static void
+stlink_swim_activate (gmt_ctx *ctx)
+{
+  PRINT_IF_VERBOSE ("...activate SWIM connection to µC: ");
+  //the SWIM entry sequence is always done at low speed
+  stlink_swim_speed (ctx, 0);
+  //NRES \_
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_NRES_LOW);
+  if (stlink_wait_swim_idle (ctx, SWIM_OP_CMD, 0)) {
+    if (ctx->prog_mode & PROG_MODE_VERBOSE)
+      fprintf (ctx->out, " NRES pull low error!\n");
+    else
+      fprintf (ctx->out, "...NRES pull low error!\n");
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
+  }
+
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_ENTER_SEQ);
+  if (stlink_wait_swim_idle (ctx, SWIM_OP_CMD, 0)) {
+    if (ctx->prog_mode & PROG_MODE_VERBOSE)
+      fprintf (ctx->out, " SWIM activation error!\n");
+    else
+      fprintf (ctx->out, "...SWIM activation error!\n");
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
+  }
+
+  Stlink_Write_Byte (ctx, STM8_SWIM_CSR, SWIM_CSR_INIT);
+  Stlink_Reg_Forget (ctx);
+
+  //we can now release NRES
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_NRES_HIGH);
+  if (stlink_wait_swim_idle (ctx, SWIM_OP_CMD, 0)) {
+    if (ctx->prog_mode & PROG_MODE_VERBOSE)
+      fprintf (ctx->out, " NRES release error!\n");
+    else
+      fprintf (ctx->out, "...NRES release error!\n");
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
+  }
+
+  //reset swim for better clk sync
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_RESET);
+  if (stlink_wait_swim_idle (ctx, SWIM_OP_CMD, 0)) {
+    if (ctx->prog_mode & PROG_MODE_VERBOSE)
+      fprintf (ctx->out, " SWIM reset error!\n");
+    else
+      fprintf (ctx->out, "...SWIM reset error!\n");
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
+  }
+
+  Stlink_Write_Byte (ctx, STM8_DM_CSR2, 0x08);
+
+  if (ctx->prog_mode & PROG_MODE_VERBOSE)
+    fprintf (ctx->out, "done\n");
+}
+
+/* Switches the target (HS bit of SWIM_CSR) and then the STLink to high speed,
+ * if the target allows it: HSIT set in SWIM_CSR. The link is checked with a
+ * read of SWIM_CSR; on any error both sides are brought back to low speed,
+ * with a new SWIM activation if the target does not answer anymore.
+ */
+static void
+stlink_swim_set_speed (gmt_ctx *ctx)
+{
+  unsigned char buf[16];
+  uint32_t stat;
+
+  if (ctx->prog_mode & PROG_MODE_LOW_SPEED) {
+    PRINT_IF_VERBOSE ("...SWIM speed: low\n");
+    return;
+  }
+
+  //HS may only be set with the HSI trimmed, the µC reports it in HSIT
+  if (!(Stlink_Read_Byte (ctx, STM8_SWIM_CSR) & SWIM_CSR_HSIT)) {
+    ctx->prog_mode |= PROG_MODE_LOW_SPEED;
+    PRINT_IF_VERBOSE ("...SWIM high speed not allowed by the µC, speed: low\n");
+    return;
+  }
+
+  stat = stlink_try_write_byte (ctx, STM8_SWIM_CSR,
+      SWIM_CSR_INIT | SWIM_CSR_HS);
+  if (!stat) {
+    stlink_swim_speed (ctx, 1);
+    memset (buf, 0x00, sizeof(buf));
+    buf[0] = STLINK_SWIM_COMMAND;
+    buf[1] = STLINK_SWIM_READMEM;
+    buf[3] = 0x01;
+    buf[6] = STM8_SWIM_CSR>>8;
+    buf[7] = STM8_SWIM_CSR & 0xFF;
+    usb_tx_cmd (ctx, buf);
+    stat = stlink_wait_swim_idle (ctx, SWIM_OP_READ, 1);
+    if (!stat) {
+      Stlink_Swim_Cmd (ctx, STLINK_SWIM_READBUF);
+      usb_rx (ctx, buf, 1);
+      if (buf[0] & SWIM_CSR_HS) {
+        PRINT_IF_VERBOSE ("...SWIM speed: high\n");
+        return;
+      }
+      stat = buf[0] | 0x100;
+    }
+  }
+
+  PRINT_IF_VERBOSE ("...SWIM high speed failed (0x%X), falling back to low "
+      "speed\n", stat);
+  stlink_swim_speed (ctx, 0);
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_RESET);
+  if (stlink_wait_swim_idle (ctx, SWIM_OP_CMD, 0)
+      || stlink_try_write_byte (ctx, STM8_SWIM_CSR, SWIM_CSR_INIT))
+    stlink_swim_activate (ctx);
+  ctx->prog_mode |= PROG_MODE_LOW_SPEED;
+  PRINT_IF_VERBOSE ("...SWIM speed: low\n");
+}
+
+void
+Stlink_Open (gmt_ctx *ctx)
 {
   unsigned char buf[16];
   uint32_t q;
@@ -299,13 +850,13 @@ Stlink_Open (void)
   PRINT_IF_VERBOSE ("...read version STlink/JTAG/SWIM: ");
   memset (buf, 0x00, sizeof(buf));
   buf[0] = STLINK_GET_VERSION;
-  usb_tx_cmd (buf);
-  usb_rx (buf, 6);
+  usb_tx_cmd (ctx, buf);
+  usb_rx (ctx, buf, 6);
   PRINT_IF_VERBOSE ("%d/%d/%d\n", buf[0]>>4, ((buf[0]&0x0F)<<2)|(buf[1]>>6),
       buf[1]&0x3F);
 
 //read current mode and set to swim
-  q = Stlink_Get_Mode();
+  q = Stlink_Get_Mode (ctx);
   switch (q) {
     case STLINK_MODE_DFU:
       PRINT_IF_VERBOSE ("...stlink mode: DFU (Direct Firmware Update)\n..."
@@ -313,7 +864,7 @@ Stlink_Open (void)
       memset (buf, 0x00, sizeof(buf));
       buf[0] = STLINK_DFU_COMMAND;
       buf[1] = STLINK_DFU_EXIT;
-      usb_tx_cmd (buf);
+      usb_tx_cmd (ctx, buf);
       PRINT_IF_VERBOSE ("done\n");
       break;
     case STLINK_MODE_MASS:
@@ -322,7 +873,7 @@ Stlink_Open (void)
       memset (buf, 0x00, sizeof(buf));
       buf[0] = STLINK_DFU_COMMAND;
       buf[1] = STLINK_DFU_EXIT;
-      usb_tx_cmd (buf);
+      usb_tx_cmd (ctx, buf);
       PRINT_IF_VERBOSE ("done\n");
       break;
     case STLINK_MODE_DEBUG:
@@ -331,7 +882,7 @@ Stlink_Open (void)
       memset (buf, 0x00, sizeof(buf));
       buf[0] = STLINK_DFU_COMMAND;
       buf[1] = STLINK_DFU_EXIT;
-      usb_tx_cmd (buf);
+      usb_tx_cmd (ctx, buf);
       PRINT_IF_VERBOSE ("done\n");
       break;
     case STLINK_MODE_SWIM:
@@ -340,11 +891,11 @@ Stlink_Open (void)
     case STLINK_MODE_BOOTLOADER:
       PRINT_IF_VERBOSE ("...stlink mode: BOOTLOADER_MODE\n");
       //what's to be done???
-      printf ("Sorry, we don't know how to handle this mode!\n");
-      exit (EXIT_FAILURE);
+      fprintf (ctx->out, "Sorry, we don't know how to handle this mode!\n");
+      GMT_FAIL (ctx, GMT_ERR_USB);
     default:
-      printf ("...unknown stlink_mode: 0x%04X\n", q);
-      exit (EXIT_FAILURE);
+      fprintf (ctx->out, "...unknown stlink_mode: 0x%04X\n", q);
+      GMT_FAIL (ctx, GMT_ERR_USB);
   }
 
   if (q != STLINK_MODE_SWIM) {
@@ -352,13 +903,13 @@ Stlink_Open (void)
     memset (buf, 0x00, sizeof(buf));
     buf[0] = STLINK_SWIM_COMMAND;
     buf[1] = STLINK_SWIM_ENTER;
-    usb_tx_cmd (buf);
-    q = Stlink_Get_Mode ();
+    usb_tx_cmd (ctx, buf);
+    q = Stlink_Get_Mode (ctx);
     if (q == STLINK_MODE_SWIM) {
       PRINT_IF_VERBOSE ("done\n");
     } else {
       PRINT_IF_VERBOSE ("error, %X\n", q);
-      exit (EXIT_FAILURE);
+      GMT_FAIL (ctx, GMT_ERR_USB);
     }
   }
 
@@ -366,73 +917,57 @@ Stlink_Open (void)
   PRINT_IF_VERBOSE ("...reading target Vcc: ");
   memset (buf, 0x00, sizeof(buf));
   buf[0] = STLINK_GET_TARGET_VOLTAGE;
-  usb_tx_cmd (buf);
-  usb_rx (buf, 8);
+  usb_tx_cmd (ctx, buf);
+  usb_rx (ctx, buf, 8);
   uint32_t factor  = (buf[3]<<24) | (buf[2]<<16) | (buf[1]<<8) | (buf[0]);
   uint32_t reading = (buf[7]<<24) | (buf[6]<<16) | (buf[5]<<8) | (buf[4]);
 
   q = 2400*reading/factor;
   if (q < 1500) {
-    if (prog_mode & PROG_MODE_VERBOSE)
-      printf ("%d mV, no target connected?\n", q);
+    if (ctx->prog_mode & PROG_MODE_VERBOSE)
+      fprintf (ctx->out, "%d mV, no target connected?\n", q);
     else
-      printf ("...target Vcc: %d mV, no target connected?\n", q);
+      fprintf (ctx->out, "...target Vcc: %d mV, no target connected?\n", q);
   } else {
-    if (prog_mode & PROG_MODE_VERBOSE)
-      printf ("%d mV\n", q);
+    if (ctx->prog_mode & PROG_MODE_VERBOSE)
+      fprintf (ctx->out, "%d mV\n", q);
   }
 
 //now we activate the swim connection to device
-  PRINT_IF_VERBOSE ("...activate SWIM connection to µC: ");
-  //NRES \_
-  Stlink_Swim_Cmd (STLINK_SWIM_NRES_LOW);
-  if (stlink_wait_swim_idle ()) {
-    if (prog_mode & PROG_MODE_VERBOSE)
-      printf (" NRES pull low error!\n");
-    else
-      printf ("...NRES pull low error!\n");
-    exit (EXIT_FAILURE);
-  }
+  stlink_swim_activate (ctx);
+  stlink_swim_set_speed (ctx);
 
-  Stlink_Swim_Cmd (STLINK_SWIM_ENTER_SEQ);
-  if (stlink_wait_swim_idle ()) {
-    if (prog_mode & PROG_MODE_VERBOSE)
-      printf (" SWIM activation error!\n");
-    else
-      printf ("...SWIM activation error!\n");
-    exit (EXIT_FAILURE);
-  }
-
-  Stlink_Write_Byte (0x7F80, 0xA5);
-
-  //we can now release NRES
-  Stlink_Swim_Cmd (STLINK_SWIM_NRES_HIGH);
-  if (stlink_wait_swim_idle ()) {
-    if (prog_mode & PROG_MODE_VERBOSE)
-      printf (" NRES release error!\n");
-    else
-      printf ("...NRES release error!\n");
-    exit (EXIT_FAILURE);
-  }
+  if (!ctx->swim_chunk)
+    ctx->swim_chunk = STLINK_SWIM_BUF_SIZE;
+  PRINT_IF_VERBOSE ("...SWIM read chunk: %u bytes\n", ctx->swim_chunk);
+}
 
-  //reset swim for better clk sync
-  Stlink_Swim_Cmd (STLINK_SWIM_RESET);
-  if (stlink_wait_swim_idle ()) {
-    if (prog_mode & PROG_MODE_VERBOSE)
-      printf (" SWIM reset error!\n");
-    else
-      printf ("...SWIM reset error!\n");
-    exit (EXIT_FAILURE);
+/* Takes the µC back after the reset that ended the previous jobs, with the
+ * STLink still open. The SWIM link stays active over the reset, so only
+ * SWIM_CSR is written again and the CPU stalled. If the µC does not answer
+ * (powered off, or replaced on the test fixture), the full activation is done.
+ */
+void
+Stlink_Swim_Resume (gmt_ctx *ctx)
+{
+  uint32_t csr = SWIM_CSR_INIT;
+
+  //the µC ran since the reset, its registers are not known
+  Stlink_Reg_Forget (ctx);
+  if (ctx->swim_hs)
+    csr |= SWIM_CSR_HS;
+  if (stlink_try_write_byte (ctx, STM8_SWIM_CSR, csr)) {
+    PRINT_IF_VERBOSE ("...SWIM session lost, reconnecting\n");
+    stlink_swim_activate (ctx);
+    stlink_swim_set_speed (ctx);
+    return;
   }
-
-  Stlink_Write_Byte (STM8_DM_CSR2, 0x08);
-
-  if (prog_mode & PROG_MODE_VERBOSE)
-    printf ("done\n");
+  Stlink_Write_Byte (ctx, STM8_DM_CSR2, 0x08);
+  PRINT_IF_VERBOSE ("...SWIM session resumed\n");
 }
 
 uint32_t
-Stlink_Read_Byte (uint32_t address)
+Stlink_Read_Byte (gmt_ctx *ctx, uint32_t address)
 {
   unsigned char buf[16];
 
@@ -447,23 +982,24 @@ Stlink_Read_Byte (uint32_t address)
   buf[5] = address>>16;
   buf[6] = address>>8;
   buf[7] = address;
-  usb_tx_cmd (buf);
+  usb_tx_cmd (ctx, buf);
 
-  uint32_t stat = stlink_wait_swim_idle ();
+  uint32_t stat = stlink_wait_swim_idle (ctx, SWIM_OP_READ, 1);
   if (stat) {
-    printf ("Error, %s: SWIM status returned 0x%X\n", __func__, stat);
-    exit (EXIT_FAILURE);
+    fprintf (ctx->out, "Error, %s: SWIM status returned 0x%X\n", __func__,
+        stat);
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
   }
 
-  Stlink_Swim_Cmd (STLINK_SWIM_READBUF);
-  usb_rx (buf, 1);
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_READBUF);
+  usb_rx (ctx, buf, 1);
 
   return buf[0];
 }
 
 
 uint32_t
-Stlink_Read_Word (uint32_t address)
+Stlink_Read_Word (gmt_ctx *ctx, uint32_t address)
 {
   unsigned char buf[16];
 
@@ -478,23 +1014,24 @@ Stlink_Read_Word (uint32_t address)
   buf[5] = address>>16;
   buf[6] = address>>8;
   buf[7] = address;
-  usb_tx_cmd (buf);
+  usb_tx_cmd (ctx, buf);
 
-  uint32_t stat = stlink_wait_swim_idle ();
+  uint32_t stat = stlink_wait_swim_idle (ctx, SWIM_OP_READ, 2);
   if (stat) {
-    printf ("Error, %s: SWIM status returned 0x%X\n", __func__, stat);
-    exit (EXIT_FAILURE);
+    fprintf (ctx->out, "Error, %s: SWIM status returned 0x%X\n", __func__,
+        stat);
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
   }
 
-  Stlink_Swim_Cmd (STLINK_SWIM_READBUF);
-  usb_rx (buf, 2);
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_READBUF);
+  usb_rx (ctx, buf, 2);
 
   return ((buf[0]<<8) | buf[1]);
 }
 
 
 uint32_t
-stlink_read_dword (uint32_t address)
+stlink_read_dword (gmt_ctx *ctx, uint32_t address)
 {
   unsigned char buf[16];
 
@@ -509,88 +1046,258 @@ stlink_read_dword (uint32_t address)
   buf[5] = address>>16;
   buf[6] = address>>8;
   buf[7] = address & 0xFC;
-  usb_tx_cmd (buf);
+  usb_tx_cmd (ctx, buf);
 
-  uint32_t stat = stlink_wait_swim_idle ();
+  uint32_t stat = stlink_wait_swim_idle (ctx, SWIM_OP_READ, 4);
   if (stat) {
-    printf ("Error, %s: SWIM status returned 0x%X\n", __func__, stat);
-    exit (EXIT_FAILURE);
+    fprintf (ctx->out, "Error, %s: SWIM status returned 0x%X\n", __func__,
+        stat);
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
   }
 
-  Stlink_Swim_Cmd (STLINK_SWIM_READBUF);
-  usb_rx (buf, 4);
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_READBUF);
+  usb_rx (ctx, buf, 4);
 
   return ((buf[0]<<24) | (buf[1]<<16) | (buf[2]<<8) | buf[3]);
 }
 
 
 void
-Stlink_Unlock_Memory (mcu *uc, uint32_t address)
+Stlink_Unlock_Memory (gmt_ctx *ctx, mcu *uc, uint32_t address)
 {
-  if ( (address >= uc->eeprom_add && address < (uc->eeprom_add + uc->eeprom_size))
+  //every write starts here, the shadow must be loaded before the memory changes
+  Shadow_Load (ctx);
+
+  if ( (address >= uc->eeprom_add
+        && address < (uc->eeprom_add + uc->eeprom_size))
       || (address >= 0x4800 && address < 0x4880) ) {
   //eeprom or option bytes
-    if (prog_stat & PROG_STAT_UL_EEPROM)
+    if (ctx->prog_stat & PROG_STAT_UL_EEPROM)
       return;
+    //IAPSR is read below, the loader must not miss its EOP
+    Stlink_Loader_Stop (ctx);
     //write FLASH_DUKR register with the key unlock
-    if (prog_mode & PROG_MODE_STM8L) {
+    if (ctx->prog_mode & PROG_MODE_STM8L) {
     //stm8l type
-      Stlink_Write_Byte (0x5053, 0xAE);
-      Stlink_Write_Byte (0x5053, 0x56);
-      if ( !(Stlink_Read_Byte (0x5054) & 0x08) ) {
-        printf ("Could not unlock EEPROM memory!\n");
-        exit (EXIT_FAILURE);
+      Stlink_Write_Byte (ctx, 0x5053, 0xAE);
+      Stlink_Write_Byte (ctx, 0x5053, 0x56);
+      if ( !(Stlink_Read_Byte (ctx, 0x5054) & 0x08) ) {
+        fprintf (ctx->out, "Could not unlock EEPROM memory!\n");
+        GMT_FAIL (ctx, GMT_ERR_UNLOCK);
       }
     } else {
     //stm8s type
-      Stlink_Write_Byte (0x5064, 0xAE);
-      Stlink_Write_Byte (0x5064, 0x56);
-      if ( !(Stlink_Read_Byte (0x505F) & 0x08) ) {
-        printf ("Could not unlock EEPROM memory!\n");
-        exit (EXIT_FAILURE);
+      Stlink_Write_Byte (ctx, 0x5064, 0xAE);
+      Stlink_Write_Byte (ctx, 0x5064, 0x56);
+      if ( !(Stlink_Read_Byte (ctx, 0x505F) & 0x08) ) {
+        fprintf (ctx->out, "Could not unlock EEPROM memory!\n");
+        GMT_FAIL (ctx, GMT_ERR_UNLOCK);
       }
     }
-    prog_stat |= PROG_STAT_UL_EEPROM;
+    ctx->prog_stat |= PROG_STAT_UL_EEPROM;
   } else if (address >= 0x8000) {
   //flash
-    if (prog_stat & PROG_STAT_UL_FLASH)
+    if (ctx->prog_stat & PROG_STAT_UL_FLASH)
       return;
+    Stlink_Loader_Stop (ctx);
     //write FLASH_PUKR register with the key unlock
-    if (prog_mode & PROG_MODE_STM8L) {
+    if (ctx->prog_mode & PROG_MODE_STM8L) {
     //stm8l type
-      Stlink_Write_Byte (0x5052, 0x56);
-      Stlink_Write_Byte (0x5052, 0xAE);
-      if ( !(Stlink_Read_Byte (0x5054) & 0x02) ) {
-        printf ("Could not unlock FLASH memory!\n");
-        exit (EXIT_FAILURE);
+      Stlink_Write_Byte (ctx, 0x5052, 0x56);
+      Stlink_Write_Byte (ctx, 0x5052, 0xAE);
+      if ( !(Stlink_Read_Byte (ctx, 0x5054) & 0x02) ) {
+        fprintf (ctx->out, "Could not unlock FLASH memory!\n");
+        GMT_FAIL (ctx, GMT_ERR_UNLOCK);
       }
     } else {
     //stm8s type
-      Stlink_Write_Byte (0x5062, 0x56);
-      Stlink_Write_Byte (0x5062, 0xAE);
-      if ( !(Stlink_Read_Byte (0x505F) & 0x02) ) {
-        printf ("Could not unlock FLASH memory!\n");
-        exit (EXIT_FAILURE);
+      Stlink_Write_Byte (ctx, 0x5062, 0x56);
+      Stlink_Write_Byte (ctx, 0x5062, 0xAE);
+      if ( !(Stlink_Read_Byte (ctx, 0x505F) & 0x02) ) {
+        fprintf (ctx->out, "Could not unlock FLASH memory!\n");
+        GMT_FAIL (ctx, GMT_ERR_UNLOCK);
       }
     }
-    prog_stat |= PROG_STAT_UL_FLASH;
+    ctx->prog_stat |= PROG_STAT_UL_FLASH;
     return;
   } else {
     return;
   }
 }
 
+/* Sets FLASH_CR2, and NCR2 on stm8s, with one SWIM write, or none if they
+ * already hold the value
+ */
+static void
+stlink_flash_cr2 (gmt_ctx *ctx, uint32_t cr2)
+{
+  Stlink_Batch_Begin (ctx);
+  if (ctx->prog_mode & PROG_MODE_STM8L) {
+  //stm8l type
+    Stlink_Reg_Write (ctx, 0x5051, cr2);
+  } else {
+  //stm8s type
+    Stlink_Reg_Write (ctx, 0x505B, cr2);
+    Stlink_Reg_Write (ctx, 0x505C, ~cr2 & 0xFF);
+  }
+  Stlink_Batch_End (ctx);
+}
+
+/* Updates the shadow of FLASH_CR2 at the end of a programming operation: PRG,
+ * FPRG, ERASE and WPRG are cleared by the µC, OPT stays. If the operation
+ * failed the registers are not sure anymore.
+ */
+static void
+stlink_reg_prog_done (gmt_ctx *ctx, int ok)
+{
+  uint32_t cr2 = (ctx->prog_mode & PROG_MODE_STM8L) ? 0x5051 : 0x505B;
+  int i = stlink_reg_find (ctx, cr2);
+  uint32_t val;
+
+  if (!ok || i < 0) {
+    stlink_reg_drop (ctx, cr2);
+    stlink_reg_drop (ctx, 0x505C);
+    return;
+  }
+  val = ctx->regs.val[i] & 0x80;
+  stlink_reg_set (ctx, cr2, val);
+  if ( !(ctx->prog_mode & PROG_MODE_STM8L) )
+    stlink_reg_set (ctx, 0x505C, ~val & 0xFF);
+}
+
+/* Programming completion.
+ * After a byte, word or block write IAPSR is polled for EOP (end of
+ * programming) in a time bounded loop. The first poll is delayed by 3/4 of the
+ * programming time learned for the operation type, the next ones are issued
+ * back to back. Returns 0 when done, the IAPSR value if the write was refused
+ * (WR_PG_DIS set), or -1 on timeout.
+ */
+#define PROG_TIMEOUT_US			30000
+
+static const char *prog_op_name[PROG_OP_CNT] = {
+  [PROG_OP_BYTE]  = "byte",
+  [PROG_OP_OPT]   = "option byte",
+  [PROG_OP_WORD]  = "word",
+  [PROG_OP_BLOCK] = "block",
+  [PROG_OP_FAST]  = "fast block",
+  [PROG_OP_ERASE] = "erase-only block",
+};
+
+static int
+stlink_wait_prog_done (gmt_ctx *ctx, int op)
+{
+  prog_op_stat *st = &ctx->prog_op[op];
+  uint64_t t0 = time_us ();
+  uint32_t iapsr, elapsed, q;
+
+  (ctx->prog_mode & PROG_MODE_STM8L) ? (iapsr = 0x5054) : (iapsr = 0x505F);
+
+  if (st->expect_us)
+    usleep (st->expect_us*3/4);
+  uint64_t timeout = time_us () + PROG_TIMEOUT_US;
+  uint64_t tpoll;
+  for (;;) {
+    tpoll = time_us ();
+    q = Stlink_Read_Byte (ctx, iapsr);
+    if (q & 0x04)
+      break;
+    if (q & 0x01) {
+      stlink_reg_prog_done (ctx, 0);
+      return q;
+    }
+    if (tpoll > timeout) {
+      stlink_reg_prog_done (ctx, 0);
+      return -1;
+    }
+  }
+  stlink_reg_prog_done (ctx, 1);
+  elapsed = time_us () - t0;
+
+  st->calls++;
+  st->total_us += elapsed;
+  if (elapsed > st->max_us)
+    st->max_us = elapsed;
+  /* The operation ended before the successful poll was issued, so the time of
+   * that poll is learned: if the first poll already sees EOP the expected time
+   * shrinks, otherwise it follows the real programming time.
+   */
+  elapsed = tpoll - t0;
+  if (st->calls == 1)
+    st->expect_us = elapsed;
+  else
+    st->expect_us = (7*st->expect_us + elapsed) / 8;
+  return 0;
+}
+
+/* Prints the SWIM status poll and the programming time statistics, verbose
+ * mode only
+ */
+void
+Stlink_Print_Timings (gmt_ctx *ctx, const char *mcu_name)
+{
+  for (int i=0; i<SWIM_OP_CNT; i++) {
+    swim_op_stat *st = &ctx->swim_stat[i];
+
+    if (!st->calls)
+      continue;
+    fprintf (ctx->out, "...SWIM %s: %u ops, avg %u us, max %u us, %u polls, "
+        "learned %u us%s\n", swim_op_info[i].name, st->calls,
+        (uint32_t)(st->total_us / st->calls), st->max_us, st->polls,
+        st->expect_us, swim_op_info[i].per_byte ? "/byte" : "");
+  }
+  for (int i=0; i<PROG_OP_CNT; i++) {
+    prog_op_stat *st = &ctx->prog_op[i];
+
+    if (!st->calls)
+      continue;
+    fprintf (ctx->out, "...%s %s programming: %u ops, avg %u us, max %u us\n",
+        mcu_name, prog_op_name[i], st->calls,
+        (uint32_t)(st->total_us / st->calls), st->max_us);
+  }
+  if (ctx->regs.skipped)
+    fprintf (ctx->out, "...register writes skipped: %u\n", ctx->regs.skipped);
+}
+
+/* FLASH_CR2 value of the block operations, NCR2 is its complement */
+static const unsigned char prog_block_cr2[PROG_OP_CNT] = {
+  [PROG_OP_BLOCK] = 0x01,	//PRG
+  [PROG_OP_FAST]  = 0x10,	//FPRG
+  [PROG_OP_ERASE] = 0x20,	//ERASE
+};
+
+/* Returns 1 if the block write goes through the RAM loader, see
+ * Stlink_Loader_Block ()
+ */
+static int
+loader_takes (gmt_ctx *ctx, uint32_t blk_add, uint32_t blk_size, int op)
+{
+  return (ctx->prog_mode & PROG_MODE_LOADER)
+      && ((op == PROG_OP_BLOCK) || (op == PROG_OP_FAST))
+      && (blk_add < 0x10000) && (blk_size <= LOADER_BLOCK_MAX);
+}
+
+/* Writes a block with the operation op: PROG_OP_BLOCK, PROG_OP_FAST if the
+ * block is erased, or PROG_OP_ERASE, that only erases it (blk_data must then be
+ * all 0x00, the erased value).
+ */
 static void
-programm_block (uint32_t blk_add, uint32_t blk_size, unsigned char *blk_data)
+programm_block (gmt_ctx *ctx, uint32_t blk_add, uint32_t blk_size,
+    unsigned char *blk_data, int op)
 {
   unsigned char buf[16];
-  uint32_t iaspr;
+  uint32_t cr2 = prog_block_cr2[op];
+
+  if (loader_takes (ctx, blk_add, blk_size, op)) {
+    Stlink_Loader_Block (ctx, blk_add, blk_size, blk_data, cr2);
+    return;
+  }
+  Stlink_Loader_Stop (ctx);
 
   buf[0] = STLINK_SWIM_COMMAND;
   buf[1] = STLINK_SWIM_WRITEMEM;
-  //cnt
+  //cnt, the erase is started by a 0x00000000 word at the block start
   buf[2] = 0x00;
-  buf[3] = blk_size;
+  buf[3] = (op == PROG_OP_ERASE) ? 4 : blk_size;
   //address
   buf[4] = 0x00;
   buf[5] = blk_add>>16;
@@ -598,64 +1305,36 @@ programm_block (uint32_t blk_add, uint32_t blk_size, unsigned char *blk_data)
   buf[7] = blk_add & ~(blk_size-1);
   memcpy (buf+8, blk_data, 8);
 
-  //block programming enable
-  if (prog_mode & PROG_MODE_STM8L) {
-  //stm8l type
-    Stlink_Write_Byte (0x5051, 0x01);
-    iaspr = 0x5054;
-  } else {
-  //stm8s type
-    Stlink_Write_Byte (0x505B, 0x01);
-    Stlink_Write_Byte (0x505C, 0xFE);
-    iaspr = 0x505F;
-  }
-  usb_tx_cmd (buf);
+  //block operation enable
+  stlink_flash_cr2 (ctx, cr2);
+  usb_tx_cmd (ctx, buf);
   //send the rest of the data block
-  int txcnt;
-  int q;
+  if (op != PROG_OP_ERASE)
+    usb_tx_queue (ctx, blk_data + 8, blk_size - 8);
+  usb_tx_flush (ctx);
 
-  q = libusb_bulk_transfer (gdev_handle, STLINK_USB_ENDPOINT_OUT2, blk_data + 8,
-      blk_size - 8, &txcnt, 100);
-  if (q) {
-    printf ("%s:%d: %s\n", __func__,__LINE__, libusb_error_name (q));
-    exit (EXIT_FAILURE);
-  }
-  if(txcnt != (blk_size - 8)) {
-    printf ("libusb_bulk_transfer: wrong number of tx bytes, "
-        "asked %d, transmitted %d\n", blk_size - 8, txcnt);
-    exit (EXIT_FAILURE);
-  }
-
-  usleep(6000);
-
-  for (int i=8; i>0; i--) {
-    if ( Stlink_Read_Byte (iaspr) & 0x04 )
-      return;
-    usleep (2000);
+  int q = stlink_wait_prog_done (ctx, op);
+  if (!q) {
+    Shadow_Update (ctx, blk_add, blk_data, blk_size);
+    return;
   }
 
-  printf ("block programming error, address=0x%04X\n", blk_add);
-  exit (EXIT_FAILURE);
+  fprintf (ctx->out, "block %s error, address=0x%04X%s\n",
+      (op == PROG_OP_ERASE) ? "erase" : "programming", blk_add,
+      (q>0) ? ", write protected" : "");
+  GMT_FAIL (ctx, GMT_ERR_PROG);
 }
 
 
 void
-Stlink_Prog_Byte (uint32_t address, uint32_t byte)
+Stlink_Prog_Byte (gmt_ctx *ctx, uint32_t address, uint32_t byte)
 {
   unsigned char buf[16];
-  uint32_t iaspr;
 
+  Stlink_Loader_Stop (ctx);
   if (address>=0x4800 && address<0x4840) {
   //OPT
-    if (prog_mode & PROG_MODE_STM8L) {
-    //stm8l type
-      Stlink_Write_Byte (0x5051, 0x80);
-    } else {
-    //stm8s type
-      Stlink_Write_Byte (0x505B, 0x80);
-      Stlink_Write_Byte (0x505C, 0x7F);
-    }
-
+    stlink_flash_cr2 (ctx, 0x80);
   }
 
   memset (buf, 0x00, sizeof(buf));
@@ -671,40 +1350,30 @@ Stlink_Prog_Byte (uint32_t address, uint32_t byte)
   buf[7] = address;
   //word
   buf[8] = byte;
-  usb_tx_cmd (buf);
+  usb_tx_cmd (ctx, buf);
+  usb_tx_flush (ctx);
 
-  (prog_mode & PROG_MODE_STM8L) ? (iaspr = 0x5054) : (iaspr = 0x505F);
-  usleep(6000);
-
-  for (int i=8; i>0; i--) {
-    if ( Stlink_Read_Byte(iaspr) & 0x04 )
-      return;
-    usleep (2000);
+  int q = stlink_wait_prog_done (ctx, (address>=0x4800 && address<0x4840) ?
+      PROG_OP_OPT : PROG_OP_BYTE);
+  if (!q) {
+    Shadow_Update (ctx, address, buf+8, 1);
+    return;
   }
 
-  printf ("byte programming error, address=0x%04X, byte=0x%02X\n",
-      address, byte);
-  exit (EXIT_FAILURE);
+  fprintf (ctx->out, "byte programming error, address=0x%04X, byte=0x%02X%s\n",
+      address, byte, (q>0) ? ", write protected" : "");
+  GMT_FAIL (ctx, GMT_ERR_PROG);
 }
 
 
 void
-Stlink_Prog_Dword (uint32_t address, uint32_t dword)
+Stlink_Prog_Dword (gmt_ctx *ctx, uint32_t address, uint32_t dword)
 {
   unsigned char buf[16];
-  uint32_t iaspr;
 
+  Stlink_Loader_Stop (ctx);
   //word programming enable
-  if (prog_mode & PROG_MODE_STM8L) {
-  //stm8l type
-    Stlink_Write_Byte (0x5051, 0x40);
-    iaspr = 0x5054;
-  } else {
-  //stm8s type
-    Stlink_Write_Byte (0x505B, 0x40);
-    Stlink_Write_Byte (0x505C, 0xBF);
-    iaspr = 0x505F;
-  }
+  stlink_flash_cr2 (ctx, 0x40);
 
   memset (buf, 0x00, sizeof(buf));
   buf[0] = STLINK_SWIM_COMMAND;
@@ -722,186 +1391,679 @@ Stlink_Prog_Dword (uint32_t address, uint32_t dword)
   buf[9] = dword>>16;
   buf[10] = dword>>8;
   buf[11] = dword;
-  usb_tx_cmd (buf);
+  usb_tx_cmd (ctx, buf);
+  usb_tx_flush (ctx);
 
-  usleep(6000);
-
-  for (int i=8; i>0; i--) {
-    if ( Stlink_Read_Byte (iaspr) & 0x04 )
-      return;
-    usleep (2000);
+  int q = stlink_wait_prog_done (ctx, PROG_OP_WORD);
+  if (!q) {
+    Shadow_Update (ctx, address & ~0x03, buf+8, 4);
+    return;
   }
 
-  printf ("dword programming error, address=0x%04X, dword=0x%08X\n",
-      address, dword);
-  exit (EXIT_FAILURE);
+  fprintf (ctx->out,
+      "dword programming error, address=0x%04X, dword=0x%08X%s\n", address,
+      dword, (q>0) ? ", write protected" : "");
+  GMT_FAIL (ctx, GMT_ERR_PROG);
 }
 
 
-/* The function programms selectively the data block starting at address
- * blk_add, with the data from *blk_data defined by *blk_def, and returns -1 if
- * nothing was written (due to identical data in µC), 0 if the full block was
- * written or the number of 4-byte words written (in case 1 or max. 2 4-byte
- * words differ).
+/* Programming cost model.
+ * The time of a write is estimated from the SWIM operation and programming
+ * times measured in the session, or from the datasheet values before the first
+ * measurement, so Stlink_Plan_Block () takes the cheaper of a full block write
+ * and the dword writes of the differing words. The break-even point depends on
+ * the block size, the link speed and the µC programming times. With
+ * PROG_MODE_TIMINGS the programming times are kept per µC type, see
+ * Stlink_Load_Timings ().
  */
-int
-Stlink_Prog_Block (uint32_t blk_add, uint32_t blk_size, unsigned char *blk_data,
-    unsigned char *blk_def)
+#define COST_SWIM_OP_US			1000	//before the first measurement
+#define COST_BYTE_US_LS			35	//SWIM data byte, low speed
+#define COST_BYTE_US_HS			15	//high speed
+
+static const uint32_t prog_op_default_us[PROG_OP_CNT] = {
+  [PROG_OP_BYTE]  = 6000,
+  [PROG_OP_OPT]   = 6000,
+  [PROG_OP_WORD]  = 6000,
+  [PROG_OP_BLOCK] = 6000,
+  [PROG_OP_FAST]  = 3000,
+  [PROG_OP_ERASE] = 3000,
+};
+
+static uint32_t
+cost_swim_us (gmt_ctx *ctx, int op)
+{
+  swim_op_stat *st = &ctx->swim_stat[op];
+
+  return st->calls ? st->total_us / st->calls : COST_SWIM_OP_US;
+}
+
+static uint32_t
+cost_prog_us (gmt_ctx *ctx, int op)
+{
+  prog_op_stat *st = &ctx->prog_op[op];
+
+  if (st->calls)
+    return st->total_us / st->calls;
+  if (st->expect_us)
+    return st->expect_us;
+  return prog_op_default_us[op];
+}
+
+/* Returns the estimated time in µs of writing size bytes at address with the
+ * programming operation op
+ */
+uint32_t
+Stlink_Cost_Us (gmt_ctx *ctx, uint32_t address, uint32_t size, int op)
+{
+  uint32_t w = cost_swim_us (ctx, SWIM_OP_WRITE);
+  uint32_t r = cost_swim_us (ctx, SWIM_OP_READ);
+  uint32_t xfer = w + size*(ctx->swim_hs ? COST_BYTE_US_HS : COST_BYTE_US_LS);
+  uint32_t prog = cost_prog_us (ctx, op);
+
+  //the loader programms a block while the host sends the next one
+  if (loader_takes (ctx, address, size, op))
+    return (prog > xfer + w + r) ? prog : xfer + w + r;
+  //FLASH_CR2 (and NCR2) write, data, IAPSR poll
+  return w + xfer + prog + r;
+}
+
+/* Returns 1 if the byte i of the block written is 0x00, the erased value */
+static int
+plan_byte_blank (gmt_ctx *ctx, unsigned char *blk_data, uint32_t *blk_def,
+    unsigned char *ucblock, int i)
+{
+  if ( (ctx->prog_mode & PROG_MODE_PERSIST) && !Ihex_Def_Get (blk_def, i) )
+    return !ucblock[i];
+  return !blk_data[i];
+}
+
+/* Decides how the data block starting at address blk_add, with the data from
+ * *blk_data defined by the blk_def mask, is written, without writing it.
+ * ucblock is the µC block content and dirty has one bit per 4-byte word that
+ * differs in the defined bytes, see diff_mcu (); both are not used with
+ * PROG_MODE_FORCE_ALL.
+ * The plan is BLK_SKIP if the µC has the same data, BLK_DWORDS for dword writes
+ * of the differing words, or BLK_WRITE for a full block write with the fastest
+ * operation the µC block content allows: fast programming if it is erased, only
+ * an erase if the new content is all 0x00.
+ */
+void
+Stlink_Plan_Block (gmt_ctx *ctx, uint32_t blk_add, uint32_t blk_size,
+    unsigned char *blk_data, uint32_t *blk_def, unsigned char *ucblock,
+    uint32_t dirty, blk_plan *plan)
 {
+  memset (plan, 0x00, sizeof(*plan));
+
   // If force flag is set we write all block data
-  if (prog_mode & PROG_MODE_FORCE_ALL) {
-    programm_block (blk_add, blk_size, blk_data);
-    return 0;
+  if (ctx->prog_mode & PROG_MODE_FORCE_ALL) {
+    plan->how = BLK_WRITE;
+    plan->op = PROG_OP_BLOCK;
+    plan->cost_us = Stlink_Cost_Us (ctx, blk_add, blk_size, PROG_OP_BLOCK);
+    return;
   }
 
-  unsigned char *ucblock = malloc (blk_size);
-  MALLOC_TST (ucblock);
-  Stlink_Read_Block (blk_add, blk_size, ucblock);
-
-  // If µC block has the same content as the block to write, skip the write
-  if (!memcmp (ucblock, blk_data, blk_size)) {
-    free (ucblock);
-    return -1;
+  // If no defined byte differs from the µC block, skip the write
+  plan->how = BLK_SKIP;
+  if (!dirty)
+    return;
+  plan->dwords = __builtin_popcount (dirty);
+
+  int blank = 1, wr_blank = 1;
+  for (int i=0; i<blk_size; i++) {
+    if (ucblock[i])
+      blank = 0;
+    if (!plan_byte_blank (ctx, blk_data, blk_def, ucblock, i))
+      wr_blank = 0;
+  }
+  plan->op = wr_blank ? PROG_OP_ERASE : (blank ? PROG_OP_FAST : PROG_OP_BLOCK);
+
+  // Take the cheaper of the block write and the dword writes
+  uint32_t blk_us = Stlink_Cost_Us (ctx, blk_add, blk_size, plan->op);
+  uint32_t dw_us = plan->dwords * Stlink_Cost_Us (ctx, blk_add, 4,
+      PROG_OP_WORD);
+  if (dw_us < blk_us) {
+    plan->how = BLK_DWORDS;
+    plan->cost_us = dw_us;
+  } else {
+    plan->how = BLK_WRITE;
+    plan->cost_us = blk_us;
   }
+}
 
-  // Count the number of 4-byte words different in the 2 blocks
-  uint32_t k = 0;
+/* The function programms selectively the data block starting at address
+ * blk_add, with the data from *blk_data defined by the blk_def mask, and
+ * returns -1 if nothing was written (due to identical data in µC), 0 if the
+ * full block was written or the number of 4-byte words written, see
+ * Stlink_Plan_Block ().
+ */
+int
+Stlink_Prog_Block (gmt_ctx *ctx, uint32_t blk_add, uint32_t blk_size,
+    unsigned char *blk_data, uint32_t *blk_def, unsigned char *ucblock,
+    uint32_t dirty)
+{
+  blk_plan plan;
+  unsigned char *wr = ctx->scratch;
+  uint32_t k;
 
-  for (int i=0; i<blk_size; i+=4) {
-    uint32_t mask = *((uint32_t *)(blk_def + i));
-    uint32_t d0 = *((uint32_t *)(blk_data + i)) & mask;
-    uint32_t d1 = *((uint32_t *)(ucblock + i)) & mask;
-    if (d0 != d1)
-      k++;
-  }
-  if (k==0)
-	return -1;
+  Stlink_Plan_Block (ctx, blk_add, blk_size, blk_data, blk_def, ucblock, dirty,
+      &plan);
+  if (plan.how == BLK_SKIP)
+    return -1;
 
-  // If more than 2 4-byte words are different, we write the full block
-  if (k > 2) {
+  if (plan.how == BLK_WRITE) {
     /* before we write the block data, we fill in the persistent bytes if flag
      * set
      */
-    if (prog_mode & PROG_MODE_PERSIST) {
-      for (int i=0; i<blk_size; i++) {
-        if ( *(blk_def + i) )
-          *(ucblock + i) = *(blk_data + i);
-      }
-      programm_block (blk_add, blk_size, ucblock);
+    if ( (ctx->prog_mode & PROG_MODE_PERSIST)
+        && !(ctx->prog_mode & PROG_MODE_FORCE_ALL)
+        && !Ihex_Def_Full (blk_def, blk_size) ) {
+      Ihex_Def_Merge (wr, blk_data, blk_def, ucblock, blk_size);
+      programm_block (ctx, blk_add, blk_size, wr, plan.op);
     } else {
-      programm_block (blk_add, blk_size, blk_data);
+      programm_block (ctx, blk_add, blk_size, blk_data, plan.op);
     }
-    free (ucblock);
     return 0;
   }
 
-  /* Here we only have 1 or 2 4-byte words different in the 2 blocks, we need to
-   * scan and selectively programm them
+  /* Here the dword writes are cheaper than the block write, we programm the
+   * differing words, with the µC content in their undefined bytes
    */
   int cnt = 0;
 
+  Ihex_Def_Merge (wr, blk_data, blk_def, ucblock, blk_size);
   for (int i=0; i<blk_size; i+=4) {
-    uint32_t mask = *((uint32_t *)(blk_def + i));
-    uint32_t d0 = *((uint32_t *)(blk_data + i)) & mask;
-    uint32_t d1 = *((uint32_t *)(ucblock + i)) & mask;
-    if (d0 != d1) {
-      *(blk_def+i) ? (k=*(blk_data+i)) : (k=*(ucblock+i));
-      k<<=8;
-      *(blk_def+i+1) ? (k|=*(blk_data+i+1)) : (k|=*(ucblock+i+1));
-      k<<=8;
-      *(blk_def+i+2) ? (k|=*(blk_data+i+2)) : (k|=*(ucblock+i+2));
-      k<<=8;
-      *(blk_def+i+3) ? (k|=*(blk_data+i+3)) : (k|=*(ucblock+i+3));
-      Stlink_Prog_Dword (blk_add + i, k);
+    if (dirty & (1u << (i/4))) {
+      k = (wr[i]<<24) | (wr[i+1]<<16) | (wr[i+2]<<8) | wr[i+3];
+      Stlink_Prog_Dword (ctx, blk_add + i, k);
       cnt++;
     }
   }
 
-  free (ucblock);
   return cnt;
 }
 
+/* Programming times per µC type, for PROG_MODE_TIMINGS.
+ * The mean programming time of each operation is kept in
+ * /tmp/gmtflasher/timings_<mcu>.txt, one "<operation>: <µs>" line per
+ * operation. Loaded when the session is opened, they replace the datasheet
+ * values of the cost model and set the first IAPSR poll delay.
+ */
+static void
+timings_file_name (gmt_ctx *ctx, char *fname, int size)
+{
+  int n = snprintf (fname, size, "/tmp/gmtflasher/timings_");
+
+  for (int i=0; ctx->uc.name[i] && n<size-5; i++)
+    fname[n++] = toupper (ctx->uc.name[i]);
+  snprintf (fname + n, size - n, ".txt");
+}
 
 void
-Stlink_Read_Memory (uint32_t address, uint32_t size, FILE *file)
+Stlink_Load_Timings (gmt_ctx *ctx)
 {
-  uint32_t cnt;
-  unsigned char buf[64];
-  uint32_t off = 0;
+  char     fname[128], line[128], name[64];
+  uint32_t us;
+  FILE     *f;
 
-  while (size) {
-    (size < 64) ? (cnt = size) : (cnt = 64);
+  if (!(ctx->prog_mode & PROG_MODE_TIMINGS))
+    return;
+  timings_file_name (ctx, fname, sizeof(fname));
+  f = fopen (fname, "r");
+  if (!f)
+    return;
+  while (fgets (line, sizeof(line), f)) {
+    if (sscanf (line, "%63[^:]: %u", name, &us) != 2)
+      continue;
+    for (int i=0; i<PROG_OP_CNT; i++) {
+      if (!strcmp (name, prog_op_name[i]) && !ctx->prog_op[i].calls)
+        ctx->prog_op[i].expect_us = us;
+    }
+  }
+  fclose (f);
+  PRINT_IF_VERBOSE ("...programming times loaded from %s\n", fname);
+}
 
-    memset (buf, 0x00, 16);
+void
+Stlink_Save_Timings (gmt_ctx *ctx)
+{
+  char fname[128];
+  FILE *f;
+
+  //the times of a clone are saved by its parent, see Gmt_Add_Timings ()
+  if (!(ctx->prog_mode & PROG_MODE_TIMINGS) || ctx->clone)
+    return;
+  timings_file_name (ctx, fname, sizeof(fname));
+  f = fopen (fname, "w");
+  if (!f) {
+    PRINT_IF_VERBOSE ("...%s: %s\n", fname, strerror(errno));
+    return;
+  }
+  for (int i=0; i<PROG_OP_CNT; i++) {
+    if (ctx->prog_op[i].calls || ctx->prog_op[i].expect_us)
+      fprintf (f, "%s: %u\n", prog_op_name[i], cost_prog_us (ctx, i));
+  }
+  fclose (f);
+}
+
+
+/* Reads up to size bytes from address into data, in one READMEM/READBUF round
+ * of at most ctx->swim_chunk bytes, and returns the number of bytes read. If
+ * the SWIM reports an error, the chunk size is halved and the read retried,
+ * down to 64 bytes, so the largest size the STLink firmware handles is found on
+ * the first read of the session.
+ */
+static uint32_t
+stlink_read_chunk (gmt_ctx *ctx, uint32_t address, uint32_t size,
+    unsigned char *data)
+{
+  unsigned char buf[16];
+  uint32_t cnt, stat;
+
+  for (;;) {
+    (size < ctx->swim_chunk) ? (cnt = size) : (cnt = ctx->swim_chunk);
+
+    memset (buf, 0x00, sizeof(buf));
     buf[0] = STLINK_SWIM_COMMAND;
     buf[1] = STLINK_SWIM_READMEM;
     //uint16 cnt
-    buf[2] = 0x00;
+    buf[2] = cnt>>8;
     buf[3] = cnt;
     //uint32 address
     buf[4] = 0x00;
     buf[5] = address>>16;
     buf[6] = address>>8;
     buf[7] = address;
-    usb_tx_cmd (buf);
+    usb_tx_cmd (ctx, buf);
 
-    uint32_t stat = stlink_wait_swim_idle ();
-    if (stat) {
-      printf ("Error, %s: SWIM status returned 0x%02X\n", __func__,
+    stat = stlink_wait_swim_idle (ctx, SWIM_OP_READ_MEM, cnt);
+    if (!stat)
+      break;
+    if (cnt <= 64) {
+      fprintf (ctx->out, "Error, %s: SWIM status returned 0x%02X\n", __func__,
           stat);
-      exit (EXIT_FAILURE);
+      GMT_FAIL (ctx, GMT_ERR_SWIM);
     }
+    ctx->swim_chunk = cnt/2;
+    PRINT_IF_VERBOSE ("\n...SWIM read of %u bytes failed, read chunk set to "
+        "%u bytes\n", cnt, ctx->swim_chunk);
+  }
 
-    Stlink_Swim_Cmd (STLINK_SWIM_READBUF);
-    usb_rx (buf, cnt);
+  Stlink_Swim_Cmd (ctx, STLINK_SWIM_READBUF);
+  usb_rx (ctx, data, cnt);
+  return cnt;
+}
 
-    if ( (address - off + cnt) > 0x10000 ) {
-      off = address & 0xFFFF0;
-      fprintf (file, ":02000002%04X%02X\n", off>>4, 0xFF & (0x100 -
-          (0xFF & (0x04 + (off>>12) + ((off>>4)&0xFF) )) ) );
-    }
+/* Reads size bytes at address in the slots of the read pipeline, the sinks of
+ * ctx->rp take them as they come, see rpipe.c
+ */
+void
+Stlink_Read_Memory (gmt_ctx *ctx, uint32_t address, uint32_t size)
+{
+  uint32_t cnt;
+  unsigned char *buf;
 
-    Ihex_Wr_Data (buf, address - off, cnt, file);
+  while (size) {
+    buf = Rpipe_Slot (ctx, &cnt);
+    //a chunk does not cross a 64K boundary, nor do the hex records then
+    if (cnt > 0x10000 - (address & 0xFFFF))
+      cnt = 0x10000 - (address & 0xFFFF);
+    if (cnt > size)
+      cnt = size;
+    cnt = stlink_read_chunk (ctx, address, cnt, buf);
+    Shadow_Update (ctx, address, buf, cnt);
+    Rpipe_Push (ctx, address, cnt);
     address += cnt;
     size -= cnt;
   }
 }
 
 void
-Stlink_Read_Block (uint32_t address, uint32_t size, unsigned char *data)
+Stlink_Read_Block (gmt_ctx *ctx, uint32_t address, uint32_t size,
+    unsigned char *data)
 {
-  uint32_t cnt, i;
-  unsigned char buf[16];
+  uint32_t cnt;
 
-  i = 0;
   while (size) {
-    (size < 64) ? (cnt = size) : (cnt = 64);
+    cnt = stlink_read_chunk (ctx, address, size, data);
+    address += cnt;
+    size -= cnt;
+    data += cnt;
+  }
+}
 
-    memset (buf, 0x00, sizeof(buf));
-    buf[0] = STLINK_SWIM_COMMAND;
-    buf[1] = STLINK_SWIM_READMEM;
-    //uint16 cnt
-    buf[2] = 0x00;
-    buf[3] = cnt;
-    //uint32 address
-    buf[4] = 0x00;
-    buf[5] = address>>16;
-    buf[6] = address>>8;
-    buf[7] = address;
-    usb_tx_cmd (buf);
+/* Writes cnt bytes, at most USB_TXQ_SLOT_SIZE, at address in RAM or registers
+ */
+void
+Stlink_Write_Memory (gmt_ctx *ctx, uint32_t address, const unsigned char *data,
+    uint32_t cnt)
+{
+  unsigned char buf[16];
 
-    uint32_t stat = stlink_wait_swim_idle ();
-    if (stat) {
-      printf ("Error, %s: SWIM status returned 0x%02X\n", __func__,
-          stat);
-      exit (EXIT_FAILURE);
+  memset (buf, 0x00, sizeof(buf));
+  buf[0] = STLINK_SWIM_COMMAND;
+  buf[1] = STLINK_SWIM_WRITEMEM;
+  //cnt
+  buf[2] = cnt>>8;
+  buf[3] = cnt;
+  //address
+  buf[4] = 0x00;
+  buf[5] = address>>16;
+  buf[6] = address>>8;
+  buf[7] = address;
+  memcpy (buf+8, data, (cnt < 8) ? cnt : 8);
+  usb_tx_cmd (ctx, buf);
+  if (cnt > 8)
+    usb_tx_queue (ctx, (unsigned char *)data + 8, cnt - 8);
+  usb_tx_flush (ctx);
+
+  uint32_t stat = stlink_wait_swim_idle (ctx, SWIM_OP_WRITE, cnt);
+  if (stat) {
+    fprintf (ctx->out, "Error, %s: SWIM status returned 0x%02X\n", __func__,
+        stat);
+    GMT_FAIL (ctx, GMT_ERR_SWIM);
+  }
+}
+
+/* On-target CRC.
+ * A routine loaded in RAM by Stlink_Crc_Load () computes the CRC-16/CCITT
+ * (polynomial 0x1021, initial value 0xFFFF) of the memory range given in its
+ * parameters, so a range is verified without reading it over SWIM. The CPU is
+ * started from the stall with the PC set on the routine, the host polls the
+ * done flag and stalls the CPU again. The routine uses 16-bit pointers, so the
+ * range must be below 0x10000. The CPU clock prescaler is set to 1 for the
+ * run, the µC reset at the end of the session restores it. The routine
+ * refreshes the independent watchdog for every byte, it may be started by the
+ * hardware watchdog option and would reset the µC in the middle of the run.
+ *
+ * RAM layout: 0x00 start address, 0x02 end address (not included, 0 for
+ * 0x10000), 0x04 CRC, 0x06 and 0x07 work bytes, 0x08 done flag, 0x10 code.
+ */
+#define CRC_RAM_PARAM			0x0000
+#define CRC_RAM_FLAG			0x0008
+#define CRC_RAM_CODE			0x0010
+#define CRC_DONE			0x5A
+#define CRC_TIMEOUT_US			100000	//plus CRC_BYTE_TIMEOUT_US/byte
+#define CRC_BYTE_TIMEOUT_US		60	//~100 cycles/byte at 2 MHz
+#define CRC_BYTE_US			6	//at 16 MHz
+
+#define STM8_CPU_PCE			0x7F01
+#define STM8_CPU_SPH			0x7F08
+#define STM8_CPU_CC			0x7F0A
+  #define CPU_CC_INT_OFF		0x28	//I1 I0 set, interrupts disabled
+#define STM8S_CLK_CKDIVR		0x50C6
+#define STM8L_CLK_CKDIVR		0x50C0
+#define STM8_IWDG_KR			0x50E0	//the same on STM8S and STM8L
+  #define IWDG_KEY_REFRESH		0xAA
+
+static const unsigned char crc_routine[] = {
+  0x90, 0xBE, 0x00,		//     ldw  y, 0x00      ;pointer
+  0xAE, 0xFF, 0xFF,		//     ldw  x, #0xFFFF   ;crc
+  0x35, IWDG_KEY_REFRESH, STM8_IWDG_KR>>8, STM8_IWDG_KR & 0xFF,
+				//byte:mov  IWDG_KR, #0xAA
+  0x90, 0xF6,			//     ld   a, (y)
+  0xB7, 0x06,			//     ld   0x06, a
+  0x9E,				//     ld   a, xh
+  0xB8, 0x06,			//     xor  a, 0x06
+  0x95,				//     ld   xh, a
+  0xA6, 0x08,			//     ld   a, #8
+  0xB7, 0x07,			//     ld   0x07, a
+  0x58,				//bit: sllw x
+  0x24, 0x08,			//     jrnc next
+  0x9E,				//     ld   a, xh
+  0xA8, 0x10,			//     xor  a, #0x10
+  0x95,				//     ld   xh, a
+  0x9F,				//     ld   a, xl
+  0xA8, 0x21,			//     xor  a, #0x21
+  0x97,				//     ld   xl, a
+  0x3A, 0x07,			//next:dec  0x07
+  0x26, 0xF1,			//     jrne bit
+  0x90, 0x5C,			//     incw y
+  0x90, 0xB3, 0x02,		//     cpw  y, 0x02
+  0x26, 0xDA,			//     jrne byte
+  0xBF, 0x04,			//     ldw  0x04, x
+  0xA6, CRC_DONE,		//     ld   a, #CRC_DONE
+  0xB7, CRC_RAM_FLAG,		//     ld   0x08, a
+  0x20, 0xFE,			//     jra  .
+};
+
+/* Sets the CPU clock to 16 MHz, for the RAM routines */
+static void
+stlink_cpu_clock_max (gmt_ctx *ctx)
+{
+  Stlink_Reg_Write (ctx, (ctx->prog_mode & PROG_MODE_STM8L) ?
+      STM8L_CLK_CKDIVR : STM8S_CLK_CKDIVR, 0x00);
+}
+
+/* Starts the stalled CPU at address, with the interrupts disabled */
+static void
+stlink_cpu_run (gmt_ctx *ctx, uint32_t address)
+{
+  //the flash loader sets FLASH_CR2 itself
+  stlink_reg_prog_done (ctx, 0);
+  //PC is one WRITEMEM, CC another, X, Y and SP lie between them
+  Stlink_Batch_Begin (ctx);
+  Stlink_Batch_Write (ctx, STM8_CPU_PCE, address>>16);
+  Stlink_Batch_Write (ctx, STM8_CPU_PCE + 1, (address>>8) & 0xFF);
+  Stlink_Batch_Write (ctx, STM8_CPU_PCE + 2, address & 0xFF);
+  Stlink_Batch_Write (ctx, STM8_CPU_CC, CPU_CC_INT_OFF);
+  Stlink_Batch_End (ctx);
+  //the stall is released only after the PC and CC writes are done
+  Stlink_Write_Byte (ctx, STM8_DM_CSR2, 0x00);
+}
+
+/* CRC-16/CCITT of data on the host, the same as the routine, start with 0xFFFF
+ */
+static uint32_t
+crc16_ccitt (uint32_t crc, const unsigned char *data, uint32_t size)
+{
+  while (size--) {
+    crc ^= *data++ << 8;
+    for (int i=0; i<8; i++)
+      crc = (crc & 0x8000) ? ((crc<<1) ^ 0x1021) : (crc<<1);
+  }
+  return crc & 0xFFFF;
+}
+
+/* Loads the CRC routine in RAM and sets the CPU clock to 16 MHz */
+void
+Stlink_Crc_Load (gmt_ctx *ctx)
+{
+  //the RAM is shared with the flash loader
+  Stlink_Loader_Stop (ctx);
+  Stlink_Write_Memory (ctx, CRC_RAM_CODE, crc_routine, sizeof(crc_routine));
+  stlink_cpu_clock_max (ctx);
+}
+
+/* Runs the CRC routine on size bytes from address. Returns the CRC, or -1 if
+ * the routine did not end in time, with the CPU stalled in both cases.
+ */
+int
+Stlink_Crc (gmt_ctx *ctx, uint32_t address, uint32_t size)
+{
+  unsigned char param[9];
+  uint32_t end = address + size;
+  uint64_t timeout;
+
+  memset (param, 0x00, sizeof(param));
+  param[0] = address>>8;
+  param[1] = address;
+  param[2] = end>>8;
+  param[3] = end;
+  Stlink_Write_Memory (ctx, CRC_RAM_PARAM, param, sizeof(param));
+  stlink_cpu_run (ctx, CRC_RAM_CODE);
+  timeout = time_us () + CRC_TIMEOUT_US + size*CRC_BYTE_TIMEOUT_US;
+  usleep (size*CRC_BYTE_US);
+  while (Stlink_Read_Byte (ctx, CRC_RAM_FLAG) != CRC_DONE) {
+    if (time_us () > timeout) {
+      Stlink_Write_Byte (ctx, STM8_DM_CSR2, 0x08);
+      return -1;
     }
+    usleep (1000);
+  }
+  Stlink_Write_Byte (ctx, STM8_DM_CSR2, 0x08);
 
-    Stlink_Swim_Cmd (STLINK_SWIM_READBUF);
-    usb_rx (data + i, cnt);
+  return Stlink_Read_Word (ctx, CRC_RAM_PARAM + 4);
+}
 
-    address += cnt;
-    size -= cnt;
-    i += cnt;
+/* Double buffered RAM flash loader, for PROG_MODE_LOADER.
+ * A routine in RAM programms the blocks that the host writes in two RAM
+ * buffers, so while the µC programms a block from one buffer the host sends the
+ * next block in the other one, and the SWIM transfer time is hidden behind the
+ * programming time. Each buffer has a descriptor: the block address, the CR2
+ * value of the block operation and a state byte, written last by the host with
+ * LOADER_FULL and set by the routine to the IAPSR value, ORed with LOADER_DONE,
+ * when the block is programmed. The
+ * routine uses 16-bit pointers, so only blocks below 0x10000 go through it.
+ * The loader starts with the first block and runs until Stlink_Loader_Stop (),
+ * that must be called before any other programming or IAPSR read, as the
+ * routine owns the flash control registers meanwhile. It refreshes the
+ * independent watchdog while it waits for a block or for the programming.
+ *
+ * RAM layout: 0x00 and 0x04 descriptors (address, CR2, state), 0x10 code, 0x7F
+ * stack top, 0x80 the two buffers.
+ */
+#define LOADER_RAM_DESC			0x0000
+#define LOADER_RAM_CODE			0x0010
+#define LOADER_RAM_STACK		0x007F
+#define LOADER_RAM_BUF			0x0080
+#define LOADER_FULL			0x01
+#define LOADER_DONE			0x80
+
+//offsets of the µC dependent values in loader_routine[]
+#define LDR_CR2				0x12	//CR2 address
+#define LDR_NCR2			0x14	//cpl and NCR2 store, 4 bytes
+#define LDR_MASK			0x22	//block size - 1
+#define LDR_IAPSR			0x2B	//IAPSR address
+
+static const unsigned char loader_routine[] = {
+  0x5F,				//next:clrw x            ;descriptor
+  0x90, 0xAE, LOADER_RAM_BUF>>8, LOADER_RAM_BUF & 0xFF,
+				//     ldw  y, #BUF
+  0x35, IWDG_KEY_REFRESH, STM8_IWDG_KR>>8, STM8_IWDG_KR & 0xFF,
+				//wait:mov  IWDG_KR, #0xAA
+  0xE6, 0x03,			//     ld   a, (3,x)     ;state
+  0xA1, LOADER_FULL,		//     cp   a, #LOADER_FULL
+  0x26, 0xF6,			//     jrne wait
+  0xE6, 0x02,			//     ld   a, (2,x)     ;CR2 value
+  0xC7, 0x50, 0x5B,		//     ld   CR2, a
+  0x43,				//     cpl  a
+  0xC7, 0x50, 0x5C,		//     ld   NCR2, a
+  0x89,				//     pushw x
+  0xFE,				//     ldw  x, (x)       ;block address
+  0x90, 0xF6,			//copy:ld   a, (y)
+  0xF7,				//     ld   (x), a
+  0x5C,				//     incw x
+  0x90, 0x5C,			//     incw y
+  0x9F,				//     ld   a, xl
+  0xA4, 0x7F,			//     and  a, #MASK
+  0x26, 0xF5,			//     jrne copy
+  0x85,				//     popw x
+  0x35, IWDG_KEY_REFRESH, STM8_IWDG_KR>>8, STM8_IWDG_KR & 0xFF,
+				//eop: mov  IWDG_KR, #0xAA
+  0xC6, 0x50, 0x5F,		//     ld   a, IAPSR
+  0xA5, 0x05,			//     bcp  a, #0x05     ;EOP or WR_PG_DIS
+  0x27, 0xF5,			//     jreq eop
+  0xAA, LOADER_DONE,		//     or   a, #LOADER_DONE
+  0xE7, 0x03,			//     ld   (3,x), a
+  0x9F,				//     ld   a, xl        ;other descriptor
+  0xA8, 0x04,			//     xor  a, #0x04
+  0x97,				//     ld   xl, a
+  0x5D,				//     tnzw x
+  0x26, 0xC9,			//     jrne wait         ;y is on buffer 1
+  0x20, 0xC2,			//     jra  next
+};
+
+/* Waits until the block in buffer b, if any, is programmed */
+static void
+loader_wait (gmt_ctx *ctx, int b)
+{
+  //the block may wait for the one in the other buffer
+  uint64_t timeout = time_us () + 2*PROG_TIMEOUT_US;
+  uint32_t add = ctx->ldr_add[b];
+  uint32_t q;
+
+  if (!add)
+    return;
+  while ( (q = Stlink_Read_Byte (ctx, LOADER_RAM_DESC + 4*b + 3))
+      == LOADER_FULL ) {
+    if (time_us () > timeout) {
+      q = 0;
+      break;
+    }
   }
+  ctx->ldr_add[b] = 0;
+  if (q & 0x04) {
+    Shadow_Update (ctx, add, ctx->ldr_data[b], ctx->uc.block_size);
+    return;
+  }
+
+  Stlink_Write_Byte (ctx, STM8_DM_CSR2, 0x08);
+  ctx->ldr_run = 0;
+  fprintf (ctx->out, "block programming error, address=0x%04X%s\n", add,
+      (q & 0x01) ? ", write protected" : "");
+  GMT_FAIL (ctx, GMT_ERR_PROG);
+}
+
+/* Loads the loader routine in RAM and starts the CPU on it */
+static void
+loader_start (gmt_ctx *ctx)
+{
+  unsigned char code[sizeof(loader_routine)];
+  unsigned char desc[8];
+  unsigned char sp[2] = {LOADER_RAM_STACK>>8, LOADER_RAM_STACK & 0xFF};
+
+  memcpy (code, loader_routine, sizeof(code));
+  code[LDR_MASK] = ctx->uc.block_size - 1;
+  if (ctx->prog_mode & PROG_MODE_STM8L) {
+    //no NCR2
+    code[LDR_CR2 + 1] = 0x51;
+    memset (code + LDR_NCR2, 0x9D, 4);	//nop
+    code[LDR_IAPSR + 1] = 0x54;
+  }
+  memset (desc, 0x00, sizeof(desc));
+  Stlink_Write_Memory (ctx, LOADER_RAM_DESC, desc, sizeof(desc));
+  Stlink_Write_Memory (ctx, LOADER_RAM_CODE, code, sizeof(code));
+  Stlink_Write_Memory (ctx, STM8_CPU_SPH, sp, sizeof(sp));
+  stlink_cpu_clock_max (ctx);
+  stlink_cpu_run (ctx, LOADER_RAM_CODE);
+
+  ctx->ldr_run = 1;
+  ctx->ldr_next = 0;
+  ctx->ldr_add[0] = ctx->ldr_add[1] = 0;
+  PRINT_IF_VERBOSE ("\n...RAM flash loader started\n");
+}
+
+/* Queues a block for the RAM loader, that is started if needed, cr2 selects
+ * the standard or fast programming. Returns when the block is in RAM, the
+ * programming errors are reported by the next calls.
+ */
+void
+Stlink_Loader_Block (gmt_ctx *ctx, uint32_t blk_add, uint32_t blk_size,
+    unsigned char *blk_data, uint32_t cr2)
+{
+  int b;
+  unsigned char desc[4] = {blk_add>>8, blk_add, cr2, LOADER_FULL};
+
+  if (!ctx->ldr_run)
+    loader_start (ctx);
+  b = ctx->ldr_next;
+  loader_wait (ctx, b);
+  Stlink_Write_Memory (ctx, LOADER_RAM_BUF + b*blk_size, blk_data, blk_size);
+  Stlink_Write_Memory (ctx, LOADER_RAM_DESC + 4*b, desc, sizeof(desc));
+  memcpy (ctx->ldr_data[b], blk_data, blk_size);
+  ctx->ldr_add[b] = blk_add;
+  ctx->ldr_next = b ^ 1;
+}
+
+/* Waits for the queued blocks and stalls the CPU, if the loader runs */
+void
+Stlink_Loader_Stop (gmt_ctx *ctx)
+{
+  if (!ctx->ldr_run)
+    return;
+  //the oldest block first
+  loader_wait (ctx, ctx->ldr_next);
+  loader_wait (ctx, ctx->ldr_next ^ 1);
+  Stlink_Write_Byte (ctx, STM8_DM_CSR2, 0x08);
+  ctx->ldr_run = 0;
 }
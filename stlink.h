@@ -20,6 +20,10 @@
 #define STLINK_USB_VENDOR_ID		0x0483
 #define STLINK_USB_PRODUCT_ID		0x3748
 
+/* Size of the STLinkV2 SWIM data buffer, the largest READMEM/READBUF transfer
+ */
+#define STLINK_SWIM_BUF_SIZE		6144
+
 enum stlink_commands {
   STLINK_GET_VERSION	    = 0xF1,    //(null) -> x6
   STLINK_DEBUG_COMMAND      = 0xF2,
@@ -56,6 +60,19 @@ enum stlink_swim_commands {
 
 #define STLINK_DFU_EXIT			0x07
 
+#define STM8_SWIM_CSR			0x7F80
+  #define SWIM_CSR_SAFE_MASK		0x80
+  #define SWIM_CSR_NO_ACCESS		0x40
+  #define SWIM_CSR_SWIM_DM		0x20
+  #define SWIM_CSR_HS			0x10
+  #define SWIM_CSR_OSCOFF		0x08
+  #define SWIM_CSR_RST			0x04
+  #define SWIM_CSR_HSIT			0x02
+  #define SWIM_CSR_PRI			0x01
+  //value written at SWIM activation: 0xA5
+  #define SWIM_CSR_INIT	(SWIM_CSR_SAFE_MASK | SWIM_CSR_SWIM_DM | SWIM_CSR_RST \
+      | SWIM_CSR_PRI)
+
 #define STM8_DM_CR1			0x7F96
 #define STM8_DM_CR2			0x7F97
 #define STM8_DM_CSR1			0x7F98
@@ -117,23 +134,127 @@ enum stlink_debug_commands {
     STLINK_APIV3_GET_VERSION_EX          = 0xFB
 };
 
-/*  Globals */
-libusb_device_handle *gdev_handle;
-libusb_context       *gusbcontext;
+/* Asynchronous transmit queue, see stlink.c */
+#define USB_TXQ_DEPTH			8
+#define USB_TXQ_SLOT_SIZE		256
+
+/* Largest block handled by the RAM flash loader */
+#define LOADER_BLOCK_MAX		128
+
+typedef struct {
+  struct libusb_transfer *xfer;
+  gmt_ctx                *ctx;
+  unsigned char           buf[USB_TXQ_SLOT_SIZE];
+  int                     busy;
+} usb_txq_slot;
+
+/* Micro-batch of SWIM writes, see stlink.c */
+#define SWIM_BATCH_CMDS			8
+#define SWIM_BATCH_DATA			8	//bytes per WRITEMEM, in the command
+
+typedef struct {
+  int           active;
+  int           cnt;
+  uint32_t      add[SWIM_BATCH_CMDS];
+  int           len[SWIM_BATCH_CMDS];
+  unsigned char data[SWIM_BATCH_CMDS][SWIM_BATCH_DATA];
+} swim_batch;
+
+/* Known values of µC registers, see stlink.c */
+#define REG_SHADOW_MAX			8
+
+typedef struct {
+  int           cnt;
+  uint32_t      add[REG_SHADOW_MAX];
+  unsigned char val[REG_SHADOW_MAX];
+  uint32_t      skipped;	//writes not done, the value was already set
+} reg_shadow;
+
+/* SWIM status poll and programming time statistics, kept per context */
+enum swim_op {
+  SWIM_OP_CMD,		//NRES, ENTER_SEQ, RESET, GEN_RST
+  SWIM_OP_WRITE,
+  SWIM_OP_READ,		//register reads, up to 4 bytes
+  SWIM_OP_READ_MEM,	//memory block reads
+  SWIM_OP_CNT
+};
+
+typedef struct {
+  uint32_t    calls;
+  uint32_t    polls;
+  uint64_t    total_us;
+  uint32_t    max_us;
+  uint32_t    expect_us;	//learned latency, per op or per byte
+} swim_op_stat;
+
+enum prog_op {
+  PROG_OP_BYTE,
+  PROG_OP_OPT,
+  PROG_OP_WORD,
+  PROG_OP_BLOCK,		//standard, erase and write
+  PROG_OP_FAST,		//fast, write of an erased block
+  PROG_OP_ERASE,	//block erase only
+  PROG_OP_CNT
+};
+
+/* Block write plan, see Stlink_Plan_Block () */
+enum blk_how {
+  BLK_SKIP,		//same data in the µC
+  BLK_DWORDS,		//dword writes of the differing words
+  BLK_WRITE		//full block write with op
+};
+
+typedef struct {
+  int         how;
+  int         op;		//PROG_OP_BLOCK, PROG_OP_FAST or PROG_OP_ERASE
+  uint32_t    dwords;		//number of differing 4-byte words
+  uint32_t    cost_us;		//estimated time
+} blk_plan;
+
+typedef struct {
+  uint32_t    calls;
+  uint64_t    total_us;
+  uint32_t    max_us;
+  uint32_t    expect_us;
+} prog_op_stat;
 
 /*  Functions */
-void Stlink_Usb_Init (void);
-void Stlink_Open (void);
-void Stlink_Swim_Cmd (uint32_t cmd);
-void Stlink_Write_Byte (uint32_t address, uint32_t byte);
-void Stlink_Write_Word (uint32_t address, uint32_t word);
-uint32_t Stlink_Get_Mode (void);
-uint32_t Stlink_Get_Swim_Status (void);
-uint32_t Stlink_Read_Byte (uint32_t address);
-uint32_t Stlink_Read_Word (uint32_t address);
-void Stlink_Prog_Byte (uint32_t address, uint32_t byte);
-void Stlink_Prog_Dword (uint32_t address, uint32_t dword);
-int  Stlink_Prog_Block (uint32_t blk_add, uint32_t blk_size,
-    unsigned char *blk_data, unsigned char *blk_def);
-void Stlink_Read_Memory (uint32_t address, uint32_t size, FILE *file);
-void Stlink_Read_Block (uint32_t address, uint32_t size, unsigned char *data);
+int  Stlink_Usb_List (char (*serials)[32], int max);
+void Stlink_Usb_Init (gmt_ctx *ctx);
+void Stlink_Usb_Close (gmt_ctx *ctx);
+void Stlink_Open (gmt_ctx *ctx);
+void Stlink_Swim_Resume (gmt_ctx *ctx);
+void Stlink_Swim_Cmd (gmt_ctx *ctx, uint32_t cmd);
+void Stlink_Write_Byte (gmt_ctx *ctx, uint32_t address, uint32_t byte);
+void Stlink_Write_Word (gmt_ctx *ctx, uint32_t address, uint32_t word);
+void Stlink_Batch_Begin (gmt_ctx *ctx);
+void Stlink_Batch_Write (gmt_ctx *ctx, uint32_t address, uint32_t byte);
+void Stlink_Batch_End (gmt_ctx *ctx);
+void Stlink_Reg_Write (gmt_ctx *ctx, uint32_t address, uint32_t byte);
+void Stlink_Reg_Forget (gmt_ctx *ctx);
+uint32_t Stlink_Get_Mode (gmt_ctx *ctx);
+uint32_t Stlink_Get_Swim_Status (gmt_ctx *ctx);
+uint32_t Stlink_Read_Byte (gmt_ctx *ctx, uint32_t address);
+uint32_t Stlink_Read_Word (gmt_ctx *ctx, uint32_t address);
+void Stlink_Prog_Byte (gmt_ctx *ctx, uint32_t address, uint32_t byte);
+void Stlink_Prog_Dword (gmt_ctx *ctx, uint32_t address, uint32_t dword);
+int  Stlink_Prog_Block (gmt_ctx *ctx, uint32_t blk_add, uint32_t blk_size,
+    unsigned char *blk_data, uint32_t *blk_def, unsigned char *ucblock,
+    uint32_t dirty);
+void Stlink_Plan_Block (gmt_ctx *ctx, uint32_t blk_add, uint32_t blk_size,
+    unsigned char *blk_data, uint32_t *blk_def, unsigned char *ucblock,
+    uint32_t dirty, blk_plan *plan);
+uint32_t Stlink_Cost_Us (gmt_ctx *ctx, uint32_t address, uint32_t size, int op);
+void Stlink_Load_Timings (gmt_ctx *ctx);
+void Stlink_Save_Timings (gmt_ctx *ctx);
+void Stlink_Read_Memory (gmt_ctx *ctx, uint32_t address, uint32_t size);
+void Stlink_Read_Block (gmt_ctx *ctx, uint32_t address, uint32_t size,
+    unsigned char *data);
+void Stlink_Print_Timings (gmt_ctx *ctx, const char *mcu_name);
+void Stlink_Write_Memory (gmt_ctx *ctx, uint32_t address,
+    const unsigned char *data, uint32_t cnt);
+void Stlink_Crc_Load (gmt_ctx *ctx);
+int  Stlink_Crc (gmt_ctx *ctx, uint32_t address, uint32_t size);
+void Stlink_Loader_Block (gmt_ctx *ctx, uint32_t blk_add, uint32_t blk_size,
+    unsigned char *blk_data, uint32_t cr2);
+void Stlink_Loader_Stop (gmt_ctx *ctx);
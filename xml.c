@@ -3,14 +3,14 @@
  * in case of error and prints the error message
  */
 static int
-get_xml_node_val (xmlNode *node)
+get_xml_node_val (gmt_ctx *ctx, xmlNode *node)
 {
   int val, k;
   char c;
 
   xmlChar *xmlcontent = xmlNodeGetContent (node);
   if (!xmlcontent) {
-    printf ("%s:%s:%i: xmlNodeGetContent()= NULL\n", __FILE__,
+    fprintf (ctx->out, "%s:%s:%i: xmlNodeGetContent()= NULL\n", __FILE__,
         __func__, __LINE__);
     return -1;
   }
@@ -24,7 +24,7 @@ get_xml_node_val (xmlNode *node)
     else if (c=='k')
       val *= 1000;
   } else {
-    printf ("%s:%s:%d: error in gmtflasher_devices.xml:%d, "
+    fprintf (ctx->out, "%s:%s:%d: error in gmtflasher_devices.xml:%d, "
           "cannot get value \"%s\"\n",
           __FILE__, __func__, __LINE__, node->line, xmlcontent);
     val = -1;
@@ -40,11 +40,11 @@ get_xml_node_val (xmlNode *node)
  * errror prints the error message and returns -1
  */
 static int
-set_device_type (xmlNode *node, mcu *uc)
+set_device_type (gmt_ctx *ctx, xmlNode *node, mcu *uc)
 {
   xmlChar *xmlcontent = xmlNodeGetContent (node);
   if (!xmlcontent) {
-    printf ("%s:%s:%i: xmlNodeGetContent()= NULL\n", __FILE__,
+    fprintf (ctx->out, "%s:%s:%i: xmlNodeGetContent()= NULL\n", __FILE__,
         __func__, __LINE__);
     return -1;
   }
@@ -52,12 +52,12 @@ set_device_type (xmlNode *node, mcu *uc)
   if (   !xmlStrcasecmp(xmlcontent, (const xmlChar *) "STM8L")
       || !xmlStrcasecmp(xmlcontent, (const xmlChar *) "STM8AL")
       || !xmlStrcasecmp(xmlcontent, (const xmlChar *) "STM8TL") ) {
-    prog_mode |= PROG_MODE_STM8L;
+    ctx->prog_mode |= PROG_MODE_STM8L;
   } else if ( !xmlStrcasecmp(xmlcontent, (const xmlChar *) "STM8S")
       || !xmlStrcasecmp(xmlcontent, (const xmlChar *) "STM8AF") ) {
-    prog_mode &= ~PROG_MODE_STM8L;
+    ctx->prog_mode &= ~PROG_MODE_STM8L;
   } else {
-    printf ("%s:%s:%d: error in gmtflasher_devices.xml:%d, "
+    fprintf (ctx->out, "%s:%s:%d: error in gmtflasher_devices.xml:%d, "
         "unknown device type \"%s\"\n",
         __FILE__, __func__, __LINE__, node->line, xmlcontent);
     xmlFree (xmlcontent);
@@ -70,28 +70,31 @@ set_device_type (xmlNode *node, mcu *uc)
 
 /* The function searches uc->name in the xml file, and fetches the data for it
  * from the file. If the mcu is not found or any other data is not identified it
- * returns -1, otherwise 0, and the 5 mcu constants are filled in: flash_add,
- * flash_size, eeprom_add, eeprom_size, block_size.
+ * fails with GMT_ERR_MCU or GMT_ERR_XML, otherwise the 5 mcu constants are
+ * filled in: flash_add, flash_size, eeprom_add, eeprom_size, block_size.
  */
 void
-Get_Xml_Mcu_Data (mcu *uc)
+Get_Xml_Mcu_Data (gmt_ctx *ctx, mcu *uc)
 {
   xmlDoc    *xml_dev_list;
   xmlNode   *element;
   int      k, q;
+  int      err = GMT_ERR_XML;
 
   xml_dev_list = xmlParseFile("/usr/share/gmtflasher/gmtflasher_devices.xml");
   if (!xml_dev_list)
-    exit (EXIT_FAILURE);
+    GMT_FAIL (ctx, GMT_ERR_XML);
 
   element = xmlDocGetRootElement (xml_dev_list);
   if (!element) {
-    printf ("Error in gmtflasher_devices.xml, could not get root element\n");
+    fprintf (ctx->out,
+        "Error in gmtflasher_devices.xml, could not get root element\n");
     goto ret_err;
   }
 
   if (xmlStrcmp(element->name, (const xmlChar *) "Gmt_Flasher_Data")) {
-    printf ("Error in gmtflasher_devices.xml, unknown root element\n");
+    fprintf (ctx->out,
+        "Error in gmtflasher_devices.xml, unknown root element\n");
     goto ret_err;
   }
 
@@ -102,7 +105,8 @@ Get_Xml_Mcu_Data (mcu *uc)
     element = element->next;
   }
   if (!element) {
-    printf ("Error in gmtflasher_devices.xml, missing Devices node\n");
+    fprintf (ctx->out,
+        "Error in gmtflasher_devices.xml, missing Devices node\n");
     goto ret_err;
   }
 
@@ -115,30 +119,30 @@ Get_Xml_Mcu_Data (mcu *uc)
       xmlNode *mcu_node = element->children;
       while (mcu_node) {
         if (!xmlStrcmp(mcu_node->name, (const xmlChar *) "Device_Type")) {
-	  q = set_device_type (mcu_node, uc);
+	  q = set_device_type (ctx, mcu_node, uc);
           if (q==-1)
             goto ret_err;
           k |= 0x01;
         } else if (!xmlStrcmp(mcu_node->name, (const xmlChar *) "Flash_Size")) {
-          q = get_xml_node_val (mcu_node);
+          q = get_xml_node_val (ctx, mcu_node);
           if (q==-1)
             goto ret_err;
           uc->flash_size = q;
           k |= 0x02;
         } else if (!xmlStrcmp(mcu_node->name, (const xmlChar *) "Block_Size")) {
-          q = get_xml_node_val (mcu_node);
+          q = get_xml_node_val (ctx, mcu_node);
           if (q==-1)
             goto ret_err;
           uc->block_size = q;
           k |= 0x04;
         } else if (!xmlStrcmp(mcu_node->name, (const xmlChar *) "Eeprom_Size")) {
-          q = get_xml_node_val (mcu_node);
+          q = get_xml_node_val (ctx, mcu_node);
           if (q==-1)
             goto ret_err;
           uc->eeprom_size = q;
           k |= 0x08;
         } else if (!xmlStrcmp(mcu_node->name, (const xmlChar *) "Eeprom_Add")) {
-          q = get_xml_node_val (mcu_node);
+          q = get_xml_node_val (ctx, mcu_node);
           if (q==-1)
             goto ret_err;
           uc->eeprom_add = q;
@@ -153,50 +157,52 @@ Get_Xml_Mcu_Data (mcu *uc)
 
   //check if we reached the list end without finding the mcu name
   if (!element) {
-    printf ("µC \"%s\" not supported\n", uc->name);
+    fprintf (ctx->out, "µC \"%s\" not supported\n", uc->name);
+    err = GMT_ERR_MCU;
     goto ret_err;
   }
 
   //check if all data was identified
   if (k != 0x1F) {
-    printf ("Error in gmtflasher_devices.xml, could not read all "
+    fprintf (ctx->out, "Error in gmtflasher_devices.xml, could not read all "
         "MCU data\n");
     goto ret_err;
   }
 
-  free (xml_dev_list);
+  xmlFreeDoc (xml_dev_list);
   return;
 
 ret_err:
-  free (xml_dev_list);
-  exit (EXIT_FAILURE);
+  xmlFreeDoc (xml_dev_list);
+  GMT_FAIL (ctx, err);
 }
 
 /* Lists all devices from the gmtflasher_devices.xml file
  */
 void
-List_Devices (void)
+List_Devices (gmt_ctx *ctx)
 {
   xmlDoc  *xml_dev_list;
   xmlNode *element;
 
   xml_dev_list = xmlParseFile ("/usr/share/gmtflasher/gmtflasher_devices.xml");
   if (!xml_dev_list)
-    exit (EXIT_FAILURE);
+    GMT_FAIL (ctx, GMT_ERR_XML);
 
 
   element = xmlDocGetRootElement (xml_dev_list);
   if (!element) {
-    printf ("Error in gmtflasher_devices.xml, could not get root "
+    fprintf (ctx->out, "Error in gmtflasher_devices.xml, could not get root "
         "element\n");
-    free (xml_dev_list);
-    exit (EXIT_FAILURE);
+    xmlFreeDoc (xml_dev_list);
+    GMT_FAIL (ctx, GMT_ERR_XML);
   }
 
   if ( xmlStrcmp(element->name, (const xmlChar *) "Gmt_Flasher_Data") ) {
-    printf ("Error in gmtflasher_devices.xml, unknown root element\n");
-    free (xml_dev_list);
-    exit (EXIT_FAILURE);
+    fprintf (ctx->out,
+        "Error in gmtflasher_devices.xml, unknown root element\n");
+    xmlFreeDoc (xml_dev_list);
+    GMT_FAIL (ctx, GMT_ERR_XML);
   }
 
   element = element->children;
@@ -206,28 +212,29 @@ List_Devices (void)
     element = element->next;
   }
   if (!element) {
-    printf ("Error in gmtflasher_devices.xml, missing Devices node\n");
-    free (xml_dev_list);
-    exit (EXIT_FAILURE);
+    fprintf (ctx->out,
+        "Error in gmtflasher_devices.xml, missing Devices node\n");
+    xmlFreeDoc (xml_dev_list);
+    GMT_FAIL (ctx, GMT_ERR_XML);
   }
 
   element = element->children;
   int i = 0;
   while (element) {
     if (element->type == XML_ELEMENT_NODE) {
-      printf ("%s, ", (char *) element->name);
+      fprintf (ctx->out, "%s, ", (char *) element->name);
       i++;
       if (i==5) {
         i = 0;
-        printf("\n");
+        fprintf (ctx->out, "\n");
       }
     }
     element = element->next;
   }
 
   if (i)
-    printf ("\n");
+    fprintf (ctx->out, "\n");
 
-  free (xml_dev_list);
+  xmlFreeDoc (xml_dev_list);
   return;
 }